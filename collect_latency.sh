@@ -5,10 +5,19 @@ CPU_NAME=`cat /proc/cpuinfo |grep "model name" |uniq |sed s/"^.*: "//`
 
 [ -e $VMLATENCY ] || { echo "$VMLATENCY does not exist" ; exit 1 ; }
 
-for i in $(seq 1 20)
-do
-    insmod $VMLATENCY
-    rmmod $VMLATENCY
-done
+run() {
+    echo "$1" > /dev/vmlatency
+    cat /dev/vmlatency
+}
 
-dmesg | grep "\[vmlatency\]" | sed s/^"\[ *"[0-9]*\.[0-9]*"\] "// |sed s/"\[vmlatency\] "// > "$CPU_NAME".txt
+insmod $VMLATENCY
+
+{
+    run info
+    for i in $(seq 1 20)
+    do
+        run batches
+    done
+} | sed s/"\[vmlatency\] "// > "$CPU_NAME".txt
+
+rmmod $VMLATENCY
@@ -9,10 +9,6 @@ if [[ "$OSTYPE" == "linux-gnu" ]]; then
     VMLATENCY=vmlatency.ko
     CPU_NAME=`cat /proc/cpuinfo |grep "model name" |uniq |sed s/"^.*: "//`
 
-    function getlog {
-        dmesg
-    }
-
     function build {
         make clean
         make
@@ -25,6 +21,26 @@ if [[ "$OSTYPE" == "linux-gnu" ]]; then
     function unload {
         $SUDO /sbin/rmmod $VMLATENCY
     }
+
+    # Module stays loaded, measurements are requested through the device
+    function run {
+        echo "$1" | $SUDO tee /dev/vmlatency > /dev/null
+        $SUDO cat /dev/vmlatency
+    }
+
+    function collect {
+        load $VMLATENCY
+        run info
+        for i in $(seq 1 20)
+        do
+            run batches
+        done
+        unload $VMLATENCY
+    }
+
+    function filter {
+        sed s/"\[vmlatency\] "//
+    }
 elif [[ "$OSTYPE" == "darwin"* ]]; then
     VMLATENCY=build/Release/vmlatency.kext
     CPU_NAME=`sysctl -n machdep.cpu.brand_string`
@@ -45,6 +61,19 @@ elif [[ "$OSTYPE" == "darwin"* ]]; then
     function unload {
         $SUDO kextunload /tmp/vmlatency.kext
     }
+
+    function collect {
+        for i in $(seq 1 20)
+        do
+            load $VMLATENCY
+            unload $VMLATENCY
+        done
+        getlog
+    }
+
+    function filter {
+        grep "\[vmlatency\]" | sed s/^"\[ *"[0-9]*\.[0-9]*"\] "// |sed s/"\[vmlatency\] "//
+    }
 else
     echo "Unsupported OSTYPE $OSTYPE"
     exit 1
@@ -54,10 +83,4 @@ build
 
 [ -e $VMLATENCY ] || { echo "$VMLATENCY does not exist" ; exit 1 ; }
 
-for i in $(seq 1 20)
-do
-    load $VMLATENCY
-    unload $VMLATENCY
-done
-
-getlog | grep "\[vmlatency\]" | sed s/^"\[ *"[0-9]*\.[0-9]*"\] "// |sed s/"\[vmlatency\] "// > "$CPU_NAME".txt
+collect | filter > "$CPU_NAME".txt
@@ -18,9 +18,20 @@
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
+#include <linux/stop_machine.h>
+#include <linux/ktime.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+#include <asm/hardirq.h>
 #include <asm/io.h>
+#include <asm/irq_vectors.h>
 
 #include "api.h"
+#include "control.h"
 
 int
 allocate_vmpage(vmpage_t *p)
@@ -44,15 +55,45 @@ free_vmpage(vmpage_t *p)
         p->pa = 0;
 }
 
+void *
+vmlatency_malloc(size_t size)
+{
+        return vzalloc(size);
+}
+
+void
+vmlatency_free(void *p, size_t size)
+{
+        vfree(p);
+}
+
+void *
+vmlatency_malloc_user(size_t size)
+{
+        return vmalloc_user(size);
+}
+
 void
 vmlatency_printm(const char *fmt, ...)
 {
         va_list va;
         va_start(va, fmt);
-        vprintk(fmt, va);
+        if (!vmlatency_control_capture(fmt, va))
+                vprintk(fmt, va);
         va_end(va);
 }
 
+int
+vmlatency_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+        int ret;
+        va_list va;
+        va_start(va, fmt);
+        ret = vsnprintf(buf, size, fmt, va);
+        va_end(va);
+        return ret;
+}
+
 void
 vmlatency_preempt_disable(unsigned long *irq_flags)
 {
@@ -66,3 +107,87 @@ vmlatency_preempt_enable(unsigned long *irq_flags)
         local_irq_restore(*irq_flags);
         preempt_enable();
 }
+
+int
+vmlatency_cpu_count(void)
+{
+        return nr_cpu_ids;
+}
+
+bool
+vmlatency_cpu_online(int cpu)
+{
+        return cpu_online(cpu);
+}
+
+int
+vmlatency_cpu_id(void)
+{
+        return raw_smp_processor_id();
+}
+
+int
+vmlatency_cpu_node(int cpu)
+{
+        return cpu_to_node(cpu);
+}
+
+typedef struct {
+        int (*fn)(void *arg);
+        void *arg;
+} cpu_work_t;
+
+static long
+cpu_work(void *arg)
+{
+        cpu_work_t *w = arg;
+        return w->fn(w->arg);
+}
+
+int
+vmlatency_run_on_cpu(int cpu, int (*fn)(void *arg), void *arg)
+{
+        cpu_work_t w = { fn, arg };
+        return work_on_cpu(cpu, cpu_work, &w);
+}
+
+int
+vmlatency_run_on_all_cpus(int (*fn)(void *arg), void *arg)
+{
+        return stop_machine(fn, arg, cpu_online_mask);
+}
+
+void
+vmlatency_yield(void)
+{
+        cond_resched();
+}
+
+/* Reschedule IPI with nothing to do only marks the CPU for a scheduler check,
+ * which is what the kernel does itself on spurious wakeups */
+int
+vmlatency_ipi_vector(void)
+{
+        return RESCHEDULE_VECTOR;
+}
+
+void
+vmlatency_irq_window(void)
+{
+        local_irq_enable();
+        /* STI blocks interrupts until the next instruction completes */
+        cpu_relax();
+        local_irq_disable();
+}
+
+u64
+vmlatency_time_ns(void)
+{
+        return ktime_get_ns();
+}
+
+u64
+vmlatency_nmi_count(void)
+{
+        return this_cpu_read(irq_stat.__nmi_count);
+}
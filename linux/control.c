@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "control.h"
+#include "ring.h"
+#include "vmx.h"
+
+#define CONTROL_COMMAND_SIZE 256
+#define CONTROL_OUTPUT_SIZE (1 << 20)
+#define CONTROL_TRUNCATED "[vmlatency] output truncated\n"
+
+/* Serializes commands, the output buffer keeps result of the last one */
+static DEFINE_MUTEX(control_mutex);
+
+/* Protects output while a command is running, printing may happen on any
+ * CPU with interrupts disabled */
+static DEFINE_SPINLOCK(output_lock);
+static char *output;
+static size_t output_len;
+static bool capturing;
+static bool truncated;
+
+bool
+vmlatency_control_capture(const char *fmt, va_list va)
+{
+        unsigned long flags;
+        size_t room;
+        int len;
+
+        spin_lock_irqsave(&output_lock, flags);
+        if (!capturing) {
+                spin_unlock_irqrestore(&output_lock, flags);
+                return false;
+        }
+
+        room = CONTROL_OUTPUT_SIZE - sizeof(CONTROL_TRUNCATED) - output_len;
+        len = vsnprintf(output + output_len, room, fmt, va);
+        if (len >= room) {
+                /* Drop partial message */
+                output[output_len] = '\0';
+                truncated = true;
+        } else {
+                output_len += len;
+        }
+        spin_unlock_irqrestore(&output_lock, flags);
+        return true;
+}
+
+static void
+set_capturing(bool on)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&output_lock, flags);
+        if (on) {
+                output_len = 0;
+                truncated = false;
+        } else if (truncated) {
+                memcpy(output + output_len, CONTROL_TRUNCATED,
+                       sizeof(CONTROL_TRUNCATED));
+                output_len += sizeof(CONTROL_TRUNCATED) - 1;
+        }
+        capturing = on;
+        spin_unlock_irqrestore(&output_lock, flags);
+}
+
+static ssize_t
+control_write(struct file *file, const char __user *buf, size_t count,
+              loff_t *ppos)
+{
+        char cmd[CONTROL_COMMAND_SIZE];
+        int ret;
+
+        if (count >= sizeof(cmd))
+                return -EINVAL;
+        if (copy_from_user(cmd, buf, count))
+                return -EFAULT;
+        cmd[count] = '\0';
+
+        if (mutex_lock_interruptible(&control_mutex))
+                return -ERESTARTSYS;
+
+        set_capturing(true);
+        ret = vmlatency_command(cmd);
+        set_capturing(false);
+
+        mutex_unlock(&control_mutex);
+        return ret < 0 ? -EINVAL : count;
+}
+
+static ssize_t
+control_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+        ssize_t ret;
+
+        if (mutex_lock_interruptible(&control_mutex))
+                return -ERESTARTSYS;
+        ret = simple_read_from_buffer(buf, count, ppos, output, output_len);
+        mutex_unlock(&control_mutex);
+        return ret;
+}
+
+/* Page offset selects the CPU: ring of CPU n is mapped at offset
+ * n * SAMPLE_RING_MAP_SIZE */
+#define SAMPLE_RING_MAP_SIZE PAGE_ALIGN(SAMPLE_RING_SIZE)
+
+static int
+control_mmap(struct file *file, struct vm_area_struct *vma)
+{
+        unsigned long pages = SAMPLE_RING_MAP_SIZE >> PAGE_SHIFT;
+        sample_ring_header_t *ring;
+        unsigned long cpu;
+        int ret;
+
+        if (vma->vm_pgoff % pages)
+                return -EINVAL;
+        if (vma->vm_end - vma->vm_start > SAMPLE_RING_MAP_SIZE)
+                return -EINVAL;
+
+        cpu = vma->vm_pgoff / pages;
+        if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+                return -ENODEV;
+
+        if (mutex_lock_interruptible(&control_mutex))
+                return -ERESTARTSYS;
+
+        ring = sample_ring_get(cpu);
+        ret = ring ? remap_vmalloc_range(vma, ring, 0) : -ENOMEM;
+
+        mutex_unlock(&control_mutex);
+        return ret;
+}
+
+static const struct file_operations control_fops = {
+        .owner = THIS_MODULE,
+        .read = control_read,
+        .write = control_write,
+        .mmap = control_mmap,
+        .llseek = default_llseek,
+};
+
+static struct miscdevice control_device = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = "vmlatency",
+        .fops = &control_fops,
+        .mode = 0600,
+};
+
+int
+vmlatency_control_register(void)
+{
+        int ret;
+
+        output = vzalloc(CONTROL_OUTPUT_SIZE);
+        if (!output)
+                return -ENOMEM;
+
+        ret = misc_register(&control_device);
+        if (ret) {
+                vfree(output);
+                output = NULL;
+        }
+        return ret;
+}
+
+void
+vmlatency_control_deregister(void)
+{
+        /* Device is not registered if VMX is not available */
+        if (!output)
+                return;
+
+        misc_deregister(&control_device);
+        vfree(output);
+        output = NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LINUX_CONTROL_H__
+#define __LINUX_CONTROL_H__
+
+#include <linux/kernel.h>
+
+/* /dev/vmlatency: write a command, read its output */
+int vmlatency_control_register(void);
+void vmlatency_control_deregister(void);
+
+/* Append message to the output of the running command. Returns false if no
+ * command is running */
+bool vmlatency_control_capture(const char *fmt, va_list va);
+
+#endif /* __LINUX_CONTROL_H__ */
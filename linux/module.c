@@ -18,26 +18,86 @@
 #include <linux/module.h>
 
 #include "vmx.h"
+#include "ring.h"
+#include "control.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Evgenii Iuliugin <yulyugin@gmail.com>");
 MODULE_DESCRIPTION("vmlatency");
 
+static unsigned int samples;
+module_param(samples, uint, 0444);
+MODULE_PARM_DESC(samples, "Number of individually timed VM round-trips "
+                          "used to build latency distribution (0 - disabled)");
+
+static bool split;
+module_param(split, bool, 0444);
+MODULE_PARM_DESC(split, "Report VM-entry and VM-exit legs of the sampled "
+                        "round-trips separately");
+
+static bool exits;
+module_param(exits, bool, 0444);
+MODULE_PARM_DESC(exits, "Measure round-trip latency for each exit reason");
+
+static bool allcpus;
+module_param(allcpus, bool, 0444);
+MODULE_PARM_DESC(allcpus, "Run the guest on all online CPUs at the same time");
+
+static bool sweep;
+module_param(sweep, bool, 0444);
+MODULE_PARM_DESC(sweep, "Run the guest on each online CPU in turn");
+
+static char *config;
+module_param(config, charp, 0444);
+MODULE_PARM_DESC(config, "Experiment parameters applied before measurements, "
+                         "e.g. \"warmup=100 payload=vmcall cpus=0-3\"");
+
 static int __init
 vmlatency_init(void)
 {
+        char cmd[256];
+        int ret;
+
         if (!vmx_enabled())
                 return 0;
 
+        if (config) {
+                snprintf(cmd, sizeof(cmd), "set %s", config);
+                if (vmlatency_command(cmd) < 0)
+                        return -EINVAL;
+        }
+
         print_vmx_info();
 
         measure_vmlatency();
-        return 0;
+
+        if (samples && split)
+                measure_vmlatency_split(samples);
+        else if (samples)
+                measure_vmlatency_distribution(samples);
+
+        if (exits)
+                measure_vmexit_matrix(samples);
+
+        if (allcpus)
+                measure_vmlatency_all_cpus(samples);
+
+        if (sweep)
+                measure_vmlatency_sweep(samples);
+
+        /* Monitors stay allocated for commands sent to the device */
+        ret = vmlatency_control_register();
+        if (ret)
+                vmm_free_all();
+        return ret;
 }
 
 static void __exit
 vmlatency_exit(void)
 {
+        vmlatency_control_deregister();
+        sample_ring_free_all();
+        vmm_free_all();
 }
 
 module_init(vmlatency_init);
@@ -16,7 +16,11 @@
  */
 
 #include <sys/systm.h>
+#include <sys/sysctl.h>
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOLib.h>
 
 #include "api.h"
 
@@ -54,6 +58,27 @@ free_vmpage(vmpage_t *p)
         p->pa = 0;
 }
 
+void *
+vmlatency_malloc(size_t size)
+{
+        void *p = IOMalloc(size);
+        if (p)
+                memset(p, 0, size);
+        return p;
+}
+
+void
+vmlatency_free(void *p, size_t size)
+{
+        IOFree(p, size);
+}
+
+void *
+vmlatency_malloc_user(size_t size)
+{
+        return vmlatency_malloc(size);
+}
+
 void
 vmlatency_printm(const char *fmt, ...)
 {
@@ -63,6 +88,17 @@ vmlatency_printm(const char *fmt, ...)
         va_end(va);
 }
 
+int
+vmlatency_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+        int ret;
+        va_list va;
+        va_start(va, fmt);
+        ret = vsnprintf(buf, size, fmt, va);
+        va_end(va);
+        return ret;
+}
+
 void
 vmlatency_preempt_disable(irq_flags_t *irq_flags)
 {
@@ -79,3 +115,76 @@ vmlatency_preempt_enable(irq_flags_t *irq_flags)
         IOSimpleLockFree(irq_flags->lock);
         irq_flags->lock = NULL;
 }
+
+int
+vmlatency_cpu_count(void)
+{
+        int ncpu = 1;
+        size_t len = sizeof(ncpu);
+        sysctlbyname("hw.logicalcpu_max", &ncpu, &len, NULL, 0);
+        return ncpu;
+}
+
+bool
+vmlatency_cpu_online(int cpu)
+{
+        return cpu < vmlatency_cpu_count();
+}
+
+int
+vmlatency_cpu_id(void)
+{
+        return cpu_number();
+}
+
+int
+vmlatency_cpu_node(int cpu)
+{
+        return -1;
+}
+
+int
+vmlatency_run_on_cpu(int cpu, int (*fn)(void *arg), void *arg)
+{
+        return -1;
+}
+
+int
+vmlatency_run_on_all_cpus(int (*fn)(void *arg), void *arg)
+{
+        return -1;
+}
+
+void
+vmlatency_yield(void)
+{
+        IOSleep(0);
+}
+
+int
+vmlatency_ipi_vector(void)
+{
+        return -1;
+}
+
+void
+vmlatency_irq_window(void)
+{
+        /* STI blocks interrupts until the next instruction completes */
+        __asm__ __volatile__("sti; nop; cli" ::: "memory");
+}
+
+u64
+vmlatency_time_ns(void)
+{
+        u64 ns;
+        absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+        return ns;
+}
+
+u64
+vmlatency_nmi_count(void)
+{
+        /* NMI statistics are not exported by XNU */
+        return 0;
+}
@@ -35,5 +35,6 @@ kern_return_t vmlatency_start(kmod_info_t * ki, void *d)
 
 kern_return_t vmlatency_stop(kmod_info_t *ki, void *d)
 {
+        vmm_free_all();
         return KERN_SUCCESS;
 }
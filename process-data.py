@@ -3,6 +3,7 @@
 import os, sys, re
 
 results_folder="results"
+batch_re = re.compile(r"^\s*(-?\d+) - (-?\d+)$")
 
 def name2uarch(brand_string):
     brand_string = brand_string.lstrip() # Remove leading spaces
@@ -70,9 +71,10 @@ def main():
         count = 0
         lmin = sys.maxint
         for l in f.readlines():
-            if l.startswith("IA32_"): # Skip MSRs
+            m = batch_re.match(l)
+            if not m: # Skip MSRs, distributions and other reports
                 continue
-            latency = int(l.split(" - ")[1])
+            latency = int(m.group(2))
             lmin = latency if latency < lmin else lmin
             total += latency
             count += 1
@@ -0,0 +1,65 @@
+#!/usr/bin/python
+
+# Stream individually timed round-trips from the per-CPU sample ring of
+# /dev/vmlatency. Records are written to stdout as
+# "seq tsc_start tsc_end exit_reason cpu".
+#
+# Usage: stream-samples.py <cpu> <count>
+
+import mmap, os, struct, sys, threading, time
+
+DEVICE = "/dev/vmlatency"
+
+RING_RECORDS = 1 << 18
+RING_DATA_OFFSET = 0x1000
+RECORD = struct.Struct("<QQQII")
+RING_SIZE = RING_DATA_OFFSET + RING_RECORDS * RECORD.size
+PAGE_SIZE = mmap.PAGESIZE
+RING_MAP_SIZE = (RING_SIZE + PAGE_SIZE - 1) // PAGE_SIZE * PAGE_SIZE
+
+# sample_ring_header_t
+HEADER = struct.Struct("<IIIIQ")
+HEAD_OFFSET = 64
+TAIL_OFFSET = 128
+
+def run_stream(cpu, count):
+    with open(DEVICE, "w") as dev:
+        dev.write("stream count=%d cpu=%d\n" % (count, cpu))
+
+def main():
+    cpu = int(sys.argv[1])
+    count = int(sys.argv[2])
+
+    fd = os.open(DEVICE, os.O_RDWR)
+    ring = mmap.mmap(fd, RING_MAP_SIZE, offset=cpu * RING_MAP_SIZE)
+    version, record_size, records, _, _ = HEADER.unpack_from(ring, 0)
+    if version != 1 or record_size != RECORD.size or records != RING_RECORDS:
+        sys.exit("Unexpected ring layout")
+
+    writer = threading.Thread(target=run_stream, args=(cpu, count))
+    writer.start()
+
+    out = sys.stdout
+    tail = struct.unpack_from("<Q", ring, TAIL_OFFSET)[0]
+    while True:
+        running = writer.is_alive()
+        head = struct.unpack_from("<Q", ring, HEAD_OFFSET)[0]
+        if head == tail:
+            if not running:
+                break
+            time.sleep(0.001)
+            continue
+
+        while tail != head:
+            r = RECORD.unpack_from(ring, RING_DATA_OFFSET
+                                   + (tail % RING_RECORDS) * RECORD.size)
+            out.write("%d %d %d %d %d\n" % r)
+            tail += 1
+        struct.pack_into("<Q", ring, TAIL_OFFSET, tail)
+
+    writer.join()
+    dropped = HEADER.unpack_from(ring, 0)[4]
+    sys.stderr.write("dropped %d\n" % dropped)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+/* Upper bound of samples if count is not given */
+#define ADAPTIVE_DEFAULT_SAMPLES 1000000
+/* Round-trips timed per run, runs are separated by vmlatency_yield */
+#define ADAPTIVE_CHUNK 10000
+/* Samples above p75 + ADAPTIVE_FENCE * (p75 - p25) are rejected */
+#define ADAPTIVE_FENCE 3
+/* 95% confidence, z = 1.96 */
+#define ADAPTIVE_Z_PERCENT 196
+#define PPM 1000000
+
+typedef enum {
+        ADAPTIVE_CONVERGED,
+        ADAPTIVE_BUDGET,    /* time budget ran out */
+        ADAPTIVE_FULL,      /* sample buffer is full */
+} adaptive_status_t;
+
+static const char *const adaptive_status_names[] = {
+        "converged", "time budget exhausted", "sample limit reached",
+};
+
+typedef struct {
+        u64 *samples;  /* sorted after every chunk */
+        u32 count;     /* taken */
+        u32 max;
+        u64 fence;     /* 0 until the first chunk is taken */
+        u64 rejected;
+        u32 chunks;
+        u64 lo, hi, estimate;  /* confidence interval of the percentile */
+} adaptive_t;
+
+static void
+measure_chunk(vm_monitor_t *vmm, void *arg)
+{
+        adaptive_t *a = arg;
+        u32 end = a->count + ADAPTIVE_CHUNK;
+        u64 start, cycles;
+        u32 i;
+
+        if (end > a->max)
+                end = a->max;
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        /* Samples beyond the fence are SMIs, NMIs and similar, they do not
+         * count towards the sample limit */
+        while (a->count < end) {
+                start = __get_tsc_start();
+                do_vmresume();
+                cycles = __get_tsc_end() - start;
+
+                if (a->fence && cycles > a->fence) {
+                        if (++a->rejected > (u64)a->max)
+                                break;
+                        continue;
+                }
+                a->samples[a->count++] = cycles;
+        }
+}
+
+static u64
+isqrt(u64 v)
+{
+        u64 r = 0, bit = 1ull << 62;
+
+        while (bit > v)
+                bit >>= 2;
+        while (bit) {
+                if (v >= r + bit) {
+                        v -= r + bit;
+                        r = (r >> 1) + bit;
+                } else {
+                        r >>= 1;
+                }
+                bit >>= 2;
+        }
+        return r;
+}
+
+/* Distribution-free confidence interval of the percentile: ranks n * q
+ * -/+ z * sqrt(n * q * (1 - q)) of the sorted samples. Returns half-width
+ * relative to the estimate in ppm */
+static u64
+update_interval(adaptive_t *a)
+{
+        u64 n = a->count, q = vmx_config.percentile;
+        u64 rank, delta, lo, hi;
+
+        rank = n * q / PPM;
+        if (rank >= n)
+                rank = n - 1;
+        delta = isqrt(n * q / PPM * (PPM - q) / PPM) * ADAPTIVE_Z_PERCENT / 100
+              + 1;
+        lo = rank > delta ? rank - delta : 0;
+        hi = rank + delta < n ? rank + delta : n - 1;
+
+        a->estimate = a->samples[rank];
+        a->lo = a->samples[lo];
+        a->hi = a->samples[hi];
+        if (!a->estimate)
+                return PPM;
+        return (a->hi - a->lo) * PPM / 2 / a->estimate;
+}
+
+static void
+update_fence(adaptive_t *a)
+{
+        u64 p25 = stats_percentile(a->samples, a->count, 250000);
+        u64 p75 = stats_percentile(a->samples, a->count, 750000);
+
+        a->fence = p75 + ADAPTIVE_FENCE * (p75 - p25);
+        /* Quantized TSC may give zero spread */
+        if (a->fence == p75)
+                a->fence = 2 * p75;
+}
+
+void
+measure_vmlatency_adaptive(u32 count)
+{
+        adaptive_t a = {0};
+        adaptive_status_t status;
+        sample_summary_t summary;
+        u64 start_ns, elapsed_ns, precision;
+        size_t size;
+
+        if (!count)
+                count = ADAPTIVE_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        a.max = count;
+        a.samples = vmlatency_malloc(size);
+        if (!a.samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                return;
+        }
+
+        start_ns = vmlatency_time_ns();
+        for (;;) {
+                if (!run_guest(measure_chunk, &a))
+                        goto out;
+                a.chunks++;
+
+                stats_sort(a.samples, a.count);
+                if (!a.fence)
+                        update_fence(&a);
+                precision = update_interval(&a);
+                elapsed_ns = vmlatency_time_ns() - start_ns;
+
+                if (precision <= vmx_config.precision) {
+                        status = ADAPTIVE_CONVERGED;
+                        break;
+                }
+                if (elapsed_ns >= (u64)vmx_config.budget_ms * 1000000) {
+                        status = ADAPTIVE_BUDGET;
+                        break;
+                }
+                if (a.count >= a.max || a.rejected > (u64)a.max) {
+                        status = ADAPTIVE_FULL;
+                        break;
+                }
+                vmlatency_yield();
+        }
+
+        stats_summarize(a.samples, a.count, &summary);
+        stats_print_summary("adaptive", &summary);
+        vmlatency_printk("adaptive: %s, percentile %u ppm %llu interval"
+                         " %llu-%llu precision %llu ppm\n",
+                         adaptive_status_names[status],
+                         vmx_config.percentile, a.estimate, a.lo, a.hi,
+                         precision);
+        vmlatency_printk("adaptive: chunks %u rejected %llu above %llu"
+                         " time %llu ms\n", a.chunks, a.rejected, a.fence,
+                         elapsed_ns / 1000000);
+
+out:
+        vmlatency_free(a.samples, size);
+}
@@ -72,10 +72,63 @@ extern "C" {
 int allocate_vmpage(vmpage_t *p);
 void free_vmpage(vmpage_t *p);
 
+/* Allocate virtually contiguous memory that is not expected to be used by
+ * the processor directly (e.g. sample buffers). May sleep. */
+void *vmlatency_malloc(size_t size);
+void vmlatency_free(void *p, size_t size);
+/* Same as vmlatency_malloc, but the memory may be mapped to user space where
+ * the platform supports it. Freed with vmlatency_free */
+void *vmlatency_malloc_user(size_t size);
+
 void vmlatency_preempt_disable(irq_flags_t *irq_flags);
 void vmlatency_preempt_enable(irq_flags_t *irq_flags);
 
 void vmlatency_printm(const char *fmt, ...);
+int vmlatency_snprintf(char *buf, size_t size, const char *fmt, ...);
+
+/* vmlatency_snprintf returns the untruncated length. Clamp the length of a
+ * string built by appending, so buf + len stays inside the buffer */
+static inline int
+vmlatency_clamp_len(int len, size_t size)
+{
+        if (len < 0)
+                return 0;
+        return (size_t)len < size ? len : (int)size - 1;
+}
+
+/* CPU ids are in range [0, vmlatency_cpu_count()), some of them may be
+ * offline */
+int vmlatency_cpu_count(void);
+bool vmlatency_cpu_online(int cpu);
+int vmlatency_cpu_id(void);
+/* NUMA node of the CPU or -1 if unknown */
+int vmlatency_cpu_node(int cpu);
+
+/* Call fn in process context pinned to the CPU. Returns fn result or -1 if
+ * not supported by the platform */
+int vmlatency_run_on_cpu(int cpu, int (*fn)(void *arg), void *arg);
+
+/* Call fn on all online CPUs at the same time with interrupts disabled.
+ * fn must not sleep. Returns -1 if not supported by the platform */
+int vmlatency_run_on_all_cpus(int (*fn)(void *arg), void *arg);
+
+/* Let other threads run between measurements. May sleep */
+void vmlatency_yield(void);
+
+/* Vector of a self-IPI the host handles harmlessly however often it comes,
+ * or -1 if not supported by the platform */
+int vmlatency_ipi_vector(void);
+
+/* Briefly enable interrupts, so that pending ones are handled by the host.
+ * Called with interrupts disabled */
+void vmlatency_irq_window(void);
+
+/* Monotonic time in nanoseconds, safe to use with interrupts disabled */
+u64 vmlatency_time_ns(void);
+
+/* NMIs handled by the current CPU since boot, or 0 if the platform does not
+ * count them */
+u64 vmlatency_nmi_count(void);
 
 #ifdef __cplusplus
 }
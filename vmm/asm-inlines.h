@@ -28,6 +28,17 @@ typedef struct {
 } descriptor_t;
 #pragma pack(pop)
 
+/* INVEPT and INVVPID descriptors */
+typedef struct {
+        u64 eptp;
+        u64 reserved;
+} invept_desc_t;
+
+typedef struct {
+        u64 vpid;
+        u64 linear_address;
+} invvpid_desc_t;
+
 static inline void
 __cpuid_all(u32 leaf, u32 subleaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
 {
@@ -146,6 +157,28 @@ __vmread(u64 field)
         return ret;
 }
 
+/* Same as __vmread, but returns -1 if the field is not supported */
+static inline int
+__vmread_checked(u64 field, u64 *value)
+{
+#ifdef WIN32
+        size_t ret;
+        if (__vmx_vmread(field, &ret))
+                return -1;
+        *value = ret;
+#else
+        u64 ret, rflags;
+        __asm__ __volatile__(
+                "vmread %2, %1;"
+                SAVE_RFLAGS(rflags), "=r"(ret)
+                :"r"(field));
+        if (rflags & (RFLAGS_CF | RFLAGS_ZF))
+                return -1;
+        *value = ret;
+#endif
+        return 0;
+}
+
 static inline void
 __vmwrite(u64 field, u64 value)
 {
@@ -177,6 +210,82 @@ __get_tsc(void)
 #endif
 }
 
+/* Read TSC at the beginning of a measured window. LFENCE makes RDTSC wait
+ * for all prior instructions to complete. */
+static inline u64
+__get_tsc_start(void)
+{
+#ifdef WIN32
+        _mm_lfence();
+        return __rdtsc();
+#else
+        u32 eax, edx;
+        __asm__ __volatile__(
+                "lfence;"
+                "rdtsc"
+                :"=a"(eax), "=d"(edx)::"memory");
+        return ((u64)edx << 32) | eax;
+#endif
+}
+
+/* Read TSC at the end of a measured window. RDTSCP waits for all prior
+ * instructions, LFENCE keeps subsequent instructions from starting early. */
+static inline u64
+__get_tsc_end(void)
+{
+#ifdef WIN32
+        unsigned int aux;
+        u64 tsc = __rdtscp(&aux);
+        _mm_lfence();
+        return tsc;
+#else
+        u32 eax, edx;
+        __asm__ __volatile__(
+                "rdtscp;"
+                "lfence"
+                :"=a"(eax), "=d"(edx)::"rcx", "memory");
+        return ((u64)edx << 32) | eax;
+#endif
+}
+
+/* Make prior stores globally visible before later instructions, including
+ * WRMSR to x2APIC ICR which is not serializing */
+static inline void
+__mfence(void)
+{
+#ifdef WIN32
+        _mm_mfence();
+        _mm_lfence();
+#else
+        __asm__ __volatile__("mfence; lfence":::"memory");
+#endif
+}
+
+/* Atomically increment *p and return the new value */
+static inline u32
+__locked_inc(volatile u32 *p)
+{
+#ifdef WIN32
+        return (u32)_InterlockedIncrement((volatile long *)p);
+#else
+        u32 val = 1;
+        __asm__ __volatile__(
+                "lock; xaddl %0, %1"
+                :"+r"(val), "+m"(*p)::"memory");
+        return val + 1;
+#endif
+}
+
+static inline void
+__pause(void)
+{
+#ifdef WIN32
+        _mm_pause();
+#else
+        __asm__ __volatile__("pause":::"memory");
+#endif
+}
+
 static inline void
 __get_idt(descriptor_t *idtr)
 {
@@ -278,6 +387,17 @@ __set_cr4(u64 cr4)
 #endif
 }
 
+/* Prevent the compiler from reordering memory accesses across the call */
+static inline void
+__compiler_barrier(void)
+{
+#ifdef WIN32
+        _ReadWriteBarrier();
+#else
+        __asm__ __volatile__("": : :"memory");
+#endif
+}
+
 static inline u64 __rdmsr(u32 msr_num)
 {
 #ifdef WIN32
@@ -292,6 +412,18 @@ static inline u64 __rdmsr(u32 msr_num)
 #endif
 }
 
+static inline void
+__wrmsr(u32 msr_num, u64 value)
+{
+#ifdef WIN32
+        __writemsr(msr_num, value);
+#else
+        __asm__ __volatile__(
+                "wrmsr"
+                ::"c"(msr_num), "a"((u32)value), "d"((u32)(value >> 32)));
+#endif
+}
+
 static inline u64
 __get_rflags(void)
 {
@@ -390,6 +522,18 @@ __str(void)
         return tr;
 }
 
+static inline void
+__invept(u64 type, const invept_desc_t *desc)
+{
+        __asm__ __volatile__("invept %0, %1"::"m"(*desc), "r"(type):"cc");
+}
+
+static inline void
+__invvpid(u64 type, const invvpid_desc_t *desc)
+{
+        __asm__ __volatile__("invvpid %0, %1"::"m"(*desc), "r"(type):"cc");
+}
+
 #else  /* !__GNUC__ */
 
 extern u16 __get_es(void);
@@ -406,11 +550,90 @@ extern void __get_gdt(descriptor_t *gdt);
 extern void __set_gdt(descriptor_t *gdt);
 extern u16 __str(void);
 
+extern void __invept(u64 type, const invept_desc_t *desc);
+extern void __invvpid(u64 type, const invvpid_desc_t *desc);
+
 extern void __vmxoff(void);
 
 #endif /* !__GNUC__ */
 
 extern int do_vmlaunch(void);
 extern int do_vmresume(void);
+/* Same as do_vmresume. Guest starts with host general purpose registers, so
+ * the argument reaches guest code unchanged in the first argument register
+ * (RDI on Linux and macOS, RCX on Windows) */
+extern int do_vmresume_arg(void *guest_arg);
+
+/* Guest registers loaded by do_vmresume_regs. Layout is used by assembly */
+typedef struct guest_regs {
+        u64 rax;
+        u64 rbx;
+        u64 rcx;
+        u64 rdx;
+} guest_regs_t;
+
+extern int do_vmresume_regs(const guest_regs_t *regs);
+
+/* Saves registers and writes host RSP like do_vmresume, but returns without
+ * entering the guest */
+extern int do_vmresume_nop(void);
+
+/* Argument of guest_touch passed with do_vmresume_arg. Guest loads count
+ * quadwords starting at buffer with given stride and stores TSC cycles spent.
+ * Layout is used by assembly */
+typedef struct guest_touch {
+        u64 buffer;
+        u64 count;  /* must not be 0 */
+        u64 stride;
+        u64 cycles;
+} guest_touch_t;
+
+/* Argument of guest_workset passed with do_vmresume_arg. Guest walks count
+ * lines of the buffer twice, either sequentially with given stride or by
+ * following pointers stored in the buffer. Layout is used by assembly */
+typedef struct guest_workset {
+        u64 buffer;
+        u64 count;  /* must not be 0 */
+        u64 stride;
+        u64 chase;
+        u64 entry_tsc;
+        u64 first_pass;   /* cycles */
+        u64 second_pass;  /* cycles */
+        u64 exit_tsc;
+} guest_workset_t;
+
+/* Argument of guest_self_ipi passed with do_vmresume_arg. Guest stores TSC
+ * and sends itself an x2APIC IPI with the vector. Layout is used by
+ * assembly */
+typedef struct guest_ipi {
+        u64 vector;
+        u64 send_tsc;
+} guest_ipi_t;
+
+/* Argument of guest_vmread and guest_vmwrite passed with do_vmresume_arg.
+ * Layout is used by assembly */
+typedef struct guest_vmaccess {
+        u64 field;
+        u64 count;   /* must not be 0 */
+        u64 value;   /* written by guest_vmwrite */
+        u64 cycles;
+} guest_vmaccess_t;
+
+/* Argument of guest_vmfunc passed with do_vmresume_arg. Guest switches
+ * through EPTP list entries 0..mask with VMFUNC count times and stores TSC
+ * cycles spent. Layout is used by assembly */
+typedef struct guest_vmfunc {
+        u64 mask;    /* number of views - 1, views is a power of 2 */
+        u64 count;   /* must not be 0 */
+        u64 cycles;
+} guest_vmfunc_t;
+
+/* Argument of guest_kick passed with do_vmresume_arg. Guest copies seq to
+ * in_guest, so other CPUs know it runs, and spins. Layout is used by
+ * assembly */
+typedef struct guest_kick {
+        volatile u64 in_guest;
+        u64 seq;
+} guest_kick_t;
 
 #endif /* __ASM_INLINES_H__ */
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "calib.h"
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+
+/* Iterations of every timed loop, a multiple of the largest unroll */
+#define CALIB_ITERATIONS 65536
+/* All loops of calib run in one guest launch, bound the time with interrupts
+ * disabled */
+#define CALIB_MAX_ITERATIONS (1 << 18)
+/* Timed windows and loops are repeated, the minimum is kept */
+#define CALIB_ROUNDS 1000
+#define CALIB_LOOP_ROUNDS 5
+
+const u32 calib_unroll[CALIB_UNROLLS] = {1, 4, 16};
+
+#define REPEAT4(x) x x x x
+#define REPEAT16(x) REPEAT4(REPEAT4(x))
+
+/* Loop of count iterations with body unrolled 1, 4 or 16 times. The switch
+ * is outside the loop, so every variant has the shape of the batch loop */
+#define UNROLLED_LOOP(unroll, count, body)                              \
+        do {                                                            \
+                u32 i_;                                                 \
+                switch (unroll) {                                       \
+                case 16:                                                \
+                        for (i_ = 0; i_ < (count); i_ += 16) {          \
+                                REPEAT16(body;)                         \
+                        }                                               \
+                        break;                                          \
+                case 4:                                                 \
+                        for (i_ = 0; i_ < (count); i_ += 4) {           \
+                                REPEAT4(body;)                          \
+                        }                                               \
+                        break;                                          \
+                default:                                                \
+                        for (i_ = 0; i_ < (count); ++i_) {              \
+                                body;                                   \
+                        }                                               \
+                }                                                       \
+        } while (0)
+
+typedef struct {
+        calib_t base;
+        u32 count;
+        u64 vmresume[CALIB_UNROLLS];  /* per-iteration round-trip cost */
+} calib_full_t;
+
+static u64
+time_empty(u32 unroll, u32 count)
+{
+        u64 start = __get_tsc();
+
+        UNROLLED_LOOP(unroll, count, __compiler_barrier());
+        return __get_tsc() - start;
+}
+
+static u64
+time_nop(u32 unroll, u32 count)
+{
+        u64 start = __get_tsc();
+
+        UNROLLED_LOOP(unroll, count, do_vmresume_nop());
+        return __get_tsc() - start;
+}
+
+static u64
+time_vmresume(u32 unroll, u32 count)
+{
+        u64 start = __get_tsc();
+
+        UNROLLED_LOOP(unroll, count, do_vmresume());
+        return __get_tsc() - start;
+}
+
+/* Minimum per-iteration cost over rounds in 1/CALIB_SCALE ticks */
+static u64
+per_iteration(u64 (*time_loop)(u32, u32), u32 unroll, u32 count)
+{
+        u64 ticks, best = ~0ull;
+        u32 r;
+
+        for (r = 0; r < CALIB_LOOP_ROUNDS; ++r) {
+                ticks = time_loop(unroll, count);
+                if (ticks < best)
+                        best = ticks;
+        }
+        return best * CALIB_SCALE / count;
+}
+
+/* Needs a current VMCS, do_vmresume_nop writes host RSP */
+static void
+measure_baselines(calib_t *c, u32 count)
+{
+        u64 start, ticks;
+        u32 r, n;
+
+        c->timer = c->sample_call = ~0ull;
+        for (r = 0; r < CALIB_ROUNDS; ++r) {
+                start = __get_tsc_start();
+                ticks = __get_tsc_end() - start;
+                if (ticks < c->timer)
+                        c->timer = ticks;
+
+                start = __get_tsc_start();
+                do_vmresume_nop();
+                ticks = __get_tsc_end() - start;
+                if (ticks < c->sample_call)
+                        c->sample_call = ticks;
+        }
+
+        for (n = 0; n < CALIB_UNROLLS; ++n) {
+                c->loop[n] = per_iteration(time_empty, calib_unroll[n],
+                                           count);
+                c->call[n] = per_iteration(time_nop, calib_unroll[n], count);
+        }
+}
+
+static void
+measure_calib(vm_monitor_t *vmm, void *arg)
+{
+        measure_baselines(arg, CALIB_ITERATIONS);
+}
+
+bool
+calib_run(calib_t *c)
+{
+        return run_guest(measure_calib, c);
+}
+
+static void
+measure_calib_full(vm_monitor_t *vmm, void *arg)
+{
+        calib_full_t *f = arg;
+        u32 i, n;
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        measure_baselines(&f->base, f->count);
+        for (n = 0; n < CALIB_UNROLLS; ++n)
+                f->vmresume[n] = per_iteration(time_vmresume,
+                                               calib_unroll[n], f->count);
+}
+
+static inline u64
+net(u64 raw, u64 overhead)
+{
+        return raw > overhead ? raw - overhead : 0;
+}
+
+void
+calib_net_summary(const sample_summary_t *raw, u64 overhead,
+                  sample_summary_t *out)
+{
+        out->count = raw->count;
+        out->min = net(raw->min, overhead);
+        out->median = net(raw->median, overhead);
+        out->p90 = net(raw->p90, overhead);
+        out->p99 = net(raw->p99, overhead);
+        out->p999 = net(raw->p999, overhead);
+        out->max = net(raw->max, overhead);
+        out->mean = net(raw->mean, overhead);
+}
+
+void
+calib_print(const calib_t *c)
+{
+        u32 n;
+
+        vmlatency_printk("timer %llu call %llu ticks per timed window\n",
+                         c->timer, c->sample_call);
+        for (n = 0; n < CALIB_UNROLLS; ++n)
+                vmlatency_printk("unroll %2u: loop %llu.%02llu call"
+                                 " %llu.%02llu ticks per iteration\n",
+                                 calib_unroll[n],
+                                 c->loop[n] / CALIB_SCALE,
+                                 c->loop[n] % CALIB_SCALE,
+                                 c->call[n] / CALIB_SCALE,
+                                 c->call[n] % CALIB_SCALE);
+}
+
+/* Round-trips in loops unrolled 1, 4 and 16 times, raw and with the cost of
+ * the same loop calling do_vmresume_nop subtracted */
+void
+measure_vmlatency_calib(u32 count)
+{
+        calib_full_t f = {0};
+        u64 raw, cost;
+        u32 n;
+
+        if (!count)
+                count = CALIB_ITERATIONS;
+        if (count > CALIB_MAX_ITERATIONS)
+                count = CALIB_MAX_ITERATIONS;
+        /* Every unrolled variant runs the same number of iterations */
+        f.count = (count + 15) / 16 * 16;
+
+        if (!run_guest(measure_calib_full, &f))
+                return;
+
+        calib_print(&f.base);
+        for (n = 0; n < CALIB_UNROLLS; ++n) {
+                raw = f.vmresume[n];
+                cost = net(raw, f.base.call[n]);
+                vmlatency_printk("unroll %2u: round-trip %llu.%02llu net"
+                                 " %llu.%02llu\n", calib_unroll[n],
+                                 raw / CALIB_SCALE, raw % CALIB_SCALE,
+                                 cost / CALIB_SCALE, cost % CALIB_SCALE);
+        }
+}
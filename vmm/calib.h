@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CALIB_H__
+#define __CALIB_H__
+
+#include "types.h"
+#include "stats.h"
+
+/* Per-iteration costs are kept in 1/CALIB_SCALE TSC ticks */
+#define CALIB_SCALE 100
+/* Loops are unrolled 1, 4 and 16 times */
+#define CALIB_UNROLLS 3
+
+/* Overhead of the measurement harness that is not VM transition cost */
+typedef struct calib {
+        u64 timer;        /* empty LFENCE+RDTSC ... RDTSCP+LFENCE window */
+        u64 sample_call;  /* the same window around do_vmresume_nop */
+        /* Per-iteration cost of loops unrolled calib_unroll[n] times, empty
+         * and calling do_vmresume_nop */
+        u64 loop[CALIB_UNROLLS];
+        u64 call[CALIB_UNROLLS];
+} calib_t;
+
+extern const u32 calib_unroll[CALIB_UNROLLS];
+
+/* Measure baselines on the current CPU in a separate guest run */
+bool calib_run(calib_t *c);
+void calib_print(const calib_t *c);
+
+/* Subtract overhead from every statistic, saturating at zero */
+void calib_net_summary(const sample_summary_t *raw, u64 overhead,
+                       sample_summary_t *out);
+
+#endif /* __CALIB_H__ */
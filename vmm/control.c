@@ -0,0 +1,664 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "ring.h"
+#include "api.h"
+#include "cpu-defs.h"
+
+/* Command syntax:
+ *   <command> [count=<samples>] [cpu=<cpu id>]
+ *   set <parameter>=<value> ...
+ */
+
+typedef struct command_args {
+        u32 count;
+        int cpu;  /* -1 for current CPU */
+} command_args_t;
+
+typedef struct command {
+        const char *name;
+        void (*run)(const command_args_t *args);
+        bool pinned;  /* runs on a single CPU */
+} command_t;
+
+static void
+run_info(const command_args_t *args)
+{
+        print_vmx_info();
+}
+
+static void
+run_batches(const command_args_t *args)
+{
+        measure_vmlatency();
+}
+
+static void
+run_samples(const command_args_t *args)
+{
+        measure_vmlatency_distribution(args->count);
+}
+
+static void
+run_split(const command_args_t *args)
+{
+        measure_vmlatency_split(args->count);
+}
+
+static void
+run_exits(const command_args_t *args)
+{
+        measure_vmexit_matrix(args->count);
+}
+
+static void
+run_allcpus(const command_args_t *args)
+{
+        measure_vmlatency_all_cpus(args->count);
+}
+
+static void
+run_sweep(const command_args_t *args)
+{
+        measure_vmlatency_sweep(args->count);
+}
+
+static void
+run_config(const command_args_t *args)
+{
+        vmx_config_print();
+}
+
+static void
+run_ept(const command_args_t *args)
+{
+        measure_vmlatency_ept(args->count);
+}
+
+static void
+run_workset(const command_args_t *args)
+{
+        measure_vmlatency_workset(args->count);
+}
+
+static void
+run_ptimer(const command_args_t *args)
+{
+        measure_vmlatency_ptimer(args->count);
+}
+
+static void
+run_extint(const command_args_t *args)
+{
+        measure_vmlatency_extint(args->count);
+}
+
+static void
+run_kick(const command_args_t *args)
+{
+        measure_vmlatency_kick(args->count, args->cpu);
+}
+
+static void
+run_fields(const command_args_t *args)
+{
+        measure_vmlatency_fields(args->count);
+}
+
+static void
+run_shadow(const command_args_t *args)
+{
+        measure_vmlatency_shadow(args->count);
+}
+
+static void
+run_pool(const command_args_t *args)
+{
+        measure_vmlatency_pool(args->count);
+}
+
+static void
+run_migrate(const command_args_t *args)
+{
+        measure_vmlatency_migrate(args->count, args->cpu);
+}
+
+static void
+run_vmfunc(const command_args_t *args)
+{
+        measure_vmlatency_vmfunc(args->count);
+}
+
+static void
+run_msrlist(const command_args_t *args)
+{
+        measure_vmlatency_msrlist(args->count);
+}
+
+static void
+run_ctls(const command_args_t *args)
+{
+        measure_vmlatency_ctls(args->count);
+}
+
+static void
+run_adaptive(const command_args_t *args)
+{
+        measure_vmlatency_adaptive(args->count);
+}
+
+static void
+run_calib(const command_args_t *args)
+{
+        measure_vmlatency_calib(args->count);
+}
+
+static void
+run_stream(const command_args_t *args)
+{
+        measure_vmlatency_stream(args->count);
+}
+
+static const command_t commands[] = {
+        {"info", run_info, true},
+        {"config", run_config, false},
+        {"batches", run_batches, true},
+        {"samples", run_samples, true},
+        {"split", run_split, true},
+        {"exits", run_exits, true},
+        {"allcpus", run_allcpus, false},
+        {"sweep", run_sweep, false},
+        {"stream", run_stream, true},
+        {"ept", run_ept, true},
+        {"workset", run_workset, true},
+        {"ptimer", run_ptimer, true},
+        {"extint", run_extint, true},
+        {"kick", run_kick, false},
+        {"fields", run_fields, true},
+        {"shadow", run_shadow, true},
+        {"pool", run_pool, true},
+        {"migrate", run_migrate, false},
+        {"vmfunc", run_vmfunc, true},
+        {"msrlist", run_msrlist, true},
+        {"ctls", run_ctls, true},
+        {"adaptive", run_adaptive, true},
+        {"calib", run_calib, true},
+};
+
+#define COMMANDS_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+static inline bool
+is_space(char c)
+{
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const char *
+skip_spaces(const char *p)
+{
+        while (is_space(*p))
+                p++;
+        return p;
+}
+
+/* Returns pointer past the word if the token at p is equal to word */
+static const char *
+match_word(const char *p, const char *word)
+{
+        while (*word && *p == *word) {
+                p++;
+                word++;
+        }
+
+        if (*word || (*p && !is_space(*p) && *p != '='))
+                return NULL;
+        return p;
+}
+
+static inline int
+digit_value(char c, u32 base)
+{
+        int d;
+
+        if (c >= '0' && c <= '9')
+                d = c - '0';
+        else if (c >= 'a' && c <= 'f')
+                d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+                d = c - 'A' + 10;
+        else
+                return -1;
+
+        return d < base ? d : -1;
+}
+
+/* Decimal or hexadecimal with 0x prefix. Stops at the first non-digit */
+static const char *
+parse_number(const char *p, u32 *val)
+{
+        u32 base = 10;
+        u64 v = 0;
+        int d;
+
+        if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+                base = 16;
+                p += 2;
+        }
+
+        if (digit_value(*p, base) < 0)
+                return NULL;
+
+        while ((d = digit_value(*p, base)) >= 0) {
+                v = v * base + d;
+                if (v > 0xffffffff)
+                        return NULL;
+                p++;
+        }
+
+        *val = (u32)v;
+        return p;
+}
+
+static const char *
+parse_u32(const char *p, u32 *val)
+{
+        p = parse_number(p, val);
+        if (!p || (*p && !is_space(*p)))
+                return NULL;
+        return p;
+}
+
+/* CPU list, e.g. "0-3,8", or "all" */
+static const char *
+parse_cpus(const char *p, vmx_config_t *c)
+{
+        const char *next;
+        u32 first, last, cpu;
+
+        if ((next = match_word(p, "all"))) {
+                c->all_cpus = true;
+                return next;
+        }
+
+        c->all_cpus = false;
+        for (cpu = 0; cpu < VMX_MAX_CPUS / 64; ++cpu)
+                c->cpu_mask[cpu] = 0;
+
+        for (;;) {
+                p = parse_number(p, &first);
+                if (!p)
+                        return NULL;
+
+                last = first;
+                if (*p == '-') {
+                        p = parse_number(p + 1, &last);
+                        if (!p)
+                                return NULL;
+                }
+
+                if (first > last || last >= VMX_MAX_CPUS)
+                        return NULL;
+
+                for (cpu = first; cpu <= last; ++cpu)
+                        c->cpu_mask[cpu / 64] |= __BIT(cpu % 64);
+
+                if (*p != ',')
+                        break;
+                p++;
+        }
+
+        if (*p && !is_space(*p))
+                return NULL;
+        return p;
+}
+
+/* Comma separated list of at most max numbers */
+static const char *
+parse_list(const char *p, u32 *values, u32 *count, u32 max)
+{
+        for (*count = 0; *count < max;) {
+                p = parse_number(p, &values[(*count)++]);
+                if (!p)
+                        return NULL;
+                if (*p != ',')
+                        break;
+                p++;
+        }
+
+        if (*p && !is_space(*p))
+                return NULL;
+        return p;
+}
+
+typedef struct flag_name {
+        const char *name;
+        u32 flags;
+} flag_name_t;
+
+static const flag_name_t pair_names[] = {
+        {"all", VMX_PAIR_ALL},
+        {"smt", VMX_PAIR_SMT},
+        {"package", VMX_PAIR_PACKAGE},
+        {"remote", VMX_PAIR_REMOTE},
+        {NULL, 0},
+};
+
+static const flag_name_t pmc_event_names[] = {
+        {"l1d-misses", VMX_PMC_L1D_MISSES},
+        {"l2-misses", VMX_PMC_L2_MISSES},
+        {"llc-misses", VMX_PMC_LLC_MISSES},
+        {"dtlb-misses", VMX_PMC_DTLB_MISSES},
+        {"machine-clears", VMX_PMC_MACHINE_CLEARS},
+        {"branch-misses", VMX_PMC_BRANCH_MISSES},
+        {NULL, 0},
+};
+
+static const flag_name_t unit_names[] = {
+        {"all", VMX_UNIT_ALL},
+        {"tsc", VMX_UNIT_TSC},
+        {"core", VMX_UNIT_CORE},
+        {"ns", VMX_UNIT_NS},
+        {NULL, 0},
+};
+
+/* Comma separated list of names from the table, e.g. of CPU pairs */
+static const char *
+parse_flags(const char *p, const flag_name_t *names, u32 *flags)
+{
+        const flag_name_t *f;
+        u32 i;
+
+        *flags = 0;
+        for (;;) {
+                for (f = names; f->name; ++f) {
+                        for (i = 0; f->name[i] && p[i] == f->name[i]; ++i)
+                                ;
+                        if (!f->name[i] &&
+                            (p[i] == ',' || !p[i] || is_space(p[i])))
+                                break;
+                }
+                if (!f->name)
+                        return NULL;
+
+                *flags |= f->flags;
+                p += i;
+                if (*p != ',')
+                        break;
+                p++;
+        }
+
+        return p;
+}
+
+static const char *
+parse_payload(const char *p, vmx_config_t *c)
+{
+        char name[16];
+        u32 i;
+
+        for (i = 0; p[i] && !is_space(p[i]); ++i) {
+                if (i == sizeof(name) - 1)
+                        return NULL;
+                name[i] = p[i];
+        }
+        name[i] = '\0';
+
+        if (vmx_config_set_payload(c, name) != 0)
+                return NULL;
+        return p + i;
+}
+
+typedef enum {
+        PARAM_U32,
+        PARAM_BOOL,
+        PARAM_LIST,
+        PARAM_PAIRS,
+        PARAM_PMC_EVENTS,
+        PARAM_UNITS,
+        PARAM_CPUS,
+        PARAM_PAYLOAD,
+} param_type_t;
+
+#define CONFIG_FIELD(field) ((size_t)&((vmx_config_t *)0)->field)
+
+typedef struct config_param {
+        const char *name;
+        param_type_t type;
+        size_t offset;  /* of u32 or bool field, or of u32 array */
+        size_t count_offset;  /* of u32 array length */
+        u32 max;  /* array size */
+} config_param_t;
+
+static const config_param_t config_params[] = {
+        {"samples", PARAM_U32, CONFIG_FIELD(samples)},
+        {"warmup", PARAM_U32, CONFIG_FIELD(warmup)},
+        {"batch_min", PARAM_U32, CONFIG_FIELD(batch_min)},
+        {"batch_max", PARAM_U32, CONFIG_FIELD(batch_max)},
+        {"batch_factor", PARAM_U32, CONFIG_FIELD(batch_factor)},
+        {"proc", PARAM_U32, CONFIG_FIELD(proc_ctls)},
+        {"proc2", PARAM_U32, CONFIG_FIELD(proc_ctls2)},
+        {"ept", PARAM_BOOL, CONFIG_FIELD(ept)},
+        {"vpid", PARAM_BOOL, CONFIG_FIELD(vpid)},
+        {"ws_min", PARAM_U32, CONFIG_FIELD(workset_min)},
+        {"ws_max", PARAM_U32, CONFIG_FIELD(workset_max)},
+        {"ptimer", PARAM_LIST, CONFIG_FIELD(ptimer),
+                CONFIG_FIELD(ptimer_count), VMX_MAX_PTIMER_VALUES},
+        {"shadow", PARAM_LIST, CONFIG_FIELD(shadow_fields),
+                CONFIG_FIELD(shadow_field_count), VMX_MAX_SHADOW_FIELDS},
+        {"kick", PARAM_PAIRS, CONFIG_FIELD(kick_pairs)},
+        {"migrate", PARAM_PAIRS, CONFIG_FIELD(migrate_pairs)},
+        {"pmc", PARAM_BOOL, CONFIG_FIELD(pmc)},
+        {"pmc_events", PARAM_PMC_EVENTS, CONFIG_FIELD(pmc_events)},
+        {"units", PARAM_UNITS, CONFIG_FIELD(units)},
+        {"percentile", PARAM_U32, CONFIG_FIELD(percentile)},
+        {"precision", PARAM_U32, CONFIG_FIELD(precision)},
+        {"budget_ms", PARAM_U32, CONFIG_FIELD(budget_ms)},
+        {"calibrate", PARAM_BOOL, CONFIG_FIELD(calibrate)},
+        {"cpus", PARAM_CPUS, 0},
+        {"payload", PARAM_PAYLOAD, 0},
+};
+
+#define CONFIG_PARAMS_COUNT (sizeof(config_params) / sizeof(config_params[0]))
+
+static const char *
+parse_param(const char *p, vmx_config_t *c)
+{
+        const config_param_t *param;
+        const char *next;
+        u32 i, val;
+
+        for (i = 0; i < CONFIG_PARAMS_COUNT; ++i) {
+                param = &config_params[i];
+                next = match_word(p, param->name);
+                if (!next || *next != '=')
+                        continue;
+
+                next++;
+                switch (param->type) {
+                case PARAM_U32:
+                        return parse_u32(next,
+                                         (u32 *)((char *)c + param->offset));
+                case PARAM_BOOL:
+                        next = parse_u32(next, &val);
+                        if (!next || val > 1)
+                                return NULL;
+                        *(bool *)((char *)c + param->offset) = !!val;
+                        return next;
+                case PARAM_LIST:
+                        return parse_list(next,
+                                          (u32 *)((char *)c + param->offset),
+                                          (u32 *)((char *)c
+                                                  + param->count_offset),
+                                          param->max);
+                case PARAM_PAIRS:
+                        return parse_flags(next, pair_names,
+                                           (u32 *)((char *)c + param->offset));
+                case PARAM_PMC_EVENTS:
+                        return parse_flags(next, pmc_event_names,
+                                           (u32 *)((char *)c + param->offset));
+                case PARAM_UNITS:
+                        return parse_flags(next, unit_names,
+                                           (u32 *)((char *)c + param->offset));
+                case PARAM_CPUS:
+                        return parse_cpus(next, c);
+                case PARAM_PAYLOAD:
+                        return parse_payload(next, c);
+                }
+        }
+
+        return NULL;
+}
+
+/* Parameters are applied only if all of them are valid */
+static int
+set_config(const char *p, const char *cmd)
+{
+        vmx_config_t c = vmx_config;
+        u32 i;
+
+        for (p = skip_spaces(p); *p; p = skip_spaces(p)) {
+                p = parse_param(p, &c);
+                if (!p) {
+                        vmlatency_printk("Malformed parameters: %s\n", cmd);
+                        return -1;
+                }
+        }
+
+        if (!c.samples || c.warmup > VMX_WARMUP_LIMIT || !c.batch_min ||
+            c.batch_max < c.batch_min || c.batch_max > VMX_BATCH_LIMIT ||
+            c.batch_factor < 2 || c.workset_min < VMX_WORKSET_MIN ||
+            c.workset_max < c.workset_min || !c.units ||
+            c.percentile >= 1000000 || !c.precision || !c.budget_ms) {
+                vmlatency_printk("Invalid parameters: %s\n", cmd);
+                return -1;
+        }
+
+        for (i = 0; i < c.ptimer_count; ++i) {
+                if (c.ptimer[i] > VMX_PTIMER_LIMIT) {
+                        vmlatency_printk("Invalid parameters: %s\n", cmd);
+                        return -1;
+                }
+        }
+
+        vmx_config = c;
+        return 0;
+}
+
+static const char *
+parse_arg(const char *p, command_args_t *args)
+{
+        const char *next;
+        u32 val;
+
+        if ((next = match_word(p, "count")) && *next == '=') {
+                return parse_u32(next + 1, &args->count);
+        } else if ((next = match_word(p, "cpu")) && *next == '=') {
+                next = parse_u32(next + 1, &val);
+                if (!next || val >= (u32)vmlatency_cpu_count() ||
+                    !vmlatency_cpu_online(val))
+                        return NULL;
+                args->cpu = val;
+                return next;
+        }
+
+        return NULL;
+}
+
+typedef struct {
+        const command_t *command;
+        const command_args_t *args;
+} pinned_command_t;
+
+static int
+run_pinned(void *arg)
+{
+        pinned_command_t *pc = arg;
+        pc->command->run(pc->args);
+        return 0;
+}
+
+int
+vmlatency_command(const char *cmd)
+{
+        const command_t *command = NULL;
+        command_args_t args = { 0, -1 };
+        pinned_command_t pc;
+        bool explicit_cpu;
+        const char *p = skip_spaces(cmd);
+        const char *next;
+        u32 i;
+
+        if ((next = match_word(p, "set")) && *next != '=')
+                return set_config(next, cmd);
+
+        for (i = 0; i < COMMANDS_COUNT; ++i) {
+                next = match_word(p, commands[i].name);
+                if (next && *next != '=') {
+                        command = &commands[i];
+                        p = next;
+                        break;
+                }
+        }
+
+        if (!command) {
+                vmlatency_printk("Unknown command: %s\n", cmd);
+                return -1;
+        }
+
+        for (p = skip_spaces(p); *p; p = skip_spaces(p)) {
+                p = parse_arg(p, &args);
+                if (!p) {
+                        vmlatency_printk("Malformed arguments: %s\n", cmd);
+                        return -1;
+                }
+        }
+
+        if (!vmx_enabled())
+                return 0;
+
+        /* Pinned commands always run pinned, so modes launching the guest
+         * many times stay on one CPU */
+        explicit_cpu = args.cpu >= 0;
+        if (!explicit_cpu && command->pinned) {
+                args.cpu = vmx_config_first_cpu();
+                if (args.cpu < 0) {
+                        vmlatency_printk("No online CPUs in CPU mask\n");
+                        return -1;
+                }
+        }
+
+        if (args.cpu < 0 || !command->pinned) {
+                command->run(&args);
+                return 0;
+        }
+
+        pc.command = command;
+        pc.args = &args;
+        if (vmlatency_run_on_cpu(args.cpu, run_pinned, &pc) != 0) {
+                if (explicit_cpu) {
+                        vmlatency_printk("Running on cpu%d is not"
+                                         " supported\n", args.cpu);
+                        return 0;
+                }
+                /* The platform cannot pin, run_guest still checks the CPU
+                 * with interrupts disabled */
+                args.cpu = -1;
+                command->run(&args);
+        }
+        return 0;
+}
@@ -22,15 +22,41 @@
 
 #define UNUSABLE_AR 0x10000
 
+/* I/O ports */
+#define IO_PORT_POST 0x80
+
 /* MSR numbers */
+#define IA32_APIC_BASE               0x1b
 #define IA32_FEATURE_CONTROL         0x3a
+#define MSR_SMI_COUNT                0x34
+#define IA32_SPEC_CTRL               0x48
+#define IA32_MPERF                   0xe7
+#define IA32_APERF                   0xe8
+#define IA32_PMC0                    0xc1
 
 #define IA32_SYSENTER_CS             0x174
 #define IA32_SYSENTER_ESP            0x175
 #define IA32_SYSENTER_EIP            0x176
-
+#define IA32_PERFEVTSEL0             0x186
+#define IA32_DEBUGCTL                0x1d9
+#define IA32_PAT                     0x277
+#define IA32_FIXED_CTR0              0x309
+#define IA32_FIXED_CTR_CTRL          0x38d
+#define IA32_PERF_GLOBAL_CTRL        0x38f
+
+#define X2APIC_EOI                   0x80b
+#define X2APIC_ICR                   0x830
+#define X2APIC_SELF_IPI              0x83f
+
+#define IA32_EFER                    0xc0000080
+#define IA32_STAR                    0xc0000081
+#define IA32_LSTAR                   0xc0000082
+#define IA32_CSTAR                   0xc0000083
+#define IA32_FMASK                   0xc0000084
 #define IA32_FS_BASE                 0xc0000100
 #define IA32_GS_BASE                 0xc0000101
+#define IA32_KERNEL_GS_BASE          0xc0000102
+#define IA32_TSC_AUX                 0xc0000103
 
 #define IA32_VMX_BASIC               0x480
 #define IA32_VMX_PINBASED_CTLS       0x481
@@ -51,6 +77,54 @@
 #define IA32_VMX_TRUE_ENTRY_CTLS     0x490
 #define IA32_VMX_VMFUNC              0x491
 
+/* Fields of IA32_VMX_MSR_MISC MSR. VMX-preemption timer counts down every
+ * time bit X of TSC changes, where X is the rate */
+#define VMX_MISC_PTIMER_RATE_MASK 0x1f
+
+/* Fields of IA32_VMX_EPT_VPID_CAP MSR */
+#define EPT_VPID_CAP_WALK_LENGTH_4      __BIT(6)
+#define EPT_VPID_CAP_MEMTYPE_UC         __BIT(8)
+#define EPT_VPID_CAP_MEMTYPE_WB         __BIT(14)
+#define EPT_VPID_CAP_2MB_PAGES          __BIT(16)
+#define EPT_VPID_CAP_1GB_PAGES          __BIT(17)
+#define EPT_VPID_CAP_INVEPT             __BIT(20)
+#define EPT_VPID_CAP_INVEPT_SINGLE      __BIT(25)
+#define EPT_VPID_CAP_INVEPT_ALL         __BIT(26)
+#define EPT_VPID_CAP_INVVPID            __BIT(32)
+#define EPT_VPID_CAP_INVVPID_SINGLE     __BIT(41)
+#define EPT_VPID_CAP_INVVPID_ALL        __BIT(42)
+
+/* INVEPT and INVVPID types */
+#define INVEPT_SINGLE_CONTEXT  1
+#define INVEPT_ALL_CONTEXT     2
+#define INVVPID_SINGLE_CONTEXT 1
+#define INVVPID_ALL_CONTEXT    2
+
+/* EPT paging structure entries */
+#define EPT_READ          __BIT(0)
+#define EPT_WRITE         __BIT(1)
+#define EPT_EXECUTE       __BIT(2)
+#define EPT_MEMTYPE_SHIFT 3
+#define EPT_LARGE_PAGE    __BIT(7)
+
+#define MEMTYPE_UC 0
+#define MEMTYPE_WB 6
+
+/* EPTP fields */
+#define EPTP_WALK_LENGTH_4 (3 << 3)
+#define EPTP_FLAGS_MASK    0xfff
+
+/* VM-function controls, also reported by IA32_VMX_VMFUNC */
+#define VMFUNC_EPTP_SWITCHING __BIT(0)
+#define VMFUNC_EPTP_LIST_SIZE 512
+
+/* Bit 31 of revision identifier marks shadow VMCS */
+#define VMCS_SHADOW_INDICATOR __BIT(31)
+
+/* Fields of IA32_APIC_BASE MSR */
+#define APIC_BASE_X2APIC_ENABLE __BIT(10)
+#define APIC_BASE_ENABLE        __BIT(11)
+
 /* Fields of IA32_FEATURE_CONTROL MSR */
 #define FEATURE_CONTROL_LOCK_BIT                   __BIT(0)
 #define FEATURE_CONTROL_VMX_OUTSIDE_SMX_ENABLE_BIT __BIT(2)
@@ -136,6 +210,40 @@
 
 /* CPUID bits */
 #define CPUID_1_ECX_VMX __BIT(5)
+#define CPUID_7_EDX_HYBRID __BIT(15)
+#define CPUID_7_EDX_SPEC_CTRL __BIT(26)
+#define CPUID_80000001_EDX_RDTSCP __BIT(27)
+#define CPUID_6_ECX_APERFMPERF __BIT(0)
+
+/* CPUID leaves */
+#define CPUID_LEAF_POWER       0x6
+#define CPUID_LEAF_PERFMON     0xa
+#define CPUID_LEAF_TOPOLOGY    0xb
+#define CPUID_LEAF_TSC         0x15
+#define CPUID_LEAF_FREQUENCY   0x16
+#define CPUID_LEAF_HYBRID      0x1a
+#define CPUID_LEAF_TOPOLOGY_V2 0x1f
+
+/* CPUID topology level types */
+#define CPUID_TOPOLOGY_INVALID 0
+#define CPUID_TOPOLOGY_SMT     1
+#define CPUID_TOPOLOGY_CORE    2
+
+/* CPUID hybrid core types */
+#define CPUID_CORE_TYPE_ATOM 0x20
+#define CPUID_CORE_TYPE_CORE 0x40
+
+/* IA32_PERFEVTSELx fields */
+#define PERFEVTSEL_UMASK_SHIFT 8
+#define PERFEVTSEL_USR         __BIT(16)
+#define PERFEVTSEL_OS          __BIT(17)
+#define PERFEVTSEL_EDGE        __BIT(18)
+#define PERFEVTSEL_EN          __BIT(22)
+#define PERFEVTSEL_CMASK_SHIFT 24
+
+/* IA32_FIXED_CTR_CTRL has 4 bits per counter */
+#define FIXED_CTR_CTRL_OS_USR 0x3
+#define FIXED_CTR_CTRL_SHIFT  4
 
 /* Control registers */
 #define CR4_VMXE __BIT(13)
@@ -146,6 +254,9 @@
 
 /* VMCS guest state */
 
+/* 16-bit control fields */
+#define VMCS_VPID 0x0000
+
 /* 16-bit guest state */
 #define VMCS_GUEST_ES     0x0800
 #define VMCS_GUEST_CS     0x0802
@@ -157,8 +268,11 @@
 #define VMCS_GUEST_TR     0x080e
 
 /* 64-bit guest state */
-#define VMCS_VMCS_LINK_PTR       0x2800
-#define VMCS_GUEST_IA32_DEBUGCTL 0x2802
+#define VMCS_VMCS_LINK_PTR               0x2800
+#define VMCS_GUEST_IA32_DEBUGCTL         0x2802
+#define VMCS_GUEST_IA32_PAT              0x2804
+#define VMCS_GUEST_IA32_EFER             0x2806
+#define VMCS_GUEST_IA32_PERF_GLOBAL_CTRL 0x2808
 
 /* 32-bit guest state */
 #define VMCS_GUEST_ES_LIMIT               0x4800
@@ -183,6 +297,7 @@
 #define VMCS_GUEST_ACTIVITY_STATE         0x4826
 #define VMCS_GUEST_SMBASE                 0x4828
 #define VMCS_GUEST_IA32_SYSENTER_CS       0x482a
+#define VMCS_GUEST_PTIMER_VALUE           0x482e
 
 /* Natural-width guest state */
 #define VMCS_GUEST_CR0                   0x6800
@@ -217,6 +332,11 @@
 #define VMCS_HOST_GS      0x0c0a
 #define VMCS_HOST_TR      0x0c0c
 
+/* 64-bit host state */
+#define VMCS_HOST_IA32_PAT              0x2c00
+#define VMCS_HOST_IA32_EFER             0x2c02
+#define VMCS_HOST_IA32_PERF_GLOBAL_CTRL 0x2c04
+
 /* 32-bit host state */
 #define VMCS_HOST_IA32_SYSENTER_CS 0x4c00
 
@@ -237,10 +357,19 @@
 /* VMCS controls */
 
 /* 64-bit control fields */
-#define VMCS_IO_BITMAP_A_ADDR 0x2000
-#define VMCS_IO_BITMAP_B_ADDR 0x2002
-#define VMCS_EXEC_VMCS_PTR    0x200c
-#define VMCS_TSC_OFFSET       0x2010
+#define VMCS_IO_BITMAP_A_ADDR      0x2000
+#define VMCS_IO_BITMAP_B_ADDR      0x2002
+#define VMCS_MSR_BITMAP_ADDR       0x2004
+#define VMCS_VMEXIT_MSR_STORE_ADDR 0x2006
+#define VMCS_VMEXIT_MSR_LOAD_ADDR  0x2008
+#define VMCS_VMENTRY_MSR_LOAD_ADDR 0x200a
+#define VMCS_EXEC_VMCS_PTR         0x200c
+#define VMCS_TSC_OFFSET            0x2010
+#define VMCS_VMFUNC_CTLS           0x2018
+#define VMCS_EPT_POINTER           0x201a
+#define VMCS_EPTP_LIST_ADDR        0x2024
+#define VMCS_VMREAD_BITMAP         0x2026
+#define VMCS_VMWRITE_BITMAP        0x2028
 
 /* 32-bit control fields */
 #define VMCS_PIN_BASED_VM_CTLS    0x4000
@@ -257,6 +386,7 @@
 #define VMCS_VMENTRY_INT_INFO     0x4016
 #define VMCS_VMENTRY_ECODE        0x4018
 #define VMCS_VMENTRY_INSTR_LEN    0x401a
+#define VMCS_PROC_BASED_VM_CTLS2  0x401e
 
 /* Natural-width control fields */
 #define VMCS_CR0_GUEST_HOST_MASK 0x6000
@@ -278,6 +408,10 @@
 #define VMCS_VM_EXIT_INSTR_LENGTH 0x440c
 #define VMCS_VM_EXIT_INSTR_INFO   0x440e
 
+/* Fields of VM-exit interruption information */
+#define VMX_INT_INFO_VECTOR_MASK 0xff
+#define VMX_INT_INFO_VALID       __BIT(31)
+
 /* Natural width read only data fields */
 #define VMCS_EXIT_QUAL     0x6400
 #define VMCS_IO_RCX        0x6402
@@ -286,6 +420,30 @@
 #define VMCS_IO_RIP        0x6408
 #define VMCS_GUEST_LINADDR 0x640a
 
-#define VMEXIT_CPUID 10
+/* Basic exit reasons */
+#define VMEXIT_EXCEPTION_NMI 0
+#define VMEXIT_EXTERNAL_INT  1
+#define VMEXIT_CPUID         10
+#define VMEXIT_HLT           12
+#define VMEXIT_INVLPG        14
+#define VMEXIT_RDPMC         15
+#define VMEXIT_RDTSC         16
+#define VMEXIT_VMCALL        18
+#define VMEXIT_VMREAD        23
+#define VMEXIT_VMWRITE       25
+#define VMEXIT_CR_ACCESS     28
+#define VMEXIT_DR_ACCESS     29
+#define VMEXIT_IO            30
+#define VMEXIT_RDMSR         31
+#define VMEXIT_WRMSR         32
+#define VMEXIT_EPT_VIOLATION 48
+#define VMEXIT_EPT_MISCONFIG 49
+#define VMEXIT_PTIMER        52
+
+/* MSR bitmap layout */
+#define MSR_BITMAP_READ_LOW   0x000
+#define MSR_BITMAP_READ_HIGH  0x400
+#define MSR_BITMAP_WRITE_LOW  0x800
+#define MSR_BITMAP_WRITE_HIGH 0xc00
 
 #endif /* __CPU_DEFS_H__ */
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+extern void guest_code(void);
+
+#define EFER_CTLS_ENTRY VMCS_VMENTRY_CTL_LOAD_IA32_EFER
+#define EFER_CTLS_EXIT (VMCS_VMEXIT_CTL_LOAD_IA32_EFER \
+                        | VMCS_VMEXIT_CTL_SAVE_IA32_EFER)
+#define PAT_CTLS_ENTRY VMCS_VMENTRY_CTL_LOAD_IA32_PAT
+#define PAT_CTLS_EXIT (VMCS_VMEXIT_CTL_LOAD_IA32_PAT \
+                       | VMCS_VMEXIT_CTL_SAVE_IA32_PAT)
+#define PERF_CTLS_ENTRY VMCS_VMENTRY_CTL_LOAD_IA32_PERF_GLOBAL_CTRL
+#define PERF_CTLS_EXIT VMCS_VMEXIT_CTL_LOAD_IA32_PERF_GLOBAL_CTRL
+#define DEBUG_CTLS_ENTRY VMCS_VMENTRY_CTL_LOAD_DBG_CTLS
+#define DEBUG_CTLS_EXIT VMCS_VMEXIT_CTL_SAVE_DBG_CTLS
+
+typedef struct ctl_test {
+        const char *name;
+        u32 entry_ctls;  /* set on top of the ones used by other modes */
+        u32 exit_ctls;
+} ctl_test_t;
+
+/* First test is the baseline for marginal costs */
+static const ctl_test_t ctl_tests[] = {
+        {"none", 0, 0},
+        {"entry-load-efer", VMCS_VMENTRY_CTL_LOAD_IA32_EFER, 0},
+        {"exit-load-efer", 0, VMCS_VMEXIT_CTL_LOAD_IA32_EFER},
+        {"exit-save-efer", 0, VMCS_VMEXIT_CTL_SAVE_IA32_EFER},
+        {"entry-load-pat", VMCS_VMENTRY_CTL_LOAD_IA32_PAT, 0},
+        {"exit-load-pat", 0, VMCS_VMEXIT_CTL_LOAD_IA32_PAT},
+        {"exit-save-pat", 0, VMCS_VMEXIT_CTL_SAVE_IA32_PAT},
+        {"entry-load-perf", VMCS_VMENTRY_CTL_LOAD_IA32_PERF_GLOBAL_CTRL, 0},
+        {"exit-load-perf", 0, VMCS_VMEXIT_CTL_LOAD_IA32_PERF_GLOBAL_CTRL},
+        {"entry-load-debug", VMCS_VMENTRY_CTL_LOAD_DBG_CTLS, 0},
+        {"exit-save-debug", 0, VMCS_VMEXIT_CTL_SAVE_DBG_CTLS},
+        {"efer", EFER_CTLS_ENTRY, EFER_CTLS_EXIT},
+        {"pat", PAT_CTLS_ENTRY, PAT_CTLS_EXIT},
+        {"perf", PERF_CTLS_ENTRY, PERF_CTLS_EXIT},
+        {"debug", DEBUG_CTLS_ENTRY, DEBUG_CTLS_EXIT},
+        {"all", EFER_CTLS_ENTRY | PAT_CTLS_ENTRY | PERF_CTLS_ENTRY
+                | DEBUG_CTLS_ENTRY, EFER_CTLS_EXIT | PAT_CTLS_EXIT
+                | PERF_CTLS_EXIT | DEBUG_CTLS_EXIT},
+};
+
+#define CTL_TESTS_COUNT (sizeof(ctl_tests) / sizeof(ctl_tests[0]))
+
+typedef enum {
+        CTL_TEST_OK,
+        CTL_TEST_UNSUPPORTED,
+        CTL_TEST_REQUIRED,
+        CTL_TEST_WRONG_EXIT,
+} ctl_test_status_t;
+
+typedef struct {
+        u64 *samples;
+        u32 count;
+        u32 test;  /* measured by the current launch */
+        u32 taken;
+        ctl_test_status_t status[CTL_TESTS_COUNT];
+        u32 exit_reason[CTL_TESTS_COUNT];
+        sample_summary_t summary[CTL_TESTS_COUNT];
+} ctl_matrix_t;
+
+/* Guest runs host code, so guest and host get the current MSR values and
+ * loading them in either direction changes nothing. Guest DR7 and DEBUGCTL
+ * are set up by initialize_vmcs */
+static void
+setup_msr_fields(vm_monitor_t *vmm)
+{
+        u64 efer = __rdmsr(IA32_EFER);
+        u64 pat = __rdmsr(IA32_PAT);
+        u64 perf;
+
+        __vmwrite(VMCS_GUEST_IA32_EFER, efer);
+        __vmwrite(VMCS_HOST_IA32_EFER, efer);
+        __vmwrite(VMCS_GUEST_IA32_PAT, pat);
+        __vmwrite(VMCS_HOST_IA32_PAT, pat);
+
+        /* Either control implies the MSR exists */
+        if ((vmm->entry_ctls_allowed1 & PERF_CTLS_ENTRY) ||
+            (vmm->exit_ctls_allowed1 & PERF_CTLS_EXIT)) {
+                perf = __rdmsr(IA32_PERF_GLOBAL_CTRL);
+                __vmwrite(VMCS_GUEST_IA32_PERF_GLOBAL_CTRL, perf);
+                __vmwrite(VMCS_HOST_IA32_PERF_GLOBAL_CTRL, perf);
+        }
+}
+
+static ctl_test_status_t
+measure_ctl_test(vm_monitor_t *vmm, ctl_matrix_t *m, u32 n)
+{
+        const ctl_test_t *t = &ctl_tests[n];
+        u32 base_entry = vmm->entry_ctls, base_exit = vmm->exit_ctls;
+        ctl_test_status_t status = CTL_TEST_OK;
+        u32 end = m->taken + VMX_SAMPLES_CHUNK;
+        u64 start;
+        u32 i;
+
+        if (end > m->count)
+                end = m->count;
+
+        /* Controls the CPU forces on are part of the baseline already */
+        if (n && !(t->entry_ctls & ~vmm->entry_ctls_allowed0) &&
+            !(t->exit_ctls & ~vmm->exit_ctls_allowed0))
+                return CTL_TEST_REQUIRED;
+
+        if (!vmx_set_entry_ctls(vmm, base_entry | t->entry_ctls))
+                return CTL_TEST_UNSUPPORTED;
+        if (!vmx_set_exit_ctls(vmm, base_exit | t->exit_ctls)) {
+                status = CTL_TEST_UNSUPPORTED;
+                goto out;
+        }
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        for (i = m->taken; i < end; ++i) {
+                start = __get_tsc_start();
+                do_vmresume();
+                m->samples[i] = __get_tsc_end() - start;
+        }
+
+        m->exit_reason[n] = (u32)__vmread(VMCS_EXIT_REASON);
+        if ((m->exit_reason[n] & 0xffff) != VMEXIT_CPUID) {
+                status = CTL_TEST_WRONG_EXIT;
+                goto out;
+        }
+        m->taken = end;
+
+out:
+        vmx_set_exit_ctls(vmm, base_exit);
+        vmx_set_entry_ctls(vmm, base_entry);
+        return status;
+}
+
+/* Take a chunk of samples of the current test */
+static void
+measure_ctl_chunk(vm_monitor_t *vmm, void *arg)
+{
+        ctl_matrix_t *m = arg;
+
+        setup_msr_fields(vmm);
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_code);
+        m->status[m->test] = measure_ctl_test(vmm, m, m->test);
+}
+
+/* Every test is taken in chunks and summarized with interrupts enabled */
+static bool
+measure_ctl_matrix(ctl_matrix_t *m)
+{
+        u32 n;
+
+        for (n = 0; n < CTL_TESTS_COUNT; ++n) {
+                m->test = n;
+                m->taken = 0;
+                m->status[n] = CTL_TEST_OK;
+                if (!run_guest_chunked(measure_ctl_chunk, m, &m->taken,
+                                       m->count))
+                        return false;
+                if (m->status[n] == CTL_TEST_OK)
+                        stats_summarize(m->samples, m->count, &m->summary[n]);
+        }
+        return true;
+}
+
+static void
+report_ctl_matrix(ctl_matrix_t *m)
+{
+        char name[64];
+        u32 n;
+
+        for (n = 0; n < CTL_TESTS_COUNT; ++n) {
+                vmlatency_snprintf(name, sizeof(name), "ctls %s",
+                                   ctl_tests[n].name);
+
+                switch (m->status[n]) {
+                case CTL_TEST_OK:
+                        stats_print_summary(name, &m->summary[n]);
+                        break;
+                case CTL_TEST_UNSUPPORTED:
+                        vmlatency_printk("%s: not supported\n", name);
+                        break;
+                case CTL_TEST_REQUIRED:
+                        vmlatency_printk("%s: always on\n", name);
+                        break;
+                case CTL_TEST_WRONG_EXIT:
+                        vmlatency_printk("%s: unexpected exit reason %#x\n",
+                                         name, m->exit_reason[n]);
+                        break;
+                }
+        }
+
+        if (m->status[0] != CTL_TEST_OK)
+                return;
+
+        /* Marginal cost is the difference of medians with the baseline */
+        for (n = 1; n < CTL_TESTS_COUNT; ++n) {
+                if (m->status[n] != CTL_TEST_OK)
+                        continue;
+                vmlatency_printk("ctls %s marginal: %lld cycles\n",
+                                 ctl_tests[n].name,
+                                 (long long)m->summary[n].median
+                                 - (long long)m->summary[0].median);
+        }
+}
+
+void
+measure_vmlatency_ctls(u32 count)
+{
+        ctl_matrix_t *m;
+        size_t size;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+
+        m = vmlatency_malloc(sizeof(*m));
+        if (!m)
+                return;
+
+        m->count = count;
+        m->samples = vmlatency_malloc(size);
+        if (!m->samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        if (measure_ctl_matrix(m))
+                report_ctl_matrix(m);
+
+        vmlatency_free(m->samples, size);
+out:
+        vmlatency_free(m, sizeof(*m));
+}
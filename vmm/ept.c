@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ept.h"
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+#define EPT_ENTRIES 512
+#define EPT_RWX (EPT_READ | EPT_WRITE | EPT_EXECUTE)
+#define EPT_LEAF_WB (EPT_RWX | EPT_LARGE_PAGE \
+                     | (MEMTYPE_WB << EPT_MEMTYPE_SHIFT))
+
+/* Dedicated pool of EPT paging structures: PML4 table, PDPTs and, if 1 GiB
+ * pages are not supported, page directories */
+static vmpage_t *ept_pages;
+static u32 ept_pages_count;
+static u64 eptp;
+
+static bool
+has_ept(void)
+{
+        if (!((__rdmsr(IA32_VMX_PROCBASED_CTLS) >> 32)
+              & VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS))
+                return false;
+        return !!((__rdmsr(IA32_VMX_PROCBASED_CTLS2) >> 32)
+                  & VMX_PROC_CTL2_ENABLE_EPT);
+}
+
+static u32
+physical_address_bits(void)
+{
+        u32 eax, ebx, ecx, edx;
+        __cpuid_all(0x80000008, 0, &eax, &ebx, &ecx, &edx);
+        return eax & 0xff;
+}
+
+int
+ept_init(void)
+{
+        u64 cap, *pml4, *pdpt, *pd;
+        u32 map_bits, pml4_count, gb_count, pd_count, g, i;
+        bool huge;
+
+        if (eptp)
+                return 0;
+
+        if (!has_ept()) {
+                vmlatency_printk("EPT is not supported\n");
+                return -1;
+        }
+
+        cap = __rdmsr(IA32_VMX_EPT_VPID_CAP);
+        if (!(cap & EPT_VPID_CAP_WALK_LENGTH_4) ||
+            !(cap & (EPT_VPID_CAP_MEMTYPE_WB | EPT_VPID_CAP_MEMTYPE_UC)) ||
+            !(cap & (EPT_VPID_CAP_1GB_PAGES | EPT_VPID_CAP_2MB_PAGES))) {
+                vmlatency_printk("EPT capabilities are not sufficient:"
+                                 " %#llx\n", cap);
+                return -1;
+        }
+
+        map_bits = physical_address_bits();
+        if (map_bits > EPT_MAP_BITS)
+                map_bits = EPT_MAP_BITS;
+
+        huge = !!(cap & EPT_VPID_CAP_1GB_PAGES);
+        gb_count = 1u << (map_bits - 30);
+        pml4_count = (gb_count + EPT_ENTRIES - 1) / EPT_ENTRIES;
+        pd_count = huge ? 0 : gb_count;
+
+        ept_pages_count = 1 + pml4_count + pd_count;
+        ept_pages = vmlatency_malloc(ept_pages_count * sizeof(vmpage_t));
+        if (!ept_pages)
+                return -1;
+
+        for (i = 0; i < ept_pages_count; ++i) {
+                if (allocate_vmpage(&ept_pages[i]) != 0) {
+                        vmlatency_printk("Failed to allocate EPT tables\n");
+                        ept_pages_count = i;
+                        ept_free();
+                        return -1;
+                }
+        }
+
+        pml4 = (u64 *)ept_pages[0].p;
+        for (i = 0; i < pml4_count; ++i)
+                pml4[i] = ept_pages[1 + i].pa | EPT_RWX;
+
+        for (g = 0; g < gb_count; ++g) {
+                pdpt = (u64 *)ept_pages[1 + g / EPT_ENTRIES].p;
+                if (huge) {
+                        pdpt[g % EPT_ENTRIES] = ((u64)g << 30) | EPT_LEAF_WB;
+                        continue;
+                }
+
+                pd = (u64 *)ept_pages[1 + pml4_count + g].p;
+                pdpt[g % EPT_ENTRIES] = ept_pages[1 + pml4_count + g].pa
+                                      | EPT_RWX;
+                for (i = 0; i < EPT_ENTRIES; ++i)
+                        pd[i] = ((u64)g << 30) | ((u64)i << 21) | EPT_LEAF_WB;
+        }
+
+        eptp = ept_pages[0].pa | EPTP_WALK_LENGTH_4
+             | (cap & EPT_VPID_CAP_MEMTYPE_WB ? MEMTYPE_WB : MEMTYPE_UC);
+        return 0;
+}
+
+void
+ept_free(void)
+{
+        u32 i;
+
+        if (!ept_pages)
+                return;
+
+        for (i = 0; i < ept_pages_count; ++i)
+                free_vmpage(&ept_pages[i]);
+        vmlatency_free(ept_pages, ept_pages_count * sizeof(vmpage_t));
+
+        ept_pages = NULL;
+        ept_pages_count = 0;
+        eptp = 0;
+}
+
+u64
+ept_pointer(void)
+{
+        return eptp;
+}
+
+u64
+ept_make_view(vmpage_t *pml4)
+{
+        const u64 *src;
+        u64 *dst = (u64 *)pml4->p;
+        u32 i;
+
+        if (!eptp)
+                return 0;
+
+        src = (const u64 *)ept_pages[0].p;
+        for (i = 0; i < EPT_ENTRIES; ++i)
+                dst[i] = src[i];
+        return pml4->pa | (eptp & EPTP_FLAGS_MASK);
+}
+
+/* Pages touched by guest and host after every VM exit, one load per page */
+#define EPT_TOUCH_PAGES 64
+#define EPT_TOUCH_STRIDE 0x1000
+
+extern void guest_code(void);
+extern void guest_touch(void);
+
+typedef struct ept_mode {
+        const char *name;
+        u32 proc_ctls2;
+} ept_mode_t;
+
+static const ept_mode_t ept_modes[] = {
+        {"ept off vpid off", 0},
+        {"ept off vpid on", VMX_PROC_CTL2_ENABLE_VPID},
+        {"ept on vpid off", VMX_PROC_CTL2_ENABLE_EPT},
+        {"ept on vpid on", VMX_PROC_CTL2_ENABLE_EPT
+                | VMX_PROC_CTL2_ENABLE_VPID},
+};
+
+#define EPT_MODES_COUNT (sizeof(ept_modes) / sizeof(ept_modes[0]))
+
+typedef enum {
+        EPT_TEST_OK,
+        EPT_TEST_UNSUPPORTED,
+        EPT_TEST_WRONG_EXIT,
+} ept_test_status_t;
+
+typedef struct {
+        u64 *round_trip;
+        u64 *guest;
+        u64 *host;
+        u32 count;
+        u32 mode;   /* measured by the current launch */
+        u32 taken;  /* samples of the mode */
+        char *buffer;
+        ept_test_status_t status[EPT_MODES_COUNT];
+        u32 exit_reason[EPT_MODES_COUNT];
+        sample_summary_t round_trip_summary[EPT_MODES_COUNT];
+        sample_summary_t guest_summary[EPT_MODES_COUNT];
+        sample_summary_t host_summary[EPT_MODES_COUNT];
+} ept_test_t;
+
+static u64
+host_touch(const char *buffer)
+{
+        u64 start = __get_tsc_start();
+        u32 i;
+
+        for (i = 0; i < EPT_TOUCH_PAGES; ++i)
+                (void)*(volatile const u64 *)(buffer + i * EPT_TOUCH_STRIDE);
+        return __get_tsc_end() - start;
+}
+
+/* Take a chunk of samples of the current mode */
+static void
+measure_ept_mode(vm_monitor_t *vmm, void *arg)
+{
+        ept_test_t *t = arg;
+        guest_touch_t *touch = (guest_touch_t *)vmm->guest_data.p;
+        u32 n = t->mode;
+        u32 end = t->taken + VMX_SAMPLES_CHUNK;
+        u64 start;
+        u32 i;
+
+        if (end > t->count)
+                end = t->count;
+
+        if (!vmx_set_proc_ctls2(vmm, ept_modes[n].proc_ctls2)) {
+                t->status[n] = EPT_TEST_UNSUPPORTED;
+                return;
+        }
+
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_code);
+        do_vmresume();
+        t->exit_reason[n] = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+        if (t->exit_reason[n] != VMEXIT_CPUID) {
+                t->status[n] = EPT_TEST_WRONG_EXIT;
+                return;
+        }
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        for (i = t->taken; i < end; ++i) {
+                start = __get_tsc_start();
+                do_vmresume();
+                t->round_trip[i] = __get_tsc_end() - start;
+        }
+
+        touch->buffer = (uintptr_t)t->buffer;
+        touch->count = EPT_TOUCH_PAGES;
+        touch->stride = EPT_TOUCH_STRIDE;
+
+        /* Guest walks the pages right after VM entry, host right after VM
+         * exit. Both pay for translations flushed by the transition */
+        for (i = 0; i < vmx_config.warmup; ++i) {
+                /* CPUID exit leaves RIP at CPUID, restart guest code */
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_touch);
+                do_vmresume_arg(touch);
+                host_touch(t->buffer);
+        }
+
+        for (i = t->taken; i < end; ++i) {
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_touch);
+                do_vmresume_arg(touch);
+                t->host[i] = host_touch(t->buffer);
+                t->guest[i] = touch->cycles;
+        }
+        t->taken = end;
+}
+
+/* Every mode is taken in chunks and summarized with interrupts enabled */
+static bool
+measure_ept(ept_test_t *t)
+{
+        u32 n;
+
+        for (n = 0; n < EPT_MODES_COUNT; ++n) {
+                t->mode = n;
+                t->taken = 0;
+                t->status[n] = EPT_TEST_OK;
+                if (!run_guest_chunked(measure_ept_mode, t, &t->taken,
+                                       t->count))
+                        return false;
+                if (t->status[n] != EPT_TEST_OK)
+                        continue;
+
+                stats_summarize(t->round_trip, t->count,
+                                &t->round_trip_summary[n]);
+                stats_summarize(t->guest, t->count, &t->guest_summary[n]);
+                stats_summarize(t->host, t->count, &t->host_summary[n]);
+        }
+        return true;
+}
+
+static void
+report_ept(ept_test_t *t)
+{
+        char name[64];
+        u32 n;
+
+        for (n = 0; n < EPT_MODES_COUNT; ++n) {
+                const char *mode = ept_modes[n].name;
+
+                switch (t->status[n]) {
+                case EPT_TEST_OK:
+                        vmlatency_snprintf(name, sizeof(name), "%s cpuid",
+                                           mode);
+                        stats_print_summary(name, &t->round_trip_summary[n]);
+                        vmlatency_snprintf(name, sizeof(name),
+                                           "%s guest-touch", mode);
+                        stats_print_summary(name, &t->guest_summary[n]);
+                        vmlatency_snprintf(name, sizeof(name),
+                                           "%s host-touch", mode);
+                        stats_print_summary(name, &t->host_summary[n]);
+                        break;
+                case EPT_TEST_UNSUPPORTED:
+                        vmlatency_printk("%s: not supported\n", mode);
+                        break;
+                case EPT_TEST_WRONG_EXIT:
+                        vmlatency_printk("%s: unexpected exit reason %u\n",
+                                         mode, t->exit_reason[n]);
+                        break;
+                }
+        }
+}
+
+void
+measure_vmlatency_ept(u32 count)
+{
+        ept_test_t *t;
+        size_t size, buffer_size = EPT_TOUCH_PAGES * EPT_TOUCH_STRIDE;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+
+        /* Without EPT tables only VPID modes are measured */
+        ept_init();
+
+        t = vmlatency_malloc(sizeof(*t));
+        if (!t)
+                return;
+
+        t->count = count;
+        t->round_trip = vmlatency_malloc(size);
+        t->guest = vmlatency_malloc(size);
+        t->host = vmlatency_malloc(size);
+        t->buffer = vmlatency_malloc(buffer_size);
+        if (!t->round_trip || !t->guest || !t->host || !t->buffer) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        if (measure_ept(t))
+                report_ept(t);
+
+out:
+        if (t->buffer)
+                vmlatency_free(t->buffer, buffer_size);
+        if (t->host)
+                vmlatency_free(t->host, size);
+        if (t->guest)
+                vmlatency_free(t->guest, size);
+        if (t->round_trip)
+                vmlatency_free(t->round_trip, size);
+        vmlatency_free(t, sizeof(*t));
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __EPT_H__
+#define __EPT_H__
+
+#include "types.h"
+#include "api.h"
+
+/* Guest physical addresses below 2^EPT_MAP_BITS are identity mapped */
+#define EPT_MAP_BITS 42
+
+/* Build identity-mapped EPT tables shared by all CPUs. The tables are never
+ * modified afterwards. May sleep */
+int ept_init(void);
+void ept_free(void);
+
+/* EPT pointer or 0 if tables are not built */
+u64 ept_pointer(void);
+
+/* Copy the PML4 table into the page, making another identity-mapped
+ * hierarchy that shares lower levels. Returns its EPT pointer or 0 if tables
+ * are not built */
+u64 ept_make_view(vmpage_t *pml4);
+
+#endif /* __EPT_H__ */
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+/* MSR accessed by RDMSR/WRMSR payloads */
+#define EXIT_TEST_MSR IA32_SYSENTER_CS
+
+extern void guest_code(void);
+extern void guest_vmcall(void);
+extern void guest_rdmsr(void);
+extern void guest_wrmsr(void);
+extern void guest_in(void);
+extern void guest_out(void);
+extern void guest_rdtsc(void);
+extern void guest_rdpmc(void);
+extern void guest_hlt(void);
+extern void guest_invlpg(void);
+extern void guest_mov_cr3(void);
+extern void guest_mov_dr(void);
+
+typedef struct exit_test {
+        const char *name;
+        void (*code)(void);
+        u32 exit_reason;
+        u32 proc_ctls;  /* primary proc-based controls causing the exit */
+        bool payload;   /* may be used as guest payload of other modes */
+} exit_test_t;
+
+static const exit_test_t exit_tests[] = {
+        {"cpuid", guest_code, VMEXIT_CPUID, 0, true},
+        {"vmcall", guest_vmcall, VMEXIT_VMCALL, 0, true},
+        {"rdmsr", guest_rdmsr, VMEXIT_RDMSR, 0, false},
+        {"rdmsr-bitmap", guest_rdmsr, VMEXIT_RDMSR,
+                VMX_PROC_CTL_USE_MSR_BITMAPS, false},
+        {"wrmsr", guest_wrmsr, VMEXIT_WRMSR, 0, false},
+        {"wrmsr-bitmap", guest_wrmsr, VMEXIT_WRMSR,
+                VMX_PROC_CTL_USE_MSR_BITMAPS, false},
+        {"in", guest_in, VMEXIT_IO, VMX_PROC_CTL_UNCONDITIONAL_IO_EXITING,
+                true},
+        {"in-bitmap", guest_in, VMEXIT_IO, VMX_PROC_CTL_USE_IO_BITMAPS,
+                false},
+        {"out", guest_out, VMEXIT_IO, VMX_PROC_CTL_UNCONDITIONAL_IO_EXITING,
+                true},
+        {"out-bitmap", guest_out, VMEXIT_IO, VMX_PROC_CTL_USE_IO_BITMAPS,
+                false},
+        {"rdtsc", guest_rdtsc, VMEXIT_RDTSC, VMX_PROC_CTL_RDTSC_EXITING,
+                true},
+        {"rdpmc", guest_rdpmc, VMEXIT_RDPMC, VMX_PROC_CTL_RDPMC_EXITING,
+                false},
+        {"hlt", guest_hlt, VMEXIT_HLT, VMX_PROC_CTL_HLT_EXITING, true},
+        {"invlpg", guest_invlpg, VMEXIT_INVLPG, VMX_PROC_CTL_INVLPG_EXITING,
+                false},
+        {"mov-cr3", guest_mov_cr3, VMEXIT_CR_ACCESS,
+                VMX_PROC_CTL_CR3_LOAD_EXITING, false},
+        {"mov-dr", guest_mov_dr, VMEXIT_DR_ACCESS,
+                VMX_PROC_CTL_MOV_DR_EXITING, true},
+};
+
+#define EXIT_TESTS_COUNT (sizeof(exit_tests) / sizeof(exit_tests[0]))
+
+typedef enum {
+        EXIT_TEST_OK,
+        EXIT_TEST_UNSUPPORTED,
+        EXIT_TEST_WRONG_EXIT,
+} exit_test_status_t;
+
+typedef struct {
+        u64 *samples;
+        u32 count;
+        u32 test;   /* measured by the current launch */
+        u32 taken;  /* samples of the test */
+        exit_test_status_t status[EXIT_TESTS_COUNT];
+        u32 exit_reason[EXIT_TESTS_COUNT];
+        sample_summary_t summary[EXIT_TESTS_COUNT];
+} exit_matrix_t;
+
+/* Payloads using guest registers or bitmaps can only run in the exit
+ * matrix, other modes enter the guest with arbitrary host registers */
+int
+vmx_config_set_payload(vmx_config_t *config, const char *name)
+{
+        const exit_test_t *t;
+        u32 n, i;
+
+        for (n = 0; n < EXIT_TESTS_COUNT; ++n) {
+                t = &exit_tests[n];
+                for (i = 0; name[i] && name[i] == t->name[i]; ++i)
+                        ;
+                if (name[i] || t->name[i])
+                        continue;
+
+                if (!t->payload)
+                        return -1;
+
+                config->payload = t->name;
+                config->payload_code = t->code;
+                config->payload_exit_reason = t->exit_reason;
+                config->payload_proc_ctls = t->proc_ctls;
+                return 0;
+        }
+
+        return -1;
+}
+
+static inline void
+set_bitmap_bit(char *bitmap, u32 bit)
+{
+        bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+/* Intercept test MSR and port in bitmaps. Bitmaps take effect only when the
+ * corresponding "use bitmaps" control is set */
+static void
+setup_bitmaps(vm_monitor_t *vmm)
+{
+        set_bitmap_bit(vmm->msr_bitmap.p + MSR_BITMAP_READ_LOW, EXIT_TEST_MSR);
+        set_bitmap_bit(vmm->msr_bitmap.p + MSR_BITMAP_WRITE_LOW,
+                       EXIT_TEST_MSR);
+        set_bitmap_bit(vmm->io_bitmap_a.p, IO_PORT_POST);
+}
+
+/* Take a chunk of samples of the current test */
+static void
+measure_exit_test(vm_monitor_t *vmm, void *arg)
+{
+        exit_matrix_t *m = arg;
+        const exit_test_t *t = &exit_tests[m->test];
+        u32 n = m->test;
+        u32 end = m->taken + VMX_SAMPLES_CHUNK;
+        guest_regs_t regs;
+        u64 msr_value = __rdmsr(EXIT_TEST_MSR);
+        u64 start;
+        u32 i;
+
+        if (end > m->count)
+                end = m->count;
+
+        setup_bitmaps(vmm);
+
+        /* If an instruction is executed natively instead of exiting it must
+         * be harmless: WRMSR writes back current value, MOV CR3 loads current
+         * CR3 */
+        regs.rax = msr_value & 0xffffffff;
+        regs.rdx = msr_value >> 32;
+        regs.rcx = EXIT_TEST_MSR;
+        regs.rbx = __get_cr3();
+
+        if (!vmx_set_proc_ctls(vmm, vmm->proc_ctls | t->proc_ctls)) {
+                m->status[n] = EXIT_TEST_UNSUPPORTED;
+                return;
+        }
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)t->code);
+
+        /* Exiting instruction leaves guest RIP unchanged, so every VM entry
+         * executes the same instruction again */
+        do_vmresume_regs(&regs);
+        m->exit_reason[n] = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+        if (m->exit_reason[n] != t->exit_reason) {
+                m->status[n] = EXIT_TEST_WRONG_EXIT;
+                return;
+        }
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume_regs(&regs);
+
+        for (i = m->taken; i < end; ++i) {
+                start = __get_tsc_start();
+                do_vmresume_regs(&regs);
+                m->samples[i] = __get_tsc_end() - start;
+        }
+        m->taken = end;
+}
+
+/* Every test is taken in chunks and summarized with interrupts enabled */
+static bool
+measure_exit_matrix(exit_matrix_t *m)
+{
+        u32 n;
+
+        for (n = 0; n < EXIT_TESTS_COUNT; ++n) {
+                m->test = n;
+                m->taken = 0;
+                m->status[n] = EXIT_TEST_OK;
+                if (!run_guest_chunked(measure_exit_test, m, &m->taken,
+                                       m->count))
+                        return false;
+                if (m->status[n] == EXIT_TEST_OK)
+                        stats_summarize(m->samples, m->count,
+                                        &m->summary[n]);
+        }
+        return true;
+}
+
+void
+measure_vmexit_matrix(u32 count)
+{
+        exit_matrix_t *m;
+        size_t size;
+        u32 n;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+
+        m = vmlatency_malloc(sizeof(*m));
+        if (!m)
+                return;
+
+        m->count = count;
+        m->samples = vmlatency_malloc(size);
+        if (!m->samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        if (measure_exit_matrix(m)) {
+                for (n = 0; n < EXIT_TESTS_COUNT; ++n) {
+                        switch (m->status[n]) {
+                        case EXIT_TEST_OK:
+                                stats_print_summary(exit_tests[n].name,
+                                                    &m->summary[n]);
+                                break;
+                        case EXIT_TEST_UNSUPPORTED:
+                                vmlatency_printk("%s: not supported\n",
+                                                 exit_tests[n].name);
+                                break;
+                        case EXIT_TEST_WRONG_EXIT:
+                                vmlatency_printk("%s: unexpected exit reason"
+                                                 " %u\n", exit_tests[n].name,
+                                                 m->exit_reason[n]);
+                                break;
+                        }
+                }
+        }
+
+        vmlatency_free(m->samples, size);
+out:
+        vmlatency_free(m, sizeof(*m));
+}
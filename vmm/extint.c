@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+#define EXTINT_DEFAULT_SAMPLES 10000
+/* Samples taken per guest launch. Interrupts of the host are handled between
+ * launches */
+#define EXTINT_CHUNK 1000
+
+extern void guest_self_ipi(void);
+
+typedef enum {
+        EXTINT_TEST_OK,
+        EXTINT_TEST_UNSUPPORTED,
+        EXTINT_TEST_WRONG_EXIT,
+} extint_test_status_t;
+
+typedef struct {
+        bool ack;    /* acknowledge interrupt on exit */
+        u32 vector;
+        u32 count;
+        u32 taken;
+        u64 *exit;     /* IPI sent in guest to VM exit seen by the host */
+        u64 *handled;  /* IPI sent in guest to the interrupt handled */
+        u64 foreign;   /* exits caused by interrupts of the host */
+        extint_test_status_t status;
+        u32 exit_reason;
+} extint_test_t;
+
+/* Acknowledged interrupt is not delivered to the host. If it is not ours,
+ * raise it again, so the host gets it once interrupts are enabled. The test
+ * vector is used by the host as well, so the interrupt is ours only if the
+ * guest has sent the IPI */
+static bool
+ack_interrupt(extint_test_t *t, const guest_ipi_t *ipi)
+{
+        u32 vector = (u32)__vmread(VMCS_VM_EXIT_INT_INFO)
+                   & VMX_INT_INFO_VECTOR_MASK;
+
+        __wrmsr(X2APIC_EOI, 0);
+        if (vector == t->vector && ipi->send_tsc)
+                return true;
+
+        __wrmsr(X2APIC_SELF_IPI, vector);
+        t->foreign++;
+        return false;
+}
+
+static void
+measure_extint(vm_monitor_t *vmm, void *arg)
+{
+        extint_test_t *t = arg;
+        guest_ipi_t ipi;
+        u32 exit_ctls = vmm->exit_ctls & ~VMCS_VMEXIT_CTL_ACK_INTERRUPT_ON_EXIT;
+        u32 end = t->taken + EXTINT_CHUNK;
+        u64 exit_tsc, handled_tsc;
+
+        if (t->ack)
+                exit_ctls |= VMCS_VMEXIT_CTL_ACK_INTERRUPT_ON_EXIT;
+
+        /* Guest writes x2APIC self-IPI MSR directly, MSR bitmap is clear */
+        if (!vmx_set_pin_ctls(vmm, vmm->pin_ctls
+                                   | VMX_PIN_CTL_EXT_INTERRUPT_EXITING) ||
+            !vmx_set_exit_ctls(vmm, exit_ctls) ||
+            !vmx_set_proc_ctls(vmm, vmm->proc_ctls
+                                    | VMX_PROC_CTL_USE_MSR_BITMAPS)) {
+                t->status = EXTINT_TEST_UNSUPPORTED;
+                return;
+        }
+
+        if (end > t->count)
+                end = t->count;
+
+        ipi.vector = t->vector;
+        while (t->taken < end) {
+                ipi.send_tsc = 0;
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_self_ipi);
+                do_vmresume_arg(&ipi);
+                exit_tsc = __get_tsc_end();
+
+                t->exit_reason = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+                if (t->exit_reason != VMEXIT_EXTERNAL_INT) {
+                        t->status = EXTINT_TEST_WRONG_EXIT;
+                        return;
+                }
+
+                if (t->ack) {
+                        if (!ack_interrupt(t, &ipi))
+                                return;
+                } else {
+                        /* The host takes the interrupt through its IDT */
+                        vmlatency_irq_window();
+                        /* Interrupt of the host came before the IPI */
+                        if (!ipi.send_tsc) {
+                                t->foreign++;
+                                continue;
+                        }
+                }
+                handled_tsc = __get_tsc_end();
+
+                t->exit[t->taken] = exit_tsc - ipi.send_tsc;
+                t->handled[t->taken] = handled_tsc - ipi.send_tsc;
+                t->taken++;
+        }
+
+        t->status = EXTINT_TEST_OK;
+}
+
+static bool
+run_extint(extint_test_t *t)
+{
+        sample_summary_t summary;
+        const char *mode = t->ack ? "ack" : "noack";
+        char name[32];
+
+        t->taken = 0;
+        t->foreign = 0;
+        t->status = EXTINT_TEST_OK;
+
+        /* Give up if the host is flooded with interrupts */
+        while (t->taken < t->count && t->foreign <= t->count) {
+                if (!run_guest(measure_extint, t))
+                        return false;
+                if (t->status != EXTINT_TEST_OK)
+                        break;
+                vmlatency_yield();
+        }
+
+        switch (t->status) {
+        case EXTINT_TEST_OK:
+                break;
+        case EXTINT_TEST_UNSUPPORTED:
+                vmlatency_printk("extint %s: not supported\n", mode);
+                return false;
+        case EXTINT_TEST_WRONG_EXIT:
+                vmlatency_printk("extint %s: unexpected exit reason %u\n",
+                                 mode, t->exit_reason);
+                return false;
+        }
+
+        if (!t->taken) {
+                vmlatency_printk("extint %s: no samples\n", mode);
+                return false;
+        }
+
+        vmlatency_snprintf(name, sizeof(name), "extint %s exit", mode);
+        stats_summarize(t->exit, t->taken, &summary);
+        stats_print_summary(name, &summary);
+        vmlatency_snprintf(name, sizeof(name), "extint %s handled", mode);
+        stats_summarize(t->handled, t->taken, &summary);
+        stats_print_summary(name, &summary);
+        vmlatency_printk("extint %s: host interrupts %llu\n", mode,
+                         t->foreign);
+        return true;
+}
+
+void
+measure_vmlatency_extint(u32 count)
+{
+        extint_test_t t = {0};
+        u64 apic_base = __rdmsr(IA32_APIC_BASE);
+        size_t size;
+        int vector = vmlatency_ipi_vector();
+
+        if (vector < 0) {
+                vmlatency_printk("Self-IPI is not supported\n");
+                return;
+        }
+
+        /* Guest would need the xAPIC page mapped to send IPI */
+        if (!(apic_base & APIC_BASE_ENABLE) ||
+            !(apic_base & APIC_BASE_X2APIC_ENABLE)) {
+                vmlatency_printk("Local APIC is not in x2APIC mode\n");
+                return;
+        }
+
+        if (!count)
+                count = EXTINT_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        t.vector = vector;
+        t.count = count;
+        t.exit = vmlatency_malloc(size);
+        t.handled = vmlatency_malloc(size);
+        if (!t.exit || !t.handled) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        t.ack = true;
+        if (run_extint(&t)) {
+                t.ack = false;
+                run_extint(&t);
+        }
+
+out:
+        if (t.handled)
+                vmlatency_free(t.handled, size);
+        if (t.exit)
+                vmlatency_free(t.exit, size);
+}
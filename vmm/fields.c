@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+#define FIELDS_DEFAULT_SAMPLES 1000
+/* Accesses per timed window, so RDTSC cost is spread among them */
+#define FIELDS_UNROLL 16
+#define REPEAT_16(x) x x x x x x x x x x x x x x x x
+
+/* Field width and type are bits 14:13 and 11:10 of the encoding */
+#define FIELD_WIDTH(e) (((e) >> 13) & 3)
+#define FIELD_TYPE(e)  (((e) >> 10) & 3)
+#define FIELD_TYPE_READ_ONLY 1
+
+typedef struct vmcs_field {
+        const char *name;
+        u32 encoding;
+} vmcs_field_t;
+
+#define VMCS_FIELD(name) {#name, VMCS_##name}
+
+static const vmcs_field_t vmcs_fields[] = {
+        /* 16-bit */
+        VMCS_FIELD(VPID),
+        VMCS_FIELD(GUEST_ES),
+        VMCS_FIELD(GUEST_CS),
+        VMCS_FIELD(GUEST_SS),
+        VMCS_FIELD(GUEST_DS),
+        VMCS_FIELD(GUEST_FS),
+        VMCS_FIELD(GUEST_GS),
+        VMCS_FIELD(GUEST_LDTR),
+        VMCS_FIELD(GUEST_TR),
+        VMCS_FIELD(HOST_ES),
+        VMCS_FIELD(HOST_CS),
+        VMCS_FIELD(HOST_SS),
+        VMCS_FIELD(HOST_DS),
+        VMCS_FIELD(HOST_FS),
+        VMCS_FIELD(HOST_GS),
+        VMCS_FIELD(HOST_TR),
+        /* 64-bit */
+        VMCS_FIELD(IO_BITMAP_A_ADDR),
+        VMCS_FIELD(IO_BITMAP_B_ADDR),
+        VMCS_FIELD(MSR_BITMAP_ADDR),
+        VMCS_FIELD(VMEXIT_MSR_STORE_ADDR),
+        VMCS_FIELD(VMEXIT_MSR_LOAD_ADDR),
+        VMCS_FIELD(VMENTRY_MSR_LOAD_ADDR),
+        VMCS_FIELD(EXEC_VMCS_PTR),
+        VMCS_FIELD(TSC_OFFSET),
+        VMCS_FIELD(VMFUNC_CTLS),
+        VMCS_FIELD(EPT_POINTER),
+        VMCS_FIELD(EPTP_LIST_ADDR),
+        VMCS_FIELD(VMREAD_BITMAP),
+        VMCS_FIELD(VMWRITE_BITMAP),
+        VMCS_FIELD(VMCS_LINK_PTR),
+        VMCS_FIELD(GUEST_IA32_DEBUGCTL),
+        VMCS_FIELD(GUEST_IA32_PAT),
+        VMCS_FIELD(GUEST_IA32_EFER),
+        VMCS_FIELD(GUEST_IA32_PERF_GLOBAL_CTRL),
+        VMCS_FIELD(HOST_IA32_PAT),
+        VMCS_FIELD(HOST_IA32_EFER),
+        VMCS_FIELD(HOST_IA32_PERF_GLOBAL_CTRL),
+        /* 32-bit */
+        VMCS_FIELD(PIN_BASED_VM_CTLS),
+        VMCS_FIELD(PROC_BASED_VM_CTLS),
+        VMCS_FIELD(EXCEPTION_BITMAP),
+        VMCS_FIELD(PF_ECODE_MASK),
+        VMCS_FIELD(PF_ECODE_MATCH),
+        VMCS_FIELD(CR3_TARGET_CNT),
+        VMCS_FIELD(VMEXIT_CTLS),
+        VMCS_FIELD(VMEXIT_MSR_STORE_CNT),
+        VMCS_FIELD(VMEXIT_MSR_LOAD_CNT),
+        VMCS_FIELD(VMENTRY_CTLS),
+        VMCS_FIELD(VMENTRY_MSR_LOAD_CNT),
+        VMCS_FIELD(VMENTRY_INT_INFO),
+        VMCS_FIELD(VMENTRY_ECODE),
+        VMCS_FIELD(VMENTRY_INSTR_LEN),
+        VMCS_FIELD(PROC_BASED_VM_CTLS2),
+        VMCS_FIELD(VM_INSTRUCTION_ERROR),
+        VMCS_FIELD(EXIT_REASON),
+        VMCS_FIELD(VM_EXIT_INT_INFO),
+        VMCS_FIELD(VM_EXIT_INT_ECODE),
+        VMCS_FIELD(IDT_VECTORING_INFO),
+        VMCS_FIELD(IDT_VECTORING_ECODE),
+        VMCS_FIELD(VM_EXIT_INSTR_LENGTH),
+        VMCS_FIELD(VM_EXIT_INSTR_INFO),
+        VMCS_FIELD(GUEST_ES_LIMIT),
+        VMCS_FIELD(GUEST_CS_LIMIT),
+        VMCS_FIELD(GUEST_SS_LIMIT),
+        VMCS_FIELD(GUEST_DS_LIMIT),
+        VMCS_FIELD(GUEST_FS_LIMIT),
+        VMCS_FIELD(GUEST_GS_LIMIT),
+        VMCS_FIELD(GUEST_LDTR_LIMIT),
+        VMCS_FIELD(GUEST_TR_LIMIT),
+        VMCS_FIELD(GUEST_GDTR_LIMIT),
+        VMCS_FIELD(GUEST_IDTR_LIMIT),
+        VMCS_FIELD(GUEST_ES_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_CS_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_SS_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_DS_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_FS_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_GS_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_LDTR_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_TR_ACCESS_RIGHTS),
+        VMCS_FIELD(GUEST_INTERRUPTIBILITY_STATE),
+        VMCS_FIELD(GUEST_ACTIVITY_STATE),
+        VMCS_FIELD(GUEST_SMBASE),
+        VMCS_FIELD(GUEST_IA32_SYSENTER_CS),
+        VMCS_FIELD(GUEST_PTIMER_VALUE),
+        VMCS_FIELD(HOST_IA32_SYSENTER_CS),
+        /* Natural width */
+        VMCS_FIELD(CR0_GUEST_HOST_MASK),
+        VMCS_FIELD(CR4_GUEST_HOST_MASK),
+        VMCS_FIELD(CR0_READ_SHADOW),
+        VMCS_FIELD(CR4_READ_SHADOW),
+        VMCS_FIELD(CR3_TARGET_VALUE_0),
+        VMCS_FIELD(CR3_TARGET_VALUE_1),
+        VMCS_FIELD(CR3_TARGET_VALUE_2),
+        VMCS_FIELD(CR3_TARGET_VALUE_3),
+        VMCS_FIELD(EXIT_QUAL),
+        VMCS_FIELD(IO_RCX),
+        VMCS_FIELD(IO_RSI),
+        VMCS_FIELD(IO_RDI),
+        VMCS_FIELD(IO_RIP),
+        VMCS_FIELD(GUEST_LINADDR),
+        VMCS_FIELD(GUEST_CR0),
+        VMCS_FIELD(GUEST_CR3),
+        VMCS_FIELD(GUEST_CR4),
+        VMCS_FIELD(GUEST_ES_BASE),
+        VMCS_FIELD(GUEST_CS_BASE),
+        VMCS_FIELD(GUEST_SS_BASE),
+        VMCS_FIELD(GUEST_DS_BASE),
+        VMCS_FIELD(GUEST_FS_BASE),
+        VMCS_FIELD(GUEST_GS_BASE),
+        VMCS_FIELD(GUEST_LDTR_BASE),
+        VMCS_FIELD(GUEST_TR_BASE),
+        VMCS_FIELD(GUEST_GDTR_BASE),
+        VMCS_FIELD(GUEST_IDTR_BASE),
+        VMCS_FIELD(GUEST_DR7),
+        VMCS_FIELD(GUEST_RSP),
+        VMCS_FIELD(GUEST_RIP),
+        VMCS_FIELD(GUEST_RFLAGS),
+        VMCS_FIELD(GUEST_PENDING_DBG_EXCEPTION),
+        VMCS_FIELD(GUEST_IA32_SYSENTER_ESP),
+        VMCS_FIELD(GUEST_IA32_SYSENTER_EIP),
+        VMCS_FIELD(HOST_CR0),
+        VMCS_FIELD(HOST_CR3),
+        VMCS_FIELD(HOST_CR4),
+        VMCS_FIELD(HOST_FS_BASE),
+        VMCS_FIELD(HOST_GS_BASE),
+        VMCS_FIELD(HOST_TR_BASE),
+        VMCS_FIELD(HOST_GDTR_BASE),
+        VMCS_FIELD(HOST_IDTR_BASE),
+        VMCS_FIELD(HOST_IA32_SYSENTER_ESP),
+        VMCS_FIELD(HOST_IA32_SYSENTER_EIP),
+        VMCS_FIELD(HOST_RSP),
+        VMCS_FIELD(HOST_RIP),
+};
+
+#define FIELDS_COUNT (sizeof(vmcs_fields) / sizeof(vmcs_fields[0]))
+
+const char *
+vmcs_field_name(u32 encoding)
+{
+        u32 n;
+
+        for (n = 0; n < FIELDS_COUNT; ++n) {
+                if (vmcs_fields[n].encoding == encoding)
+                        return vmcs_fields[n].name;
+        }
+        return NULL;
+}
+
+static const char *width_names[] = {"16-bit", "64-bit", "32-bit", "natural"};
+static const char *type_names[] = {"control", "read-only", "guest", "host"};
+
+/* Independent accesses may overlap in the pipeline, in dependent ones the
+ * encoding or the value of the next access comes from the previous read */
+typedef enum {
+        FIELD_READ,
+        FIELD_READ_DEP,
+        FIELD_WRITE,
+        FIELD_WRITE_READ,
+        FIELD_MODES,
+} field_mode_t;
+
+static const char *mode_names[FIELD_MODES] = {
+        "read", "read-dep", "write", "write-read"
+};
+
+typedef struct {
+        u64 *samples;
+        u32 count;
+        u32 field;  /* index and mode measured by the current launch */
+        u32 mode;
+        u32 taken;
+        volatile u64 zero;  /* hides dependency from the compiler */
+        bool supported[FIELDS_COUNT];
+        u64 cost[FIELDS_COUNT][FIELD_MODES];  /* cycles per access */
+} field_bench_t;
+
+/* Take a chunk of samples of the current field and mode. Every access
+ * writes back the value already in the field, so VMCS state does not
+ * change */
+static void
+time_field(vm_monitor_t *vmm, void *arg)
+{
+        field_bench_t *b = arg;
+        u64 field = vmcs_fields[b->field].encoding;
+        u64 zero = b->zero;
+        u64 f = field;
+        u32 end = b->taken + VMX_SAMPLES_CHUNK;
+        u64 v, start;
+        u32 i;
+
+        if (end > b->count)
+                end = b->count;
+
+        if (__vmread_checked(field, &v) != 0) {
+                b->supported[b->field] = false;
+                return;
+        }
+
+        for (i = b->taken; i < end; ++i) {
+                start = __get_tsc_start();
+                switch (b->mode) {
+                case FIELD_READ:
+                        REPEAT_16(v = __vmread(field);)
+                        break;
+                case FIELD_READ_DEP:
+                        REPEAT_16(v = __vmread(f); f = field | (v & zero);)
+                        break;
+                case FIELD_WRITE:
+                        REPEAT_16(__vmwrite(field, v);)
+                        break;
+                case FIELD_WRITE_READ:
+                        REPEAT_16(__vmwrite(field, v); v = __vmread(field);)
+                        break;
+                default:
+                        break;
+                }
+                b->samples[i] = __get_tsc_end() - start;
+        }
+        b->taken = end;
+}
+
+/* Every field and mode is taken in chunks. Cost is the median cycles per
+ * access rounded to nearest, 0 means not measured */
+static bool
+measure_fields(field_bench_t *b)
+{
+        sample_summary_t summary;
+        u32 encoding, n, mode;
+
+        for (n = 0; n < FIELDS_COUNT; ++n) {
+                encoding = vmcs_fields[n].encoding;
+                b->field = n;
+                b->supported[n] = true;
+
+                for (mode = 0; mode < FIELD_MODES; ++mode) {
+                        if (mode >= FIELD_WRITE &&
+                            FIELD_TYPE(encoding) == FIELD_TYPE_READ_ONLY)
+                                continue;
+
+                        b->mode = mode;
+                        b->taken = 0;
+                        if (!run_guest_chunked(time_field, b, &b->taken,
+                                               b->count))
+                                return false;
+                        if (!b->supported[n])
+                                break;
+
+                        stats_summarize(b->samples, b->count, &summary);
+                        b->cost[n][mode] = (summary.median + FIELDS_UNROLL / 2)
+                                         / FIELDS_UNROLL;
+                }
+        }
+        return true;
+}
+
+static void
+print_costs(const char *name, const char *group, const u64 *cost)
+{
+        char buf[96];
+        int len = 0;
+        u32 mode;
+
+        buf[0] = '\0';
+        for (mode = 0; mode < FIELD_MODES; ++mode) {
+                if (cost[mode])
+                        len += vmlatency_snprintf(buf + len, sizeof(buf) - len,
+                                                  " %s %llu", mode_names[mode],
+                                                  cost[mode]);
+                len = vmlatency_clamp_len(len, sizeof(buf));
+        }
+        vmlatency_printk("%s %s:%s\n", name, group, buf);
+}
+
+static void
+report_fields(field_bench_t *b)
+{
+        u64 sum[FIELD_MODES], avg[FIELD_MODES];
+        char group[32];
+        u32 width, type, n, mode, fields;
+        u32 encoding;
+
+        for (n = 0; n < FIELDS_COUNT; ++n) {
+                encoding = vmcs_fields[n].encoding;
+                if (!b->supported[n]) {
+                        vmlatency_printk("%s: not supported\n",
+                                         vmcs_fields[n].name);
+                        continue;
+                }
+                vmlatency_snprintf(group, sizeof(group), "%s %s",
+                                   width_names[FIELD_WIDTH(encoding)],
+                                   type_names[FIELD_TYPE(encoding)]);
+                print_costs(vmcs_fields[n].name, group, b->cost[n]);
+        }
+
+        /* Average of per-field medians of every width and type */
+        for (width = 0; width < 4; ++width) {
+                for (type = 0; type < 4; ++type) {
+                        fields = 0;
+                        for (mode = 0; mode < FIELD_MODES; ++mode)
+                                sum[mode] = 0;
+
+                        for (n = 0; n < FIELDS_COUNT; ++n) {
+                                encoding = vmcs_fields[n].encoding;
+                                if (!b->supported[n] ||
+                                    FIELD_WIDTH(encoding) != width ||
+                                    FIELD_TYPE(encoding) != type)
+                                        continue;
+                                for (mode = 0; mode < FIELD_MODES; ++mode)
+                                        sum[mode] += b->cost[n][mode];
+                                fields++;
+                        }
+                        if (!fields)
+                                continue;
+
+                        for (mode = 0; mode < FIELD_MODES; ++mode)
+                                avg[mode] = (sum[mode] + fields / 2) / fields;
+                        vmlatency_snprintf(group, sizeof(group), "%s %s",
+                                           width_names[width],
+                                           type_names[type]);
+                        print_costs("group", group, avg);
+                }
+        }
+}
+
+void
+measure_vmlatency_fields(u32 count)
+{
+        field_bench_t *b;
+        size_t size;
+        u32 n, mode;
+
+        if (!count)
+                count = FIELDS_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        b = vmlatency_malloc(sizeof(*b));
+        if (!b)
+                return;
+
+        b->count = count;
+        b->zero = 0;
+        b->samples = vmlatency_malloc(size);
+        if (!b->samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        for (n = 0; n < FIELDS_COUNT; ++n) {
+                for (mode = 0; mode < FIELD_MODES; ++mode)
+                        b->cost[n][mode] = 0;
+        }
+
+        if (measure_fields(b))
+                report_fields(b);
+
+        vmlatency_free(b->samples, size);
+out:
+        vmlatency_free(b, sizeof(*b));
+}
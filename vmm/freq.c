@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freq.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+
+/* Ratios are fixed point numbers with 16 fractional bits */
+#define FREQ_SHIFT 16
+#define FREQ_CALIBRATION_NS 10000000
+
+static u64 core_ratio;     /* core cycles per TSC tick */
+static u64 tenths_ns_ratio;  /* tenths of nanosecond per TSC tick */
+static u64 tsc_khz;
+static bool tsc_khz_detected;
+
+static bool
+has_aperfmperf(void)
+{
+        u32 eax, ebx, ecx, edx;
+
+        __cpuid_all(0, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < CPUID_LEAF_POWER)
+                return false;
+        __cpuid_all(CPUID_LEAF_POWER, 0, &eax, &ebx, &ecx, &edx);
+        return !!(ecx & CPUID_6_ECX_APERFMPERF);
+}
+
+void
+freq_read(freq_sample_t *s)
+{
+        if (!has_aperfmperf()) {
+                s->aperf = 0;
+                s->mperf = 0;
+                return;
+        }
+
+        s->mperf = __rdmsr(IA32_MPERF);
+        s->aperf = __rdmsr(IA32_APERF);
+}
+
+void
+freq_update(const freq_sample_t *start, const freq_sample_t *end)
+{
+        u64 mperf = end->mperf - start->mperf;
+
+        if (mperf)
+                core_ratio = ((end->aperf - start->aperf) << FREQ_SHIFT)
+                             / mperf;
+}
+
+/* Crystal clock multiplied by TSC/crystal ratio. Leaf 0x16 base frequency
+ * is the TSC frequency where the crystal clock is not enumerated */
+static u64
+cpuid_tsc_khz(void)
+{
+        u32 max_leaf, eax, ebx, ecx, edx;
+
+        __cpuid_all(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+        if (max_leaf >= CPUID_LEAF_TSC) {
+                __cpuid_all(CPUID_LEAF_TSC, 0, &eax, &ebx, &ecx, &edx);
+                if (eax && ebx && ecx)
+                        return (u64)ecx * ebx / eax / 1000;
+        }
+
+        if (max_leaf >= CPUID_LEAF_FREQUENCY) {
+                __cpuid_all(CPUID_LEAF_FREQUENCY, 0, &eax, &ebx, &ecx, &edx);
+                if (eax & 0xffff)
+                        return (u64)(eax & 0xffff) * 1000;
+        }
+
+        return 0;
+}
+
+static u64
+calibrate_tsc_khz(void)
+{
+        u64 start_ns, start_tsc, ns, tsc;
+
+        start_ns = vmlatency_time_ns();
+        start_tsc = __get_tsc();
+        do {
+                ns = vmlatency_time_ns() - start_ns;
+                tsc = __get_tsc() - start_tsc;
+        } while (ns < FREQ_CALIBRATION_NS);
+
+        return tsc * 1000000 / ns;
+}
+
+u64
+freq_tsc_khz(void)
+{
+        if (tsc_khz_detected)
+                return tsc_khz;
+
+        tsc_khz = cpuid_tsc_khz();
+        if (!tsc_khz)
+                tsc_khz = calibrate_tsc_khz();
+        if (tsc_khz)
+                tenths_ns_ratio = (10000000ull << FREQ_SHIFT) / tsc_khz;
+        tsc_khz_detected = true;
+        return tsc_khz;
+}
+
+bool
+freq_core_cycles(u64 ticks, u64 *cycles)
+{
+        if (!core_ratio)
+                return false;
+        *cycles = (ticks * core_ratio) >> FREQ_SHIFT;
+        return true;
+}
+
+bool
+freq_ns(u64 ticks, u64 *tenths_ns)
+{
+        if (!freq_tsc_khz())
+                return false;
+        *tenths_ns = (ticks * tenths_ns_ratio) >> FREQ_SHIFT;
+        return true;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __FREQ_H__
+#define __FREQ_H__
+
+#include "types.h"
+
+/* Results are measured in TSC ticks. They are converted to core cycles with
+ * APERF/MPERF ratio of the last measurement and to nanoseconds with TSC
+ * frequency */
+
+typedef struct freq_sample {
+        u64 aperf;
+        u64 mperf;
+} freq_sample_t;
+
+/* Read APERF and MPERF of the current CPU, zeros if not supported */
+void freq_read(freq_sample_t *s);
+
+/* Record core cycles per TSC tick between the samples. MPERF counts at TSC
+ * frequency. With measurements on several CPUs the last one wins */
+void freq_update(const freq_sample_t *start, const freq_sample_t *end);
+
+/* TSC frequency in kHz from CPUID leaf 0x15 or 0x16, otherwise calibrated
+ * against vmlatency_time_ns. Detected once, may spin for 10 ms */
+u64 freq_tsc_khz(void);
+
+/* Convert TSC ticks. Return false if the ratio or the frequency is unknown */
+bool freq_core_cycles(u64 ticks, u64 *cycles);
+bool freq_ns(u64 ticks, u64 *tenths_ns);
+
+#endif /* __FREQ_H__ */
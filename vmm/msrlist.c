@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+#define MSRLIST_DEFAULT_SAMPLES 10000
+
+extern void guest_code(void);
+
+/* Entry of VM-exit MSR-store, VM-exit MSR-load and VM-entry MSR-load areas */
+typedef struct vmx_msr_entry {
+        u32 index;
+        u32 reserved;
+        u64 value;
+} vmx_msr_entry_t;
+
+/* MSRs a hypervisor typically switches between guest and host, in the
+ * order they are added to the lists */
+static const u32 switched_msrs[] = {
+        IA32_KERNEL_GS_BASE,
+        IA32_STAR,
+        IA32_LSTAR,
+        IA32_CSTAR,
+        IA32_FMASK,
+        IA32_TSC_AUX,
+        IA32_SPEC_CTRL,
+        IA32_SYSENTER_CS,
+        IA32_SYSENTER_ESP,
+        IA32_SYSENTER_EIP,
+};
+
+#define MSRLIST_MAX (sizeof(switched_msrs) / sizeof(switched_msrs[0]))
+
+typedef enum {
+        MSRLIST_AUTO,    /* VMCS MSR lists */
+        MSRLIST_MANUAL,  /* RDMSR and WRMSR on the host path */
+        MSRLIST_MODES,
+} msrlist_mode_t;
+
+static const char *const msrlist_mode_names[MSRLIST_MODES] = {
+        "msr-list", "msr-manual",
+};
+
+typedef struct {
+        vmpage_t exit_store;
+        vmpage_t exit_load;
+        vmpage_t entry_load;
+        u32 msrs[MSRLIST_MAX];
+        u32 msr_count;
+        u64 *samples;
+        u32 count;
+        u32 length;  /* list length and mode measured by the current launch */
+        u32 mode;
+        u32 taken;
+        bool wrong_exit;
+        u32 exit_reason;
+        sample_summary_t summary[MSRLIST_MODES][MSRLIST_MAX + 1];
+} msrlist_bench_t;
+
+static bool
+msr_supported(u32 msr)
+{
+        u32 eax, ebx, ecx, edx;
+
+        switch (msr) {
+        case IA32_SPEC_CTRL:
+                __cpuid_all(0, 0, &eax, &ebx, &ecx, &edx);
+                if (eax < 7)
+                        return false;
+                __cpuid_all(7, 0, &eax, &ebx, &ecx, &edx);
+                return !!(edx & CPUID_7_EDX_SPEC_CTRL);
+        case IA32_TSC_AUX:
+                __cpuid_all(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+                return !!(edx & CPUID_80000001_EDX_RDTSCP);
+        default:
+                return true;
+        }
+}
+
+/* Guest runs host code, so guest and host values of every MSR are the
+ * current ones and loading them in either direction changes nothing */
+static void
+fill_msr_areas(msrlist_bench_t *b)
+{
+        vmx_msr_entry_t *store = (vmx_msr_entry_t *)b->exit_store.p;
+        vmx_msr_entry_t *host = (vmx_msr_entry_t *)b->exit_load.p;
+        vmx_msr_entry_t *guest = (vmx_msr_entry_t *)b->entry_load.p;
+        u32 n;
+
+        for (n = 0; n < b->msr_count; ++n) {
+                store[n].index = b->msrs[n];
+                store[n].value = 0;
+                host[n].index = b->msrs[n];
+                host[n].value = __rdmsr(b->msrs[n]);
+                guest[n] = host[n];
+        }
+}
+
+static void
+set_msr_counts(u32 n)
+{
+        __vmwrite(VMCS_VMEXIT_MSR_STORE_CNT, n);
+        __vmwrite(VMCS_VMEXIT_MSR_LOAD_CNT, n);
+        __vmwrite(VMCS_VMENTRY_MSR_LOAD_CNT, n);
+}
+
+/* Manual switching mirrors the lists: guest values are written before VM
+ * entry, then guest values are read and host values written after VM exit */
+static u64
+manual_round_trip(msrlist_bench_t *b, u32 n)
+{
+        vmx_msr_entry_t *store = (vmx_msr_entry_t *)b->exit_store.p;
+        vmx_msr_entry_t *host = (vmx_msr_entry_t *)b->exit_load.p;
+        vmx_msr_entry_t *guest = (vmx_msr_entry_t *)b->entry_load.p;
+        u64 start = __get_tsc_start();
+        u32 i;
+
+        for (i = 0; i < n; ++i)
+                __wrmsr(guest[i].index, guest[i].value);
+        do_vmresume();
+        for (i = 0; i < n; ++i) {
+                store[i].value = __rdmsr(store[i].index);
+                __wrmsr(host[i].index, host[i].value);
+        }
+        return __get_tsc_end() - start;
+}
+
+/* Take a chunk of samples of the current list length and mode */
+static void
+measure_msrlist(vm_monitor_t *vmm, void *arg)
+{
+        msrlist_bench_t *b = arg;
+        u32 end = b->taken + VMX_SAMPLES_CHUNK;
+        u64 start, cycles;
+        u32 i;
+
+        if (end > b->count)
+                end = b->count;
+
+        fill_msr_areas(b);
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_code);
+        __vmwrite(VMCS_VMEXIT_MSR_STORE_ADDR, b->exit_store.pa);
+        __vmwrite(VMCS_VMEXIT_MSR_LOAD_ADDR, b->exit_load.pa);
+        __vmwrite(VMCS_VMENTRY_MSR_LOAD_ADDR, b->entry_load.pa);
+        set_msr_counts(b->mode == MSRLIST_AUTO ? b->length : 0);
+
+        for (i = 0; i < vmx_config.warmup + end - b->taken; ++i) {
+                if (b->mode == MSRLIST_AUTO) {
+                        start = __get_tsc_start();
+                        do_vmresume();
+                        cycles = __get_tsc_end() - start;
+                } else {
+                        cycles = manual_round_trip(b, b->length);
+                }
+                if (i >= vmx_config.warmup)
+                        b->samples[b->taken + i - vmx_config.warmup] = cycles;
+        }
+
+        b->exit_reason = (u32)__vmread(VMCS_EXIT_REASON);
+        if ((b->exit_reason & 0xffff) != VMEXIT_CPUID)
+                b->wrong_exit = true;
+        else
+                b->taken = end;
+
+        set_msr_counts(0);
+}
+
+/* Every list length and mode is taken in chunks and summarized with
+ * interrupts enabled */
+static bool
+measure_msrlists(msrlist_bench_t *b)
+{
+        u32 mode, n;
+
+        b->wrong_exit = false;
+        for (n = 0; n <= b->msr_count; ++n) {
+                for (mode = 0; mode < MSRLIST_MODES; ++mode) {
+                        b->length = n;
+                        b->mode = mode;
+                        b->taken = 0;
+                        if (!run_guest_chunked(measure_msrlist, b, &b->taken,
+                                               b->count))
+                                return false;
+                        if (b->wrong_exit)
+                                return true;
+                        stats_summarize(b->samples, b->count,
+                                        &b->summary[mode][n]);
+                }
+        }
+        return true;
+}
+
+static void
+report_msrlist(msrlist_bench_t *b)
+{
+        const sample_summary_t *first, *last;
+        char name[64];
+        u32 mode, n;
+
+        if (b->wrong_exit) {
+                vmlatency_printk("msr-list: unexpected exit reason %#x\n",
+                                 b->exit_reason);
+                return;
+        }
+
+        for (n = 0; n <= b->msr_count; ++n) {
+                for (mode = 0; mode < MSRLIST_MODES; ++mode) {
+                        vmlatency_snprintf(name, sizeof(name), "%s %u",
+                                           msrlist_mode_names[mode], n);
+                        stats_print_summary(name, &b->summary[mode][n]);
+                }
+        }
+
+        if (!b->msr_count)
+                return;
+
+        /* Added cost per MSR from medians of the empty and the full list */
+        for (mode = 0; mode < MSRLIST_MODES; ++mode) {
+                first = &b->summary[mode][0];
+                last = &b->summary[mode][b->msr_count];
+                vmlatency_printk("%s per MSR: %lld cycles\n",
+                                 msrlist_mode_names[mode],
+                                 ((long long)last->median
+                                  - (long long)first->median)
+                                 / (long long)b->msr_count);
+        }
+}
+
+void
+measure_vmlatency_msrlist(u32 count)
+{
+        msrlist_bench_t *b;
+        size_t size;
+        u32 n;
+
+        if (!count)
+                count = MSRLIST_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        b = vmlatency_malloc(sizeof(*b));
+        if (!b)
+                return;
+
+        b->count = count;
+        b->samples = vmlatency_malloc(size);
+        if (!b->samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out1;
+        }
+
+        for (n = 0; n < MSRLIST_MAX; ++n)
+                if (msr_supported(switched_msrs[n]))
+                        b->msrs[b->msr_count++] = switched_msrs[n];
+
+        if (allocate_vmpage(&b->exit_store) != 0)
+                goto out2;
+        if (allocate_vmpage(&b->exit_load) != 0)
+                goto out3;
+        if (allocate_vmpage(&b->entry_load) != 0)
+                goto out4;
+
+        if (measure_msrlists(b))
+                report_msrlist(b);
+
+        free_vmpage(&b->entry_load);
+out4:
+        free_vmpage(&b->exit_load);
+out3:
+        free_vmpage(&b->exit_store);
+out2:
+        vmlatency_free(b->samples, size);
+out1:
+        vmlatency_free(b, sizeof(*b));
+}
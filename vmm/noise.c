@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "noise.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+
+/* MSR_SMI_COUNT exists on family 6 since Nehalem, except Bonnell and
+ * Saltwell Atoms */
+static bool
+has_smi_count(void)
+{
+        static const u32 old_atoms[] = {0x1c, 0x26, 0x27, 0x35, 0x36};
+        u32 eax, ebx, ecx, edx, family, model, i;
+
+        __cpuid_all(1, 0, &eax, &ebx, &ecx, &edx);
+        family = (eax >> 8) & 0xf;
+        model = ((eax >> 4) & 0xf) | ((eax >> 12) & 0xf0);
+        if (family != 6 || model < 0x1a)
+                return false;
+
+        for (i = 0; i < sizeof(old_atoms) / sizeof(old_atoms[0]); ++i)
+                if (model == old_atoms[i])
+                        return false;
+        return true;
+}
+
+void
+noise_read(noise_sample_t *s)
+{
+        static int smi_count = -1;  /* unknown, not supported, supported */
+
+        if (smi_count < 0)
+                smi_count = has_smi_count();
+
+        s->smi = smi_count ? (u32)__rdmsr(MSR_SMI_COUNT) : 0;
+        s->nmi = vmlatency_nmi_count();
+}
+
+bool
+noise_delta(const noise_sample_t *start, const noise_sample_t *end,
+            noise_sample_t *delta)
+{
+        /* SMI counter is 32 bits wide */
+        delta->smi = (u32)(end->smi - start->smi);
+        delta->nmi = end->nmi - start->nmi;
+        return delta->smi || delta->nmi;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __NOISE_H__
+#define __NOISE_H__
+
+#include "types.h"
+
+/* SMI and NMI counts of the current CPU. Measurement windows where they
+ * change were interrupted by firmware or by the host, and their excess time
+ * is not caused by VMX transitions */
+typedef struct noise_sample {
+        u64 smi;
+        u64 nmi;
+} noise_sample_t;
+
+/* Sample modes count SMIs and NMIs of every NOISE_WINDOW samples */
+#define NOISE_WINDOW 1000
+#define NOISE_WINDOWS(count) (((count) + NOISE_WINDOW - 1) / NOISE_WINDOW)
+
+/* Read counts, SMI count is 0 if MSR_SMI_COUNT is not supported */
+void noise_read(noise_sample_t *s);
+
+/* Store counts between the samples to delta and return true if any of them
+ * changed */
+bool noise_delta(const noise_sample_t *start, const noise_sample_t *end,
+                 noise_sample_t *delta);
+
+#endif /* __NOISE_H__ */
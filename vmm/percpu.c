@@ -0,0 +1,970 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+typedef struct cpu_run {
+        vm_monitor_t *vmm;
+        u64 *samples;
+        bool initialized;
+        bool failed;  /* in any round */
+        u64 start_ns;
+        u64 end_ns;
+} cpu_run_t;
+
+/* Samples are taken in rounds of VMX_SAMPLES_CHUNK, one stop-machine call
+ * per round, so the machine is not stalled for long */
+typedef struct {
+        cpu_run_t *cpus;  /* indexed by CPU id */
+        int ncpus;
+        u32 online;
+        u32 count;
+        u32 taken;  /* samples of previous rounds */
+        u32 end;    /* samples after this round */
+        u64 busy_ns;  /* sum of round durations */
+        volatile u32 arrived;
+} all_cpus_t;
+
+/* Wait until every online CPU gets here. CPUs which failed to launch the
+ * guest also arrive, so nobody waits forever */
+static void
+cpu_barrier(all_cpus_t *a)
+{
+        __locked_inc(&a->arrived);
+        while (a->arrived < a->online)
+                __pause();
+}
+
+static void
+measure_concurrent(vm_monitor_t *vmm, void *arg)
+{
+        all_cpus_t *a = arg;
+        cpu_run_t *c = &a->cpus[vmlatency_cpu_id()];
+        u64 start;
+        u32 i;
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        cpu_barrier(a);
+
+        c->start_ns = vmlatency_time_ns();
+        for (i = a->taken; i < a->end; ++i) {
+                start = __get_tsc_start();
+                do_vmresume();
+                c->samples[i] = __get_tsc_end() - start;
+        }
+        c->end_ns = vmlatency_time_ns();
+}
+
+static int
+run_on_cpu(void *arg)
+{
+        all_cpus_t *a = arg;
+        cpu_run_t *c = &a->cpus[vmlatency_cpu_id()];
+
+        /* CPU came online after memory was allocated */
+        if (!c->initialized)
+                return 0;
+
+        if (c->failed || !vmm_run(c->vmm, measure_concurrent, a)) {
+                c->failed = true;
+                cpu_barrier(a);
+        }
+        return 0;
+}
+
+/* Duration of the round from the first CPU starting to the last one
+ * finishing */
+static void
+account_round(all_cpus_t *a)
+{
+        u64 first_ns = ~0ull, last_ns = 0;
+        int cpu;
+
+        for (cpu = 0; cpu < a->ncpus; ++cpu) {
+                cpu_run_t *c = &a->cpus[cpu];
+                if (!c->initialized || c->failed)
+                        continue;
+                if (c->start_ns < first_ns)
+                        first_ns = c->start_ns;
+                if (c->end_ns > last_ns)
+                        last_ns = c->end_ns;
+        }
+
+        if (last_ns > first_ns)
+                a->busy_ns += last_ns - first_ns;
+}
+
+static void
+report_all_cpus(all_cpus_t *a)
+{
+        sample_summary_t summary;
+        char name[16];
+        u64 exits = 0;
+        u32 launched = 0;
+        int cpu;
+
+        for (cpu = 0; cpu < a->ncpus; ++cpu) {
+                cpu_run_t *c = &a->cpus[cpu];
+                if (!c->initialized)
+                        continue;
+
+                if (c->failed) {
+                        vmlatency_printk("cpu%d: failed\n", cpu);
+                        continue;
+                }
+
+                stats_summarize(c->samples, a->count, &summary);
+                vmlatency_snprintf(name, sizeof(name), "cpu%d", cpu);
+                stats_print_summary(name, &summary);
+
+                exits += a->count;
+                launched++;
+        }
+
+        if (launched && a->busy_ns)
+                vmlatency_printk("all: cpus %u exits %llu exits/s %llu\n",
+                                 launched, exits,
+                                 exits * 1000000000ull / a->busy_ns);
+}
+
+void
+measure_vmlatency_all_cpus(u32 count)
+{
+        all_cpus_t a = {0};
+        size_t size;
+        int cpu;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+
+        a.count = count;
+        a.ncpus = vmlatency_cpu_count();
+        a.cpus = vmlatency_malloc(a.ncpus * sizeof(cpu_run_t));
+        if (!a.cpus)
+                return;
+
+        /* Everything that may sleep is done before CPUs are stopped */
+        for (cpu = 0; cpu < a.ncpus; ++cpu) {
+                cpu_run_t *c = &a.cpus[cpu];
+                if (!vmlatency_cpu_online(cpu) || !vmx_config_has_cpu(cpu))
+                        continue;
+
+                c->samples = vmlatency_malloc(size);
+                c->vmm = vmm_get(cpu);
+                if (!c->samples || !c->vmm) {
+                        vmlatency_printk("cpu%d: failed to allocate memory\n",
+                                         cpu);
+                        goto out;
+                }
+                c->initialized = true;
+                a.online++;
+        }
+
+        for (a.taken = 0; a.taken < a.count; a.taken = a.end) {
+                a.end = a.taken + VMX_SAMPLES_CHUNK;
+                if (a.end > a.count)
+                        a.end = a.count;
+                a.arrived = 0;
+
+                if (vmlatency_run_on_all_cpus(run_on_cpu, &a) < 0) {
+                        vmlatency_printk("Running on all CPUs is not"
+                                         " supported\n");
+                        goto out;
+                }
+                account_round(&a);
+                vmlatency_yield();
+        }
+
+        report_all_cpus(&a);
+
+out:
+        for (cpu = 0; cpu < a.ncpus; ++cpu) {
+                cpu_run_t *c = &a.cpus[cpu];
+                if (c->samples)
+                        vmlatency_free(c->samples, size);
+        }
+        vmlatency_free(a.cpus, a.ncpus * sizeof(cpu_run_t));
+}
+
+typedef struct cpu_topology {
+        u32 apic_id;
+        u32 package;
+        u32 core;
+        u32 smt;
+        u32 core_type;  /* 0 if CPU is not hybrid */
+} cpu_topology_t;
+
+/* Decode x2APIC ID of the current CPU using CPUID leaf 0x1f or 0xb. Core ID
+ * is relative to the package and includes die and module bits if any */
+static void
+read_cpu_topology(cpu_topology_t *t)
+{
+        u32 eax, ebx, ecx, edx, max_leaf, leaf, level;
+        u32 smt_shift = 0, pkg_shift = 0;
+
+        __cpuid_all(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+        if (max_leaf >= CPUID_LEAF_TOPOLOGY_V2) {
+                __cpuid_all(CPUID_LEAF_TOPOLOGY_V2, 0, &eax, &ebx, &ecx, &edx);
+                leaf = ebx ? CPUID_LEAF_TOPOLOGY_V2 : CPUID_LEAF_TOPOLOGY;
+        } else {
+                leaf = CPUID_LEAF_TOPOLOGY;
+        }
+
+        /* Initial APIC ID is used if there is no extended topology */
+        __cpuid_all(1, 0, &eax, &ebx, &ecx, &edx);
+        t->apic_id = ebx >> 24;
+
+        if (max_leaf >= CPUID_LEAF_TOPOLOGY) {
+                for (level = 0; level < 8; ++level) {
+                        __cpuid_all(leaf, level, &eax, &ebx, &ecx, &edx);
+                        if (((ecx >> 8) & 0xff) == CPUID_TOPOLOGY_INVALID)
+                                break;
+                        if (((ecx >> 8) & 0xff) == CPUID_TOPOLOGY_SMT)
+                                smt_shift = eax & 0x1f;
+                        pkg_shift = eax & 0x1f;
+                        t->apic_id = edx;
+                }
+        }
+
+        t->smt = t->apic_id & (__BIT(smt_shift) - 1);
+        t->core = (t->apic_id >> smt_shift)
+                & (__BIT(pkg_shift - smt_shift) - 1);
+        t->package = t->apic_id >> pkg_shift;
+
+        t->core_type = 0;
+        if (max_leaf >= CPUID_LEAF_HYBRID) {
+                __cpuid_all(7, 0, &eax, &ebx, &ecx, &edx);
+                if (edx & CPUID_7_EDX_HYBRID) {
+                        __cpuid_all(CPUID_LEAF_HYBRID, 0,
+                                    &eax, &ebx, &ecx, &edx);
+                        t->core_type = eax >> 24;
+                }
+        }
+}
+
+static const char *
+core_type_name(u32 core_type)
+{
+        switch (core_type) {
+        case CPUID_CORE_TYPE_ATOM: return " E-core";
+        case CPUID_CORE_TYPE_CORE: return " P-core";
+        default: return "";
+        }
+}
+
+typedef struct {
+        sample_buffer_t buf;
+        cpu_topology_t topology;
+} sweep_t;
+
+static int
+sweep_cpu(void *arg)
+{
+        sweep_t *sw = arg;
+
+        read_cpu_topology(&sw->topology);
+        return run_guest_samples(&sw->buf) ? 0 : -1;
+}
+
+void
+measure_vmlatency_sweep(u32 count)
+{
+        sweep_t sw;
+        sample_summary_t summary;
+        char name[64];
+        size_t size;
+        int cpu;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+
+        sw.buf.count = count;
+        sw.buf.noise = NULL;
+        sw.buf.samples = vmlatency_malloc(size);
+        if (!sw.buf.samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                return;
+        }
+
+        for (cpu = 0; cpu < vmlatency_cpu_count(); ++cpu) {
+                if (!vmlatency_cpu_online(cpu) || !vmx_config_has_cpu(cpu))
+                        continue;
+
+                if (vmlatency_run_on_cpu(cpu, sweep_cpu, &sw) != 0) {
+                        vmlatency_printk("cpu%d: failed\n", cpu);
+                        continue;
+                }
+
+                stats_summarize(sw.buf.samples, sw.buf.count, &summary);
+                vmlatency_snprintf(name, sizeof(name),
+                                   "cpu%d pkg %u core %u smt %u node %d%s",
+                                   cpu, sw.topology.package, sw.topology.core,
+                                   sw.topology.smt, vmlatency_cpu_node(cpu),
+                                   core_type_name(sw.topology.core_type));
+                stats_print_summary(name, &summary);
+        }
+
+        vmlatency_free(sw.buf.samples, size);
+}
+
+#define KICK_DEFAULT_SAMPLES 10000
+/* Sender gives up if the guest does not run for this many TSC cycles */
+#define KICK_TIMEOUT (1ull << 32)
+/* VMX-preemption timer ticks between guest exits letting the target notice
+ * that the sender gave up */
+#define KICK_WATCHDOG 0x100000
+
+extern void guest_kick(void);
+
+typedef enum {
+        KICK_OK,
+        KICK_UNSUPPORTED,
+        KICK_WRONG_EXIT,
+        KICK_TIMED_OUT,
+} kick_status_t;
+
+typedef struct {
+        int target;  /* CPU running the guest */
+        int sender;
+        u32 target_apic;
+        u32 vector;
+        u32 count;
+        u64 *samples;
+        vm_monitor_t *vmm;
+        guest_kick_t guest;
+        volatile u64 send_tsc;
+        volatile u64 send_seq;  /* iteration of send_tsc */
+        volatile bool stop;
+        bool launched;
+        kick_status_t status;
+        u32 exit_reason;
+        u32 warmup;  /* iterations of every round */
+        u32 total;   /* iterations of this round */
+        u64 seq;     /* iterations of previous rounds */
+        u32 taken;
+        u32 end;     /* samples after this round */
+        u64 foreign;  /* exits caused by interrupts of the host */
+        u64 resend[256 / 64];  /* vectors to raise again after the run */
+} kick_t;
+
+static void
+measure_kick_target(vm_monitor_t *vmm, void *arg)
+{
+        kick_t *k = arg;
+        u32 i = 0, vector;
+        u64 exit_tsc;
+
+        /* VMX-preemption timer is the watchdog, without it the target would
+         * spin in the guest forever if the sender gave up */
+        if (!vmx_set_pin_ctls(vmm, vmm->pin_ctls
+                                   | VMX_PIN_CTL_EXT_INTERRUPT_EXITING
+                                   | VMX_PIN_CTL_ACTIVATE_PTIMER) ||
+            !vmx_set_exit_ctls(vmm, vmm->exit_ctls
+                                    | VMCS_VMEXIT_CTL_ACK_INTERRUPT_ON_EXIT)) {
+                k->status = KICK_UNSUPPORTED;
+                goto out;
+        }
+        __vmwrite(VMCS_GUEST_PTIMER_VALUE, KICK_WATCHDOG);
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_kick);
+
+        while (i < k->total && !k->stop) {
+                k->guest.seq = k->seq + i + 1;
+                do_vmresume_arg(&k->guest);
+                exit_tsc = __get_tsc_end();
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_kick);
+
+                k->exit_reason = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+                if (k->exit_reason == VMEXIT_PTIMER)
+                        continue;
+                if (k->exit_reason != VMEXIT_EXTERNAL_INT) {
+                        k->status = KICK_WRONG_EXIT;
+                        break;
+                }
+
+                vector = (u32)__vmread(VMCS_VM_EXIT_INT_INFO)
+                       & VMX_INT_INFO_VECTOR_MASK;
+                __wrmsr(X2APIC_EOI, 0);
+                if (vector != k->vector) {
+                        k->resend[vector / 64] |= __BIT(vector % 64);
+                        k->foreign++;
+                        continue;
+                }
+
+                /* IPI sent for another iteration, e.g. late from an earlier
+                 * round, is not timed and is raised again for the host */
+                if (k->send_seq != k->guest.seq) {
+                        k->resend[vector / 64] |= __BIT(vector % 64);
+                        continue;
+                }
+
+                if (i >= k->warmup)
+                        k->samples[k->taken + i - k->warmup] =
+                                exit_tsc - k->send_tsc;
+                i++;
+        }
+
+        if (i > k->warmup)
+                k->taken += i - k->warmup;
+
+out:
+        k->stop = true;
+
+        /* Host interrupts acknowledged on exit are raised again and handled
+         * once interrupts are enabled */
+        for (vector = 0; vector < 256; ++vector) {
+                if (k->resend[vector / 64] & __BIT(vector % 64))
+                        __wrmsr(X2APIC_SELF_IPI, vector);
+        }
+        for (vector = 0; vector < 256 / 64; ++vector)
+                k->resend[vector] = 0;
+}
+
+/* Send IPI as soon as the guest of the current iteration runs. Timestamp
+ * and iteration are visible to the target before the IPI arrives */
+static void
+kick_sender(kick_t *k)
+{
+        u64 icr = ((u64)k->target_apic << 32) | k->vector;
+        u64 start, seq;
+        u32 i;
+
+        for (i = 0; i < k->total; ++i) {
+                seq = k->seq + i + 1;
+                start = __get_tsc();
+                while (k->guest.in_guest != seq) {
+                        if (k->stop)
+                                return;
+                        if (__get_tsc() - start > KICK_TIMEOUT) {
+                                k->status = KICK_TIMED_OUT;
+                                k->stop = true;
+                                return;
+                        }
+                        __pause();
+                }
+
+                k->send_tsc = __get_tsc_start();
+                k->send_seq = seq;
+                __mfence();
+                __wrmsr(X2APIC_ICR, icr);
+        }
+}
+
+static int
+kick_on_cpu(void *arg)
+{
+        kick_t *k = arg;
+        int cpu = vmlatency_cpu_id();
+
+        if (cpu == k->target) {
+                k->launched = vmm_run(k->vmm, measure_kick_target, k);
+                k->stop = true;
+        } else if (cpu == k->sender) {
+                kick_sender(k);
+        }
+        return 0;
+}
+
+/* Samples are taken in rounds of VMX_SAMPLES_CHUNK, one stop-machine call
+ * per round, so the machine is not stalled for long */
+static void
+run_kick(kick_t *k)
+{
+        k->warmup = vmx_config.warmup;
+        if (k->warmup > VMX_SAMPLES_CHUNK)
+                k->warmup = VMX_SAMPLES_CHUNK;
+        k->seq = 0;
+
+        for (k->taken = 0; k->taken < k->count; k->seq += k->total) {
+                k->end = k->taken + VMX_SAMPLES_CHUNK;
+                if (k->end > k->count)
+                        k->end = k->count;
+                k->total = k->warmup + k->end - k->taken;
+                k->stop = false;
+                k->launched = false;
+
+                vmlatency_run_on_all_cpus(kick_on_cpu, k);
+                if (!k->launched || k->status != KICK_OK ||
+                    k->taken < k->end)
+                        break;
+                vmlatency_yield();
+        }
+}
+
+static int
+topology_on_cpu(void *arg)
+{
+        cpu_topology_t *topology = arg;
+
+        read_cpu_topology(&topology[vmlatency_cpu_id()]);
+        return 0;
+}
+
+/* Another online CPU related to the target as the pair says, or -1 */
+static int
+find_cpu_pair(const cpu_topology_t *topology, int target, u32 pair)
+{
+        const cpu_topology_t *t = &topology[target];
+        const cpu_topology_t *s;
+        int cpu;
+
+        for (cpu = 0; cpu < vmlatency_cpu_count(); ++cpu) {
+                if (cpu == target || !vmlatency_cpu_online(cpu))
+                        continue;
+
+                s = &topology[cpu];
+                switch (pair) {
+                case VMX_PAIR_SMT:
+                        if (s->package == t->package && s->core == t->core)
+                                return cpu;
+                        break;
+                case VMX_PAIR_PACKAGE:
+                        if (s->package == t->package && s->core != t->core)
+                                return cpu;
+                        break;
+                case VMX_PAIR_REMOTE:
+                        if (s->package != t->package)
+                                return cpu;
+                        break;
+                }
+        }
+        return -1;
+}
+
+static void
+report_kick(kick_t *k, const char *pair)
+{
+        sample_summary_t summary;
+        char name[64];
+
+        if (!k->launched) {
+                vmlatency_printk("kick %s: cpu%d failed\n", pair, k->target);
+                return;
+        }
+
+        switch (k->status) {
+        case KICK_OK:
+                break;
+        case KICK_UNSUPPORTED:
+                vmlatency_printk("kick %s: not supported\n", pair);
+                return;
+        case KICK_WRONG_EXIT:
+                vmlatency_printk("kick %s: unexpected exit reason %u\n", pair,
+                                 k->exit_reason);
+                return;
+        case KICK_TIMED_OUT:
+                vmlatency_printk("kick %s: timed out\n", pair);
+                break;
+        }
+
+        if (!k->taken)
+                return;
+
+        stats_summarize(k->samples, k->taken, &summary);
+        vmlatency_snprintf(name, sizeof(name), "kick %s cpu%d->cpu%d", pair,
+                           k->sender, k->target);
+        stats_print_summary(name, &summary);
+        vmlatency_printk("kick %s: host interrupts %llu\n", pair, k->foreign);
+}
+
+static const struct {
+        u32 pair;
+        const char *name;
+} cpu_pairs[] = {
+        {VMX_PAIR_SMT, "smt"},
+        {VMX_PAIR_PACKAGE, "package"},
+        {VMX_PAIR_REMOTE, "remote"},
+};
+
+#define CPU_PAIRS_COUNT (sizeof(cpu_pairs) / sizeof(cpu_pairs[0]))
+
+void
+measure_vmlatency_kick(u32 count, int cpu)
+{
+        cpu_topology_t *topology;
+        kick_t *k;
+        u64 apic_base = __rdmsr(IA32_APIC_BASE);
+        size_t size, topology_size;
+        int vector = vmlatency_ipi_vector();
+        u32 n, i;
+
+        if (vector < 0) {
+                vmlatency_printk("IPI vector is not supported\n");
+                return;
+        }
+
+        /* Sender writes x2APIC ICR with x2APIC ID of the target */
+        if (!(apic_base & APIC_BASE_ENABLE) ||
+            !(apic_base & APIC_BASE_X2APIC_ENABLE)) {
+                vmlatency_printk("Local APIC is not in x2APIC mode\n");
+                return;
+        }
+
+        if (cpu < 0)
+                cpu = vmx_config_first_cpu();
+        if (cpu < 0) {
+                vmlatency_printk("No online CPUs in CPU mask\n");
+                return;
+        }
+
+        if (!count)
+                count = KICK_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+        topology_size = vmlatency_cpu_count() * sizeof(cpu_topology_t);
+
+        k = vmlatency_malloc(sizeof(*k));
+        if (!k)
+                return;
+        topology = vmlatency_malloc(topology_size);
+        if (!topology)
+                goto out1;
+        k->samples = vmlatency_malloc(size);
+        k->vmm = vmm_get(cpu);
+        if (!k->samples || !k->vmm) {
+                vmlatency_printk("cpu%d: failed to allocate memory\n", cpu);
+                goto out2;
+        }
+
+        if (vmlatency_run_on_all_cpus(topology_on_cpu, topology) < 0) {
+                vmlatency_printk("Running on all CPUs is not supported\n");
+                goto out2;
+        }
+
+        for (n = 0; n < CPU_PAIRS_COUNT; ++n) {
+                if (!(vmx_config.kick_pairs & cpu_pairs[n].pair))
+                        continue;
+
+                k->target = cpu;
+                k->sender = find_cpu_pair(topology, cpu, cpu_pairs[n].pair);
+                if (k->sender < 0) {
+                        vmlatency_printk("kick %s: no CPU for cpu%d\n",
+                                         cpu_pairs[n].name, cpu);
+                        continue;
+                }
+
+                k->target_apic = topology[cpu].apic_id;
+                k->vector = vector;
+                k->count = count;
+                k->guest.in_guest = 0;
+                k->send_tsc = 0;
+                k->send_seq = 0;
+                k->status = KICK_OK;
+                k->taken = 0;
+                k->foreign = 0;
+                for (i = 0; i < 256 / 64; ++i)
+                        k->resend[i] = 0;
+
+                run_kick(k);
+                report_kick(k, cpu_pairs[n].name);
+        }
+
+out2:
+        if (k->samples)
+                vmlatency_free(k->samples, size);
+        vmlatency_free(topology, topology_size);
+out1:
+        vmlatency_free(k, sizeof(*k));
+}
+
+#define MIGRATE_DEFAULT_MOVES 1000
+/* Round-trips timed on the new CPU after every move */
+#define MIGRATE_ROUNDS 16
+/* CPU gives up waiting for the VMCS after this many TSC cycles */
+#define MIGRATE_TIMEOUT (1ull << 32)
+/* Moves of one stop-machine round */
+#define MIGRATE_CHUNK (VMX_SAMPLES_CHUNK / MIGRATE_ROUNDS)
+
+typedef enum {
+        MIGRATE_OK,
+        MIGRATE_FAILED,
+        MIGRATE_TIMED_OUT,
+} migrate_status_t;
+
+/* VMCS moves back and forth between cpu[0] and cpu[1]. Turn t is done by
+ * cpu[t % 2]: it loads the VMCS moved by turn t - 1, runs the guest and
+ * VMCLEARs the VMCS for the next turn. Every round of moves starts with
+ * turn 0 setting up the VMCS */
+typedef struct {
+        int cpu[2];
+        vm_monitor_t *vmm[2];
+        vmpage_t vmcs;
+        u32 moves;
+        u32 taken;  /* moves of previous rounds */
+        u32 end;    /* moves after this round */
+        volatile u32 turn;
+        volatile bool stop;
+        bool launched[2];
+        migrate_status_t status;
+        u64 *load;    /* VMPTRLD, host state and VMLAUNCH of every move */
+        u64 *clear;   /* VMCLEAR before every move */
+        u64 *rounds;  /* MIGRATE_ROUNDS round-trips after every move */
+} migrate_t;
+
+static bool
+wait_turn(migrate_t *m, u32 turn)
+{
+        u64 start = __get_tsc();
+
+        while (m->turn != turn) {
+                if (m->stop)
+                        return false;
+                if (__get_tsc() - start > MIGRATE_TIMEOUT) {
+                        m->status = MIGRATE_TIMED_OUT;
+                        m->stop = true;
+                        return false;
+                }
+                __pause();
+        }
+        return true;
+}
+
+static void
+measure_migrate(vm_monitor_t *vmm, void *arg)
+{
+        migrate_t *m = arg;
+        int side = vmlatency_cpu_id() == m->cpu[1];
+        bool current = false;
+        u32 turns = m->end - m->taken;
+        u64 start;
+        u32 turn, i;
+
+        for (turn = side; turn <= turns; turn += 2) {
+                if (!wait_turn(m, turn))
+                        break;
+
+                start = __get_tsc_start();
+                if (turn == 0) {
+                        current = true;
+                        if (vmm_setup_vmcs(vmm, &m->vmcs) != 0 ||
+                            do_vmlaunch() != 0) {
+                                m->status = MIGRATE_FAILED;
+                                m->stop = true;
+                                break;
+                        }
+                } else {
+                        if (__vmptrld(m->vmcs.pa) != 0) {
+                                m->status = MIGRATE_FAILED;
+                                m->stop = true;
+                                break;
+                        }
+                        current = true;
+                        vmm_load_host_state(vmm);
+                        if (do_vmlaunch() != 0) {
+                                m->status = MIGRATE_FAILED;
+                                m->stop = true;
+                                break;
+                        }
+                        m->load[m->taken + turn - 1] =
+                                __get_tsc_end() - start;
+                }
+
+                for (i = 0; i < MIGRATE_ROUNDS; ++i) {
+                        start = __get_tsc_start();
+                        do_vmresume();
+                        if (turn)
+                                m->rounds[(m->taken + turn - 1)
+                                          * MIGRATE_ROUNDS + i] =
+                                        __get_tsc_end() - start;
+                }
+
+                start = __get_tsc_start();
+                __vmclear(m->vmcs.pa);
+                current = false;
+                if (turn < turns)
+                        m->clear[m->taken + turn] = __get_tsc_end() - start;
+
+                m->turn = turn + 1;
+        }
+
+        /* VMCS is still current if VMLAUNCH failed */
+        if (current)
+                __vmclear(m->vmcs.pa);
+        __vmptrld(vmm->vmcs.pa);
+}
+
+static int
+migrate_on_cpu(void *arg)
+{
+        migrate_t *m = arg;
+        int cpu = vmlatency_cpu_id();
+        int side;
+
+        if (cpu != m->cpu[0] && cpu != m->cpu[1])
+                return 0;
+
+        side = cpu == m->cpu[1];
+        m->launched[side] = vmm_run(m->vmm[side], measure_migrate, m);
+        if (!m->launched[side])
+                m->stop = true;
+        return 0;
+}
+
+/* One stop-machine call per round of MIGRATE_CHUNK moves, so the machine
+ * is not stalled for long */
+static void
+run_migrate(migrate_t *m)
+{
+        for (m->taken = 0; m->taken < m->moves; m->taken = m->end) {
+                m->end = m->taken + MIGRATE_CHUNK;
+                if (m->end > m->moves)
+                        m->end = m->moves;
+                m->turn = 0;
+                m->stop = false;
+                m->launched[0] = false;
+                m->launched[1] = false;
+
+                vmlatency_run_on_all_cpus(migrate_on_cpu, m);
+                if (!m->launched[0] || !m->launched[1] ||
+                    m->status != MIGRATE_OK)
+                        break;
+                vmlatency_yield();
+        }
+}
+
+static void
+report_migrate(migrate_t *m, const char *pair)
+{
+        sample_summary_t summary;
+        char name[64];
+        u64 *samples = m->clear;
+        u32 i, n;
+
+        if (!m->launched[0] || !m->launched[1]) {
+                vmlatency_printk("migrate %s: failed to launch\n", pair);
+                return;
+        }
+
+        switch (m->status) {
+        case MIGRATE_OK:
+                break;
+        case MIGRATE_FAILED:
+                vmlatency_printk("migrate %s: VMPTRLD or VMLAUNCH failed\n",
+                                 pair);
+                return;
+        case MIGRATE_TIMED_OUT:
+                vmlatency_printk("migrate %s: timed out\n", pair);
+                return;
+        }
+
+        vmlatency_snprintf(name, sizeof(name), "migrate %s cpu%d<->cpu%d clear",
+                           pair, m->cpu[0], m->cpu[1]);
+        stats_summarize(m->clear, m->moves, &summary);
+        stats_print_summary(name, &summary);
+
+        vmlatency_snprintf(name, sizeof(name), "migrate %s cpu%d<->cpu%d load",
+                           pair, m->cpu[0], m->cpu[1]);
+        stats_summarize(m->load, m->moves, &summary);
+        stats_print_summary(name, &summary);
+
+        /* Distribution of i-th round-trip after the move. Clear samples are
+         * summarized already, so their buffer is reused */
+        for (i = 0; i < MIGRATE_ROUNDS; ++i) {
+                for (n = 0; n < m->moves; ++n)
+                        samples[n] = m->rounds[n * MIGRATE_ROUNDS + i];
+                stats_summarize(samples, m->moves, &summary);
+                vmlatency_snprintf(name, sizeof(name),
+                                   "migrate %s round-trip %u", pair, i + 1);
+                stats_print_summary(name, &summary);
+        }
+}
+
+void
+measure_vmlatency_migrate(u32 count, int cpu)
+{
+        cpu_topology_t *topology;
+        migrate_t *m;
+        size_t size, topology_size;
+        u32 n;
+
+        if (cpu < 0)
+                cpu = vmx_config_first_cpu();
+        if (cpu < 0) {
+                vmlatency_printk("No online CPUs in CPU mask\n");
+                return;
+        }
+
+        if (!count)
+                count = MIGRATE_DEFAULT_MOVES;
+        size = (size_t)count * sizeof(u64);
+        topology_size = vmlatency_cpu_count() * sizeof(cpu_topology_t);
+
+        m = vmlatency_malloc(sizeof(*m));
+        if (!m)
+                return;
+        topology = vmlatency_malloc(topology_size);
+        m->load = vmlatency_malloc(size);
+        m->clear = vmlatency_malloc(size);
+        m->rounds = vmlatency_malloc(size * MIGRATE_ROUNDS);
+        if (!topology || !m->load || !m->clear || !m->rounds ||
+            allocate_vmpage(&m->vmcs) != 0) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        if (vmlatency_run_on_all_cpus(topology_on_cpu, topology) < 0) {
+                vmlatency_printk("Running on all CPUs is not supported\n");
+                goto out;
+        }
+
+        for (n = 0; n < CPU_PAIRS_COUNT; ++n) {
+                if (!(vmx_config.migrate_pairs & cpu_pairs[n].pair))
+                        continue;
+
+                m->cpu[0] = cpu;
+                m->cpu[1] = find_cpu_pair(topology, cpu, cpu_pairs[n].pair);
+                if (m->cpu[1] < 0) {
+                        vmlatency_printk("migrate %s: no CPU for cpu%d\n",
+                                         cpu_pairs[n].name, cpu);
+                        continue;
+                }
+
+                m->vmm[0] = vmm_get(m->cpu[0]);
+                m->vmm[1] = vmm_get(m->cpu[1]);
+                if (!m->vmm[0] || !m->vmm[1]) {
+                        vmlatency_printk("migrate %s: failed to allocate"
+                                         " memory\n", cpu_pairs[n].name);
+                        continue;
+                }
+
+                m->moves = count;
+                m->status = MIGRATE_OK;
+
+                run_migrate(m);
+                report_migrate(m, cpu_pairs[n].name);
+        }
+
+out:
+        if (m->vmcs.p)
+                free_vmpage(&m->vmcs);
+        if (m->rounds)
+                vmlatency_free(m->rounds, size * MIGRATE_ROUNDS);
+        if (m->clear)
+                vmlatency_free(m->clear, size);
+        if (m->load)
+                vmlatency_free(m->load, size);
+        if (topology)
+                vmlatency_free(topology, topology_size);
+        vmlatency_free(m, sizeof(*m));
+}
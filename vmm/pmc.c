@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pmc.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+
+/* General-purpose counters used at most */
+#define PMC_MAX_GP 8
+
+typedef struct pmc_event {
+        const char *name;
+        u32 event;   /* VMX_PMC_* */
+        u32 evtsel;  /* event select, unit mask, edge and counter mask */
+} pmc_event_t;
+
+#define EVTSEL(event, umask) ((event) | ((umask) << PERFEVTSEL_UMASK_SHIFT))
+
+/* Architectural events where possible, others are encodings of Sandy Bridge
+ * and newer cores */
+static const pmc_event_t pmc_events[VMX_PMC_EVENTS] = {
+        {"l1d-misses", VMX_PMC_L1D_MISSES, EVTSEL(0x51, 0x01)},
+        {"l2-misses", VMX_PMC_L2_MISSES, EVTSEL(0x24, 0x3f)},
+        {"llc-misses", VMX_PMC_LLC_MISSES, EVTSEL(0x2e, 0x41)},
+        {"dtlb-misses", VMX_PMC_DTLB_MISSES, EVTSEL(0x08, 0x0e)},
+        {"machine-clears", VMX_PMC_MACHINE_CLEARS, EVTSEL(0xc3, 0x01)
+                | PERFEVTSEL_EDGE | (1 << PERFEVTSEL_CMASK_SHIFT)},
+        {"branch-misses", VMX_PMC_BRANCH_MISSES, EVTSEL(0xc5, 0x00)},
+};
+
+static const char *const fixed_names[PMC_FIXED_COUNT] = {
+        "instructions", "cycles", "ref-cycles",
+};
+
+/* Counter MSRs of the host, e.g. of the NMI watchdog */
+typedef struct {
+        u64 global_ctrl;
+        u64 fixed_ctrl;
+        u64 fixed[PMC_FIXED_COUNT];
+        u64 evtsel[PMC_MAX_GP];
+        u64 pmc[PMC_MAX_GP];
+} pmc_state_t;
+
+static void
+save_state(pmc_state_t *s, u32 gp)
+{
+        u32 i;
+
+        s->global_ctrl = __rdmsr(IA32_PERF_GLOBAL_CTRL);
+        __wrmsr(IA32_PERF_GLOBAL_CTRL, 0);
+
+        s->fixed_ctrl = __rdmsr(IA32_FIXED_CTR_CTRL);
+        for (i = 0; i < PMC_FIXED_COUNT; ++i)
+                s->fixed[i] = __rdmsr(IA32_FIXED_CTR0 + i);
+        for (i = 0; i < gp; ++i) {
+                s->evtsel[i] = __rdmsr(IA32_PERFEVTSEL0 + i);
+                s->pmc[i] = __rdmsr(IA32_PMC0 + i);
+        }
+}
+
+static void
+restore_state(const pmc_state_t *s, u32 gp)
+{
+        u32 i;
+
+        for (i = 0; i < gp; ++i) {
+                __wrmsr(IA32_PERFEVTSEL0 + i, s->evtsel[i]);
+                __wrmsr(IA32_PMC0 + i, s->pmc[i]);
+        }
+        for (i = 0; i < PMC_FIXED_COUNT; ++i)
+                __wrmsr(IA32_FIXED_CTR0 + i, s->fixed[i]);
+        __wrmsr(IA32_FIXED_CTR_CTRL, s->fixed_ctrl);
+        __wrmsr(IA32_PERF_GLOBAL_CTRL, s->global_ctrl);
+}
+
+/* Counts of one pass are stored to counts[0..PMC_FIXED_COUNT - 1] for fixed
+ * counters and to counts[PMC_FIXED_COUNT..] for general-purpose ones */
+static void
+run_pass(vm_monitor_t *vmm, u32 rounds, u64 enable, u32 gp, bool guest_only,
+         u64 *counts)
+{
+        u32 entry_ctls = vmm->entry_ctls, exit_ctls = vmm->exit_ctls;
+        u32 i;
+
+        for (i = 0; i < PMC_FIXED_COUNT; ++i)
+                __wrmsr(IA32_FIXED_CTR0 + i, 0);
+        for (i = 0; i < gp; ++i)
+                __wrmsr(IA32_PMC0 + i, 0);
+
+        if (guest_only) {
+                vmx_set_entry_ctls(vmm, entry_ctls
+                        | VMCS_VMENTRY_CTL_LOAD_IA32_PERF_GLOBAL_CTRL);
+                vmx_set_exit_ctls(vmm, exit_ctls
+                        | VMCS_VMEXIT_CTL_LOAD_IA32_PERF_GLOBAL_CTRL);
+                __vmwrite(VMCS_GUEST_IA32_PERF_GLOBAL_CTRL, enable);
+                __vmwrite(VMCS_HOST_IA32_PERF_GLOBAL_CTRL, 0);
+        } else {
+                __wrmsr(IA32_PERF_GLOBAL_CTRL, enable);
+        }
+
+        for (i = 0; i < rounds; ++i)
+                do_vmresume();
+
+        __wrmsr(IA32_PERF_GLOBAL_CTRL, 0);
+        if (guest_only) {
+                vmx_set_exit_ctls(vmm, exit_ctls);
+                vmx_set_entry_ctls(vmm, entry_ctls);
+        }
+
+        for (i = 0; i < PMC_FIXED_COUNT; ++i)
+                counts[i] = __rdmsr(IA32_FIXED_CTR0 + i);
+        for (i = 0; i < gp; ++i)
+                counts[PMC_FIXED_COUNT + i] = __rdmsr(IA32_PMC0 + i);
+}
+
+bool
+pmc_measure(vm_monitor_t *vmm, u32 rounds, pmc_counts_t *c)
+{
+        const pmc_event_t *group[PMC_MAX_GP];
+        u64 total[PMC_FIXED_COUNT + PMC_MAX_GP];
+        u64 guest[PMC_FIXED_COUNT + PMC_MAX_GP];
+        u64 enable, fixed_ctrl = 0;
+        u32 eax, ebx, ecx, edx;
+        u32 version, gp, n, i, grouped, next = 0;
+        pmc_state_t state;
+        bool first = true;
+
+        __cpuid_all(0, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < CPUID_LEAF_PERFMON)
+                return false;
+        __cpuid_all(CPUID_LEAF_PERFMON, 0, &eax, &ebx, &ecx, &edx);
+        version = eax & 0xff;
+        gp = (eax >> 8) & 0xff;
+        if (version < 2 || gp == 0 || (edx & 0x1f) < PMC_FIXED_COUNT)
+                return false;
+        if (gp > PMC_MAX_GP)
+                gp = PMC_MAX_GP;
+
+        c->split = (vmm->entry_ctls_allowed1
+                    & VMCS_VMENTRY_CTL_LOAD_IA32_PERF_GLOBAL_CTRL) &&
+                   (vmm->exit_ctls_allowed1
+                    & VMCS_VMEXIT_CTL_LOAD_IA32_PERF_GLOBAL_CTRL);
+
+        c->count = PMC_FIXED_COUNT;
+        for (i = 0; i < PMC_FIXED_COUNT; ++i) {
+                c->name[i] = fixed_names[i];
+                fixed_ctrl |= (u64)FIXED_CTR_CTRL_OS_USR
+                              << (i * FIXED_CTR_CTRL_SHIFT);
+        }
+
+        save_state(&state, gp);
+        __wrmsr(IA32_FIXED_CTR_CTRL, fixed_ctrl);
+
+        /* Fixed counters count in every pass, their counts are taken from
+         * the first one */
+        do {
+                for (grouped = 0; grouped < gp && next < VMX_PMC_EVENTS;
+                     ++next) {
+                        if (vmx_config.pmc_events & pmc_events[next].event)
+                                group[grouped++] = &pmc_events[next];
+                }
+
+                enable = ((u64)((1u << PMC_FIXED_COUNT) - 1) << 32)
+                       | ((1u << grouped) - 1);
+                for (i = 0; i < gp; ++i)
+                        __wrmsr(IA32_PERFEVTSEL0 + i, i < grouped
+                                ? group[i]->evtsel | PERFEVTSEL_USR
+                                  | PERFEVTSEL_OS | PERFEVTSEL_EN
+                                : 0);
+
+                run_pass(vmm, rounds, enable, gp, false, total);
+                if (c->split)
+                        run_pass(vmm, rounds, enable, gp, true, guest);
+
+                for (n = first ? 0 : PMC_FIXED_COUNT;
+                     n < PMC_FIXED_COUNT + grouped; ++n) {
+                        i = n < PMC_FIXED_COUNT ? n : c->count++;
+                        if (n >= PMC_FIXED_COUNT)
+                                c->name[i] = group[n - PMC_FIXED_COUNT]->name;
+                        c->total[i] = total[n];
+                        c->guest[i] = c->split ? guest[n] : 0;
+                }
+                first = false;
+        } while (next < VMX_PMC_EVENTS && vmx_config.pmc_events >> next);
+
+        restore_state(&state, gp);
+        return true;
+}
+
+/* Appends count per round-trip with two decimals to the line */
+static int
+format_per_round(char *buf, size_t size, const char *label, u64 count,
+                 u32 rounds)
+{
+        u64 v = count * 100 / rounds;
+
+        return vmlatency_snprintf(buf, size, " %s %llu.%02llu", label,
+                                  v / 100, v % 100);
+}
+
+void
+pmc_print(const pmc_counts_t *c, u32 rounds)
+{
+        char line[128];
+        u64 host;
+        int len;
+        u32 i;
+
+        for (i = 0; i < c->count; ++i) {
+                len = vmlatency_snprintf(line, sizeof(line), "%s:",
+                                         c->name[i]);
+                len = vmlatency_clamp_len(len, sizeof(line));
+                len += format_per_round(line + len, sizeof(line) - len,
+                                        "total", c->total[i], rounds);
+                len = vmlatency_clamp_len(len, sizeof(line));
+                if (c->split) {
+                        host = c->total[i] > c->guest[i]
+                             ? c->total[i] - c->guest[i] : 0;
+                        len += format_per_round(line + len,
+                                                sizeof(line) - len, "guest",
+                                                c->guest[i], rounds);
+                        len = vmlatency_clamp_len(len, sizeof(line));
+                        format_per_round(line + len, sizeof(line) - len,
+                                         "host", host, rounds);
+                }
+                vmlatency_printk("        %s\n", line);
+        }
+}
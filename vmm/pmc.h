@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PMC_H__
+#define __PMC_H__
+
+#include "types.h"
+#include "vmx.h"
+
+/* Instructions retired, core cycles and reference cycles */
+#define PMC_FIXED_COUNT 3
+#define PMC_MAX_EVENTS (PMC_FIXED_COUNT + VMX_PMC_EVENTS)
+
+typedef struct pmc_counts {
+        u32 count;  /* events captured */
+        const char *name[PMC_MAX_EVENTS];
+        u64 total[PMC_MAX_EVENTS];
+        u64 guest[PMC_MAX_EVENTS];  /* valid if split */
+        bool split;
+} pmc_counts_t;
+
+/* Run rounds VM round-trips with fixed counters and vmx_config.pmc_events
+ * counted, repeating them if there are more events than general-purpose
+ * counters. If VM-entry and VM-exit controls can load PERF_GLOBAL_CTRL, the
+ * round-trips are repeated with counting enabled only in the guest. Counter
+ * MSRs are restored afterwards. Returns false if architectural performance
+ * monitoring version 2 is not supported. Called inside vmm_run */
+bool pmc_measure(vm_monitor_t *vmm, u32 rounds, pmc_counts_t *c);
+
+/* Print counts per round-trip */
+void pmc_print(const pmc_counts_t *c, u32 rounds);
+
+#endif /* __PMC_H__ */
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+#define POOL_DEFAULT_SAMPLES 10000
+/* Pool sizes are multiplied by 2 up to the maximum */
+#define POOL_MAX_VMCS 256
+
+typedef enum {
+        POOL_TEST_OK,
+        POOL_TEST_SETUP_FAILED,
+        POOL_TEST_LAUNCH_FAILED,
+} pool_test_status_t;
+
+typedef struct {
+        vmpage_t *vmcs;
+        u32 size;  /* VMCSes in use */
+        u32 count;
+        u64 *samples;
+        pool_test_status_t status;
+        sample_summary_t warm_summary;
+        sample_summary_t cold_summary;
+} vmcs_pool_t;
+
+/* Start the guest on every VMCS of the pool */
+static pool_test_status_t
+launch_pool(vm_monitor_t *vmm, vmcs_pool_t *p)
+{
+        u32 n;
+
+        for (n = 0; n < p->size; ++n) {
+                if (vmm_setup_vmcs(vmm, &p->vmcs[n]) != 0)
+                        return POOL_TEST_SETUP_FAILED;
+                if (do_vmlaunch() != 0)
+                        return POOL_TEST_LAUNCH_FAILED;
+        }
+        return POOL_TEST_OK;
+}
+
+static void
+measure_pool(vm_monitor_t *vmm, void *arg)
+{
+        vmcs_pool_t *p = arg;
+        vmpage_t *vmcs;
+        u64 start;
+        u32 i;
+
+        p->status = launch_pool(vmm, p);
+        if (p->status != POOL_TEST_OK)
+                goto out;
+
+        /* vCPU switch: make next VMCS current and resume it */
+        for (i = 0; i < vmx_config.warmup + p->count; ++i) {
+                vmcs = &p->vmcs[i % p->size];
+                start = __get_tsc_start();
+                __vmptrld(vmcs->pa);
+                do_vmresume();
+                if (i >= vmx_config.warmup)
+                        p->samples[i - vmx_config.warmup] =
+                                __get_tsc_end() - start;
+        }
+        stats_summarize(p->samples, p->count, &p->warm_summary);
+
+        /* Cold start: VMCLEAR writes VMCS back to memory and clears launch
+         * state, so the VMCS is loaded from memory and launched again */
+        for (i = 0; i < p->count; ++i) {
+                vmcs = &p->vmcs[i % p->size];
+                start = __get_tsc_start();
+                __vmclear(vmcs->pa);
+                __vmptrld(vmcs->pa);
+                do_vmlaunch();
+                p->samples[i] = __get_tsc_end() - start;
+        }
+        stats_summarize(p->samples, p->count, &p->cold_summary);
+
+out:
+        /* Hand the CPU back with the VMCS of vmm current */
+        for (i = 0; i < p->size; ++i)
+                __vmclear(p->vmcs[i].pa);
+        __vmptrld(vmm->vmcs.pa);
+}
+
+void
+measure_vmlatency_pool(u32 count)
+{
+        vmcs_pool_t p;
+        char name[32];
+        size_t size;
+        u32 n, allocated;
+
+        if (!count)
+                count = POOL_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        p.count = count;
+        p.samples = vmlatency_malloc(size);
+        p.vmcs = vmlatency_malloc(POOL_MAX_VMCS * sizeof(vmpage_t));
+        if (!p.samples || !p.vmcs) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        for (allocated = 0; allocated < POOL_MAX_VMCS; ++allocated) {
+                if (allocate_vmpage(&p.vmcs[allocated]) != 0)
+                        break;
+        }
+
+        /* Separate guest launch per pool size keeps interrupts enabled
+         * between them */
+        for (p.size = 1; p.size <= allocated; p.size *= 2) {
+                if (!run_guest(measure_pool, &p))
+                        break;
+
+                switch (p.status) {
+                case POOL_TEST_OK:
+                        vmlatency_snprintf(name, sizeof(name),
+                                           "pool %u switch", p.size);
+                        stats_print_summary(name, &p.warm_summary);
+                        vmlatency_snprintf(name, sizeof(name),
+                                           "pool %u cold", p.size);
+                        stats_print_summary(name, &p.cold_summary);
+                        continue;
+                case POOL_TEST_SETUP_FAILED:
+                        vmlatency_printk("pool %u: VMCLEAR or VMPTRLD"
+                                         " failed\n", p.size);
+                        break;
+                case POOL_TEST_LAUNCH_FAILED:
+                        vmlatency_printk("pool %u: VMLAUNCH failed\n",
+                                         p.size);
+                        break;
+                }
+                break;
+        }
+
+        for (n = 0; n < allocated; ++n)
+                free_vmpage(&p.vmcs[n]);
+
+out:
+        if (p.vmcs)
+                vmlatency_free(p.vmcs, POOL_MAX_VMCS * sizeof(vmpage_t));
+        if (p.samples)
+                vmlatency_free(p.samples, size);
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+/* Every sample waits for the timer, so fewer samples are taken than in other
+ * modes to bound the time spent with interrupts disabled */
+#define PTIMER_DEFAULT_SAMPLES 10000
+/* Timer deadlines waited for by one guest launch */
+#define PTIMER_CHUNK_CYCLES (1ull << 24)
+
+extern void guest_spin(void);
+
+typedef enum {
+        PTIMER_TEST_OK,
+        PTIMER_TEST_UNSUPPORTED,
+        PTIMER_TEST_WRONG_EXIT,
+} ptimer_test_status_t;
+
+typedef struct {
+        u32 value;  /* timer ticks */
+        u32 rate;   /* timer ticks every 2^rate TSC cycles */
+        u32 count;
+        u32 chunk;  /* samples per launch */
+        u32 taken;
+        u64 *round_trip;
+        u64 *rearm;
+        u64 *delay;
+        ptimer_test_status_t status;
+        u32 exit_reason;
+        sample_summary_t round_trip_summary;
+        sample_summary_t rearm_summary;
+        sample_summary_t delay_summary;
+        u64 early;  /* exits before the deadline */
+} ptimer_test_t;
+
+/* Take a chunk of samples of the current value */
+static void
+measure_ptimer(vm_monitor_t *vmm, void *arg)
+{
+        ptimer_test_t *t = arg;
+        u64 deadline = (u64)t->value << t->rate;
+        u32 end = t->taken + t->chunk;
+        u32 warmup = vmx_config.warmup;
+        u64 start, cycles;
+        u32 i;
+
+        if (end > t->count)
+                end = t->count;
+        if (warmup > t->chunk)
+                warmup = t->chunk;
+
+        if (!vmx_set_pin_ctls(vmm, vmm->pin_ctls
+                                   | VMX_PIN_CTL_ACTIVATE_PTIMER)) {
+                t->status = PTIMER_TEST_UNSUPPORTED;
+                return;
+        }
+
+        /* Guest spins until the timer expires. Without "save VMX-preemption
+         * timer value" exit control every VM entry starts counting from the
+         * value in VMCS, so the timer does not have to be re-armed */
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_spin);
+        __vmwrite(VMCS_GUEST_PTIMER_VALUE, t->value);
+        do_vmresume();
+        t->exit_reason = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+        if (t->exit_reason != VMEXIT_PTIMER) {
+                t->status = PTIMER_TEST_WRONG_EXIT;
+                return;
+        }
+
+        for (i = 0; i < warmup; ++i)
+                do_vmresume();
+
+        for (i = t->taken; i < end; ++i) {
+                start = __get_tsc_start();
+                do_vmresume();
+                cycles = __get_tsc_end() - start;
+
+                t->round_trip[i] = cycles;
+                /* Timer ticks are 2^rate cycles apart, so an exit may come
+                 * up to one tick before the deadline measured from VMRESUME */
+                if (cycles < deadline) {
+                        t->early++;
+                        t->delay[i] = 0;
+                } else {
+                        t->delay[i] = cycles - deadline;
+                }
+        }
+
+        /* Same with the value written before every VM entry as hypervisors do
+         * when time slices vary */
+        for (i = t->taken; i < end; ++i) {
+                start = __get_tsc_start();
+                __vmwrite(VMCS_GUEST_PTIMER_VALUE, t->value);
+                do_vmresume();
+                t->rearm[i] = __get_tsc_end() - start;
+        }
+        t->taken = end;
+}
+
+/* Chunks are sized so that one launch waits for about PTIMER_CHUNK_CYCLES
+ * of timer deadlines */
+static bool
+measure_ptimer_value(ptimer_test_t *t)
+{
+        u64 deadline = (u64)t->value << t->rate;
+
+        t->chunk = VMX_SAMPLES_CHUNK;
+        if (deadline && PTIMER_CHUNK_CYCLES / deadline < t->chunk)
+                t->chunk = (u32)(PTIMER_CHUNK_CYCLES / deadline);
+        if (!t->chunk)
+                t->chunk = 1;
+
+        t->status = PTIMER_TEST_OK;
+        t->taken = 0;
+        t->early = 0;
+        if (!run_guest_chunked(measure_ptimer, t, &t->taken, t->count))
+                return false;
+        if (t->status != PTIMER_TEST_OK)
+                return true;
+
+        stats_summarize(t->round_trip, t->count, &t->round_trip_summary);
+        stats_summarize(t->rearm, t->count, &t->rearm_summary);
+        stats_summarize(t->delay, t->count, &t->delay_summary);
+        return true;
+}
+
+static bool
+report_ptimer(ptimer_test_t *t)
+{
+        char name[64];
+
+        switch (t->status) {
+        case PTIMER_TEST_OK:
+                vmlatency_snprintf(name, sizeof(name), "ptimer %u round-trip",
+                                   t->value);
+                stats_print_summary(name, &t->round_trip_summary);
+                vmlatency_snprintf(name, sizeof(name), "ptimer %u rearm",
+                                   t->value);
+                stats_print_summary(name, &t->rearm_summary);
+                vmlatency_snprintf(name, sizeof(name), "ptimer %u delay",
+                                   t->value);
+                stats_print_summary(name, &t->delay_summary);
+                vmlatency_printk("ptimer %u: deadline %llu early %llu\n",
+                                 t->value, (u64)t->value << t->rate, t->early);
+                return true;
+        case PTIMER_TEST_UNSUPPORTED:
+                vmlatency_printk("VMX-preemption timer is not supported\n");
+                return false;
+        case PTIMER_TEST_WRONG_EXIT:
+                vmlatency_printk("ptimer %u: unexpected exit reason %u\n",
+                                 t->value, t->exit_reason);
+                return false;
+        }
+        return false;
+}
+
+/* Delay is the round-trip minus the programmed deadline, so it includes
+ * VM entry and exit legs; its spread is the timer jitter */
+void
+measure_vmlatency_ptimer(u32 count)
+{
+        ptimer_test_t t = {0};
+        size_t size;
+        u32 n;
+
+        if (!count)
+                count = PTIMER_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        t.count = count;
+        t.rate = __rdmsr(IA32_VMX_MSR_MISC) & VMX_MISC_PTIMER_RATE_MASK;
+        t.round_trip = vmlatency_malloc(size);
+        t.rearm = vmlatency_malloc(size);
+        t.delay = vmlatency_malloc(size);
+        if (!t.round_trip || !t.rearm || !t.delay) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        vmlatency_printk("ptimer rate: TSC >> %u\n", t.rate);
+
+        for (n = 0; n < vmx_config.ptimer_count; ++n) {
+                t.value = vmx_config.ptimer[n];
+                if (!measure_ptimer_value(&t) || !report_ptimer(&t))
+                        break;
+        }
+
+out:
+        if (t.delay)
+                vmlatency_free(t.delay, size);
+        if (t.rearm)
+                vmlatency_free(t.rearm, size);
+        if (t.round_trip)
+                vmlatency_free(t.round_trip, size);
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ring.h"
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+
+/* Round-trips per guest launch. Bounds the time spent with interrupts
+ * disabled when streaming long runs */
+#define STREAM_CHUNK 65536
+
+static sample_ring_header_t **rings;
+static int rings_count;
+
+sample_ring_header_t *
+sample_ring_get(int cpu)
+{
+        sample_ring_header_t *ring;
+
+        if (!rings) {
+                rings_count = vmlatency_cpu_count();
+                rings = vmlatency_malloc(rings_count * sizeof(*rings));
+                if (!rings)
+                        return NULL;
+        }
+
+        if (rings[cpu])
+                return rings[cpu];
+
+        ring = vmlatency_malloc_user(SAMPLE_RING_SIZE);
+        if (!ring)
+                return NULL;
+
+        ring->version = SAMPLE_RING_VERSION;
+        ring->record_size = sizeof(sample_record_t);
+        ring->records = SAMPLE_RING_RECORDS;
+        ring->cpu = cpu;
+
+        rings[cpu] = ring;
+        return ring;
+}
+
+void
+sample_ring_free_all(void)
+{
+        int cpu;
+
+        if (!rings)
+                return;
+
+        for (cpu = 0; cpu < rings_count; ++cpu) {
+                if (rings[cpu])
+                        vmlatency_free(rings[cpu], SAMPLE_RING_SIZE);
+        }
+
+        vmlatency_free(rings, rings_count * sizeof(*rings));
+        rings = NULL;
+}
+
+typedef struct {
+        u32 count;     /* round-trips in the current chunk */
+        u64 seq;       /* sequence number of the next sample */
+        u64 dropped;
+        bool no_ring;  /* thread migrated to CPU without a ring */
+} stream_t;
+
+static void
+measure_stream(vm_monitor_t *vmm, void *arg)
+{
+        stream_t *s = arg;
+        int cpu = vmlatency_cpu_id();
+        sample_ring_header_t *ring = rings[cpu];
+        sample_record_t *records, *r;
+        u64 head, start, end;
+        u32 i;
+
+        if (!ring) {
+                s->no_ring = true;
+                return;
+        }
+        records = (sample_record_t *)((char *)ring + SAMPLE_RING_DATA_OFFSET);
+        head = ring->head;
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        for (i = 0; i < s->count; ++i, ++s->seq) {
+                start = __get_tsc_start();
+                do_vmresume();
+                end = __get_tsc_end();
+
+                if (head - ring->tail >= SAMPLE_RING_RECORDS) {
+                        ring->dropped++;
+                        s->dropped++;
+                        continue;
+                }
+
+                r = &records[head % SAMPLE_RING_RECORDS];
+                r->seq = s->seq;
+                r->tsc_start = start;
+                r->tsc_end = end;
+                r->exit_reason = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+                r->cpu = cpu;
+
+                /* Record must be visible before head. Stores are not
+                 * reordered on x86, so only the compiler is fenced */
+                __compiler_barrier();
+                ring->head = ++head;
+        }
+}
+
+void
+measure_vmlatency_stream(u32 count)
+{
+        stream_t s = {0};
+        u32 left;
+
+        if (!count)
+                count = vmx_config.samples;
+
+        for (left = count; left; left -= s.count) {
+                if (!sample_ring_get(vmlatency_cpu_id())) {
+                        vmlatency_printk("Failed to allocate sample ring\n");
+                        break;
+                }
+
+                s.count = left < STREAM_CHUNK ? left : STREAM_CHUNK;
+                if (!run_guest(measure_stream, &s) || s.no_ring)
+                        break;
+
+                vmlatency_yield();
+        }
+
+        vmlatency_printk("stream: samples %llu dropped %llu\n",
+                         s.seq, s.dropped);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "types.h"
+
+/* Per-CPU single-producer/single-consumer ring of sample records shared with
+ * user space. Layout of the mapping:
+ *
+ *   0                        sample_ring_header_t
+ *   SAMPLE_RING_DATA_OFFSET  SAMPLE_RING_RECORDS records
+ *
+ * head and tail are free-running record counters, record n is stored at
+ * index n % SAMPLE_RING_RECORDS. The producer (measurement loop) fills the
+ * record at head and then increments head. The consumer reads records up to
+ * head and then sets tail past them. When the ring is full new records are
+ * dropped and counted, the measurement is never stalled by the reader */
+
+#define SAMPLE_RING_VERSION 1
+
+#define SAMPLE_RING_RECORDS (1u << 18)
+#define SAMPLE_RING_DATA_OFFSET 0x1000
+#define SAMPLE_RING_SIZE (SAMPLE_RING_DATA_OFFSET \
+                          + SAMPLE_RING_RECORDS * sizeof(sample_record_t))
+
+typedef struct sample_record {
+        u64 seq;
+        u64 tsc_start;
+        u64 tsc_end;
+        u32 exit_reason;
+        u32 cpu;
+} sample_record_t;
+
+/* head and tail are in separate cache lines so producer and consumer do not
+ * bounce a line on every record */
+typedef struct sample_ring_header {
+        u32 version;
+        u32 record_size;
+        u32 records;
+        u32 cpu;
+        volatile u64 dropped;
+        u64 reserved0[5];
+
+        volatile u64 head;  /* written by the producer only */
+        u64 reserved1[7];
+
+        volatile u64 tail;  /* written by the consumer only */
+        u64 reserved2[7];
+} sample_ring_header_t;
+
+/* Get ring of the CPU, allocating it on first use. May sleep */
+sample_ring_header_t *sample_ring_get(int cpu);
+void sample_ring_free_all(void);
+
+/* Stream individually timed round-trips of the current CPU to its ring */
+void measure_vmlatency_stream(u32 count);
+
+#endif /* __RING_H__ */
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+#define SHADOW_DEFAULT_SAMPLES 10000
+/* Shadowed accesses per VM entry */
+#define SHADOW_UNROLL 16
+/* VMREAD and VMWRITE bitmaps are indexed by bits 14:0 of field encoding */
+#define SHADOW_BITMAP_MASK 0x7fff
+#define FIELD_TYPE_READ_ONLY(e) ((((e) >> 10) & 3) == 1)
+
+extern void guest_vmread(void);
+extern void guest_vmwrite(void);
+extern void guest_vmread_exit(void);
+extern void guest_vmwrite_exit(void);
+
+typedef enum {
+        SHADOW_READ,
+        SHADOW_WRITE,
+        SHADOW_READ_EXIT,
+        SHADOW_WRITE_EXIT,
+        SHADOW_MODES,
+} shadow_mode_t;
+
+typedef struct shadow_mode_info {
+        const char *name;
+        void (*code)(void);
+        u32 exit_reason;  /* VM exit caused by the guest */
+        bool write;
+        bool shadowed;
+} shadow_mode_info_t;
+
+static const shadow_mode_info_t shadow_modes[SHADOW_MODES] = {
+        {"read", guest_vmread, VMEXIT_CPUID, false, true},
+        {"write", guest_vmwrite, VMEXIT_CPUID, true, true},
+        {"read-exit", guest_vmread_exit, VMEXIT_VMREAD, false, false},
+        {"write-exit", guest_vmwrite_exit, VMEXIT_VMWRITE, true, false},
+};
+
+typedef enum {
+        SHADOW_TEST_OK,
+        SHADOW_TEST_SKIPPED,
+        SHADOW_TEST_WRONG_EXIT,
+} shadow_test_status_t;
+
+typedef struct {
+        vmpage_t shadow_vmcs;
+        vmpage_t vmread_bitmap;
+        vmpage_t vmwrite_bitmap;
+        u64 *samples;
+        u32 count;
+        u32 field;  /* index and mode measured by the current launch */
+        u32 mode;
+        u32 taken;
+        bool supported;
+        shadow_test_status_t status[VMX_MAX_SHADOW_FIELDS][SHADOW_MODES];
+        u32 exit_reason[VMX_MAX_SHADOW_FIELDS][SHADOW_MODES];
+        sample_summary_t summary[VMX_MAX_SHADOW_FIELDS][SHADOW_MODES];
+} shadow_bench_t;
+
+static inline void
+set_bitmap_bit(char *bitmap, u32 bit, bool set)
+{
+        if (set)
+                bitmap[bit / 8] |= 1 << (bit % 8);
+        else
+                bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* Shadowed accesses are timed by the guest, the ones causing VM exit by the
+ * host as VM round-trips */
+static shadow_test_status_t
+measure_access(shadow_bench_t *b, u32 field, shadow_mode_t mode,
+               u32 *exit_reason)
+{
+        const shadow_mode_info_t *m = &shadow_modes[mode];
+        guest_vmaccess_t access;
+        u32 bit = field & SHADOW_BITMAP_MASK;
+        u32 end = b->taken + VMX_SAMPLES_CHUNK;
+        u64 start, cycles;
+        u32 i;
+
+        if (end > b->count)
+                end = b->count;
+
+        set_bitmap_bit(b->vmread_bitmap.p, bit, !m->shadowed);
+        set_bitmap_bit(b->vmwrite_bitmap.p, bit, !m->shadowed);
+
+        access.field = field;
+        access.count = SHADOW_UNROLL;
+        access.value = 0;
+
+        for (i = 0; i < vmx_config.warmup + end - b->taken; ++i) {
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)m->code);
+                start = __get_tsc_start();
+                do_vmresume_arg(&access);
+                cycles = m->shadowed ? access.cycles / SHADOW_UNROLL
+                                     : __get_tsc_end() - start;
+
+                *exit_reason = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+                if (*exit_reason != m->exit_reason)
+                        return SHADOW_TEST_WRONG_EXIT;
+
+                if (i >= vmx_config.warmup)
+                        b->samples[b->taken + i - vmx_config.warmup] = cycles;
+        }
+
+        b->taken = end;
+        return SHADOW_TEST_OK;
+}
+
+/* Take a chunk of samples of the current field and mode */
+static void
+measure_shadow(vm_monitor_t *vmm, void *arg)
+{
+        shadow_bench_t *b = arg;
+        u32 ctls2 = vmm->proc_ctls2;
+        u32 n = b->field, mode = b->mode;
+
+        /* Shadow VMCS is initialized by VMCLEAR and never made current */
+        ((u32 *)b->shadow_vmcs.p)[0] = (u32)(vmm->ia32_vmx_basic & 0x7fffffff)
+                                     | VMCS_SHADOW_INDICATOR;
+        if (__vmclear(b->shadow_vmcs.pa) != 0 ||
+            !vmx_set_proc_ctls2(vmm, ctls2 | VMX_PROC_CTL2_VMCS_SHADOWING)) {
+                b->supported = false;
+                return;
+        }
+
+        __vmwrite(VMCS_VMCS_LINK_PTR, b->shadow_vmcs.pa);
+        __vmwrite(VMCS_VMREAD_BITMAP, b->vmread_bitmap.pa);
+        __vmwrite(VMCS_VMWRITE_BITMAP, b->vmwrite_bitmap.pa);
+
+        b->status[n][mode] = measure_access(b, vmx_config.shadow_fields[n],
+                                            mode, &b->exit_reason[n][mode]);
+
+        __vmwrite(VMCS_VMCS_LINK_PTR, 0xffffffffffffffffull);
+        vmx_set_proc_ctls2(vmm, ctls2);
+        /* Processor may keep shadow VMCS data cached until VMCLEAR */
+        __vmclear(b->shadow_vmcs.pa);
+}
+
+/* Every field and mode is taken in chunks and summarized with interrupts
+ * enabled */
+static bool
+measure_shadow_fields(shadow_bench_t *b)
+{
+        u32 n, mode, field;
+
+        b->supported = true;
+        for (n = 0; n < vmx_config.shadow_field_count; ++n) {
+                field = vmx_config.shadow_fields[n];
+                for (mode = 0; mode < SHADOW_MODES; ++mode) {
+                        /* Writing read-only fields needs VMX_MISC support */
+                        if (shadow_modes[mode].write &&
+                            FIELD_TYPE_READ_ONLY(field)) {
+                                b->status[n][mode] = SHADOW_TEST_SKIPPED;
+                                continue;
+                        }
+
+                        b->field = n;
+                        b->mode = mode;
+                        b->taken = 0;
+                        b->status[n][mode] = SHADOW_TEST_OK;
+                        if (!run_guest_chunked(measure_shadow, b, &b->taken,
+                                               b->count))
+                                return false;
+                        if (!b->supported)
+                                return true;
+                        if (b->status[n][mode] == SHADOW_TEST_OK)
+                                stats_summarize(b->samples, b->count,
+                                                &b->summary[n][mode]);
+                }
+        }
+        return true;
+}
+
+static void
+report_shadow(shadow_bench_t *b)
+{
+        const char *field_name;
+        char name[64];
+        u32 n, mode, field;
+
+        if (!b->supported) {
+                vmlatency_printk("VMCS shadowing is not supported\n");
+                return;
+        }
+
+        for (n = 0; n < vmx_config.shadow_field_count; ++n) {
+                field = vmx_config.shadow_fields[n];
+                field_name = vmcs_field_name(field);
+                for (mode = 0; mode < SHADOW_MODES; ++mode) {
+                        if (field_name)
+                                vmlatency_snprintf(name, sizeof(name),
+                                                   "shadow %s %s", field_name,
+                                                   shadow_modes[mode].name);
+                        else
+                                vmlatency_snprintf(name, sizeof(name),
+                                                   "shadow %#x %s", field,
+                                                   shadow_modes[mode].name);
+
+                        switch (b->status[n][mode]) {
+                        case SHADOW_TEST_OK:
+                                stats_print_summary(name, &b->summary[n][mode]);
+                                break;
+                        case SHADOW_TEST_SKIPPED:
+                                break;
+                        case SHADOW_TEST_WRONG_EXIT:
+                                vmlatency_printk("%s: unexpected exit reason"
+                                                 " %u\n", name,
+                                                 b->exit_reason[n][mode]);
+                                break;
+                        }
+                }
+        }
+}
+
+void
+measure_vmlatency_shadow(u32 count)
+{
+        shadow_bench_t *b;
+        size_t size;
+
+        if (!count)
+                count = SHADOW_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        b = vmlatency_malloc(sizeof(*b));
+        if (!b)
+                return;
+
+        b->count = count;
+        b->samples = vmlatency_malloc(size);
+        if (!b->samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out1;
+        }
+
+        if (allocate_vmpage(&b->shadow_vmcs) != 0)
+                goto out2;
+        if (allocate_vmpage(&b->vmread_bitmap) != 0)
+                goto out3;
+        if (allocate_vmpage(&b->vmwrite_bitmap) != 0)
+                goto out4;
+
+        if (measure_shadow_fields(b))
+                report_shadow(b);
+
+        free_vmpage(&b->vmwrite_bitmap);
+out4:
+        free_vmpage(&b->vmread_bitmap);
+out3:
+        free_vmpage(&b->shadow_vmcs);
+out2:
+        vmlatency_free(b->samples, size);
+out1:
+        vmlatency_free(b, sizeof(*b));
+}
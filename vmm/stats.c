@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stats.h"
+#include "vmx.h"
+#include "api.h"
+#include "cpu-defs.h"
+#include "freq.h"
+
+/* Every power of two range is split into 2^HIST_SUB_BITS buckets, so bucket
+ * width never exceeds 1/8 of the value it holds */
+#define HIST_SUB_BITS 3
+
+static void
+sift_down(u64 *v, u64 root, u64 end)
+{
+        u64 child, tmp;
+        while ((child = 2 * root + 1) < end) {
+                if (child + 1 < end && v[child] < v[child + 1])
+                        child++;
+                if (v[root] >= v[child])
+                        return;
+                tmp = v[root];
+                v[root] = v[child];
+                v[child] = tmp;
+                root = child;
+        }
+}
+
+/* Heapsort: no recursion and no extra memory, so it is safe to use with
+ * huge sample buffers on a kernel stack */
+void
+stats_sort(u64 *samples, u64 count)
+{
+        u64 i, tmp;
+        if (count < 2)
+                return;
+
+        for (i = count / 2; i > 0; --i)
+                sift_down(samples, i - 1, count);
+
+        for (i = count - 1; i > 0; --i) {
+                tmp = samples[0];
+                samples[0] = samples[i];
+                samples[i] = tmp;
+                sift_down(samples, 0, i);
+        }
+}
+
+u64
+stats_percentile(const u64 *sorted, u64 count, u64 ppm)
+{
+        u64 rank;
+        if (count == 0)
+                return 0;
+
+        rank = (count * ppm + 999999) / 1000000;
+        return sorted[rank ? rank - 1 : 0];
+}
+
+void
+stats_summarize(u64 *samples, u64 count, sample_summary_t *s)
+{
+        u64 i, total = 0;
+
+        stats_sort(samples, count);
+
+        for (i = 0; i < count; ++i)
+                total += samples[i];
+
+        s->count = count;
+        s->min = count ? samples[0] : 0;
+        s->median = stats_percentile(samples, count, 500000);
+        s->p90 = stats_percentile(samples, count, 900000);
+        s->p99 = stats_percentile(samples, count, 990000);
+        s->p999 = stats_percentile(samples, count, 999000);
+        s->max = count ? samples[count - 1] : 0;
+        s->mean = count ? total / count : 0;
+}
+
+/* Returns false if the unit is unknown, e.g. APERF/MPERF is not supported */
+static bool
+convert_summary(const sample_summary_t *s, bool (*convert)(u64, u64 *),
+                sample_summary_t *out)
+{
+        out->count = s->count;
+        return convert(s->min, &out->min) &&
+               convert(s->median, &out->median) &&
+               convert(s->p90, &out->p90) &&
+               convert(s->p99, &out->p99) &&
+               convert(s->p999, &out->p999) &&
+               convert(s->max, &out->max) &&
+               convert(s->mean, &out->mean);
+}
+
+void
+stats_print_summary(const char *name, const sample_summary_t *s)
+{
+        sample_summary_t c;
+
+        if (vmx_config.units & VMX_UNIT_TSC)
+                vmlatency_printk("%s: samples %llu min %llu median %llu"
+                                 " p90 %llu p99 %llu p99.9 %llu max %llu"
+                                 " mean %llu\n", name, s->count, s->min,
+                                 s->median, s->p90, s->p99, s->p999, s->max,
+                                 s->mean);
+
+        if ((vmx_config.units & VMX_UNIT_CORE) &&
+            convert_summary(s, freq_core_cycles, &c))
+                vmlatency_printk("%s (core): samples %llu min %llu median"
+                                 " %llu p90 %llu p99 %llu p99.9 %llu max %llu"
+                                 " mean %llu\n", name, c.count, c.min,
+                                 c.median, c.p90, c.p99, c.p999, c.max,
+                                 c.mean);
+
+        /* Nanoseconds are converted with one decimal */
+        if ((vmx_config.units & VMX_UNIT_NS) &&
+            convert_summary(s, freq_ns, &c))
+                vmlatency_printk("%s (ns): samples %llu min %llu.%llu median"
+                                 " %llu.%llu p90 %llu.%llu p99 %llu.%llu"
+                                 " p99.9 %llu.%llu max %llu.%llu"
+                                 " mean %llu.%llu\n", name, c.count,
+                                 c.min / 10, c.min % 10,
+                                 c.median / 10, c.median % 10,
+                                 c.p90 / 10, c.p90 % 10,
+                                 c.p99 / 10, c.p99 % 10,
+                                 c.p999 / 10, c.p999 % 10,
+                                 c.max / 10, c.max % 10,
+                                 c.mean / 10, c.mean % 10);
+}
+
+static unsigned
+hist_bucket(u64 v)
+{
+        unsigned msb = 0, shift;
+        if (v < __BIT(HIST_SUB_BITS))
+                return (unsigned)v;
+
+        while (v >> (msb + 1))
+                msb++;
+        shift = msb - HIST_SUB_BITS;
+        return ((shift + 1) << HIST_SUB_BITS)
+               + (unsigned)((v >> shift) & (__BIT(HIST_SUB_BITS) - 1));
+}
+
+static u64
+hist_bucket_low(unsigned bucket)
+{
+        unsigned shift;
+        if (bucket < __BIT(HIST_SUB_BITS))
+                return bucket;
+
+        shift = (bucket >> HIST_SUB_BITS) - 1;
+        return (__BIT(HIST_SUB_BITS) | (bucket & (__BIT(HIST_SUB_BITS) - 1)))
+               << shift;
+}
+
+void
+stats_print_histogram(const char *name, const u64 *sorted, u64 count)
+{
+        u64 i = 0, first;
+        unsigned bucket;
+
+        while (i < count) {
+                bucket = hist_bucket(sorted[i]);
+                first = i;
+                while (i < count && hist_bucket(sorted[i]) == bucket)
+                        i++;
+                vmlatency_printk("%s hist %llu-%llu: %llu\n", name,
+                                 hist_bucket_low(bucket),
+                                 hist_bucket_low(bucket + 1) - 1, i - first);
+        }
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "types.h"
+
+typedef struct sample_summary {
+        u64 count;
+        u64 min;
+        u64 median;
+        u64 p90;
+        u64 p99;
+        u64 p999;
+        u64 max;
+        u64 mean;
+} sample_summary_t;
+
+/* Sort samples in place in ascending order */
+void stats_sort(u64 *samples, u64 count);
+
+/* Nearest-rank percentile of sorted samples. Percentile is expressed in
+ * parts per million to avoid floating point, e.g. 999000 for p99.9 */
+u64 stats_percentile(const u64 *sorted, u64 count, u64 ppm);
+
+/* Sort samples and fill in the summary */
+void stats_summarize(u64 *samples, u64 count, sample_summary_t *s);
+
+void stats_print_summary(const char *name, const sample_summary_t *s);
+
+/* Print log-bucketed histogram of sorted samples */
+void stats_print_histogram(const char *name, const u64 *sorted, u64 count);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "ept.h"
+#include "stats.h"
+
+#define VMFUNC_DEFAULT_SAMPLES 10000
+/* EPT views in the EPTP list, must be a power of 2. View 0 is the shared
+ * hierarchy, others get their own PML4 table */
+#define VMFUNC_VIEWS 4
+/* VMFUNC switches per VM entry */
+#define VMFUNC_UNROLL 16
+
+extern void guest_vmfunc(void);
+extern void guest_vmcall(void);
+
+typedef enum {
+        VMFUNC_SWITCH,
+        VMFUNC_VMCALL,
+        VMFUNC_VMCALL_SWITCH,
+        VMFUNC_MODES,
+} vmfunc_mode_t;
+
+static const char *const vmfunc_mode_names[VMFUNC_MODES] = {
+        "vmfunc", "vmcall", "vmcall-switch",
+};
+
+typedef enum {
+        VMFUNC_TEST_OK,
+        VMFUNC_TEST_WRONG_EXIT,
+} vmfunc_test_status_t;
+
+typedef struct {
+        vmpage_t eptp_list;
+        vmpage_t pml4[VMFUNC_VIEWS - 1];
+        u64 eptp[VMFUNC_VIEWS];
+        u64 *samples;
+        u32 count;
+        bool supported;
+        vmfunc_test_status_t status[VMFUNC_MODES];
+        u32 exit_reason[VMFUNC_MODES];
+        sample_summary_t summary[VMFUNC_MODES];
+} vmfunc_bench_t;
+
+/* VMFUNC is timed by the guest. VMCALL modes are VM round-trips timed by the
+ * host, vmcall-switch also loads the next view into the EPT pointer as a
+ * hypervisor switching views on a hypercall does */
+static vmfunc_test_status_t
+measure_mode(vmfunc_bench_t *b, vmfunc_mode_t mode, u32 *exit_reason)
+{
+        guest_vmfunc_t vmfunc;
+        u32 expected = mode == VMFUNC_SWITCH ? VMEXIT_CPUID : VMEXIT_VMCALL;
+        u64 start, cycles;
+        u32 i;
+
+        vmfunc.mask = VMFUNC_VIEWS - 1;
+        vmfunc.count = VMFUNC_UNROLL;
+
+        /* Exiting VMCALL leaves guest RIP unchanged */
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_vmcall);
+
+        for (i = 0; i < vmx_config.warmup + b->count; ++i) {
+                switch (mode) {
+                case VMFUNC_SWITCH:
+                        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_vmfunc);
+                        do_vmresume_arg(&vmfunc);
+                        cycles = vmfunc.cycles / VMFUNC_UNROLL;
+                        break;
+                case VMFUNC_VMCALL:
+                        start = __get_tsc_start();
+                        do_vmresume();
+                        cycles = __get_tsc_end() - start;
+                        break;
+                default:
+                        start = __get_tsc_start();
+                        __vmwrite(VMCS_EPT_POINTER,
+                                  b->eptp[(i + 1) % VMFUNC_VIEWS]);
+                        do_vmresume();
+                        cycles = __get_tsc_end() - start;
+                        break;
+                }
+
+                if (i >= vmx_config.warmup)
+                        b->samples[i - vmx_config.warmup] = cycles;
+
+                *exit_reason = (u32)__vmread(VMCS_EXIT_REASON) & 0xffff;
+                if (*exit_reason != expected)
+                        return VMFUNC_TEST_WRONG_EXIT;
+        }
+
+        return VMFUNC_TEST_OK;
+}
+
+static void
+measure_vmfunc(vm_monitor_t *vmm, void *arg)
+{
+        vmfunc_bench_t *b = arg;
+        u32 ctls2 = vmm->proc_ctls2;
+        u32 mode;
+
+        b->supported = false;
+        if (!(vmm->procbased2_allowed1 & VMX_PROC_CTL2_ENABLE_VMFUNC) ||
+            !(__rdmsr(IA32_VMX_VMFUNC) & VMFUNC_EPTP_SWITCHING))
+                return;
+        if (!vmx_set_proc_ctls2(vmm, ctls2 | VMX_PROC_CTL2_ENABLE_EPT
+                                | VMX_PROC_CTL2_ENABLE_VMFUNC))
+                return;
+        b->supported = true;
+
+        __vmwrite(VMCS_VMFUNC_CTLS, VMFUNC_EPTP_SWITCHING);
+        __vmwrite(VMCS_EPTP_LIST_ADDR, b->eptp_list.pa);
+
+        for (mode = 0; mode < VMFUNC_MODES; ++mode) {
+                __vmwrite(VMCS_EPT_POINTER, b->eptp[0]);
+                b->status[mode] = measure_mode(b, mode,
+                                               &b->exit_reason[mode]);
+                if (b->status[mode] == VMFUNC_TEST_OK)
+                        stats_summarize(b->samples, b->count,
+                                        &b->summary[mode]);
+        }
+
+        __vmwrite(VMCS_EPT_POINTER, b->eptp[0]);
+        __vmwrite(VMCS_VMFUNC_CTLS, 0);
+        vmx_set_proc_ctls2(vmm, ctls2);
+}
+
+static void
+report_vmfunc(vmfunc_bench_t *b)
+{
+        char name[64];
+        u32 mode;
+
+        if (!b->supported) {
+                vmlatency_printk("VMFUNC EPTP switching is not supported\n");
+                return;
+        }
+
+        for (mode = 0; mode < VMFUNC_MODES; ++mode) {
+                vmlatency_snprintf(name, sizeof(name), "eptp %s",
+                                   vmfunc_mode_names[mode]);
+
+                switch (b->status[mode]) {
+                case VMFUNC_TEST_OK:
+                        stats_print_summary(name, &b->summary[mode]);
+                        break;
+                case VMFUNC_TEST_WRONG_EXIT:
+                        vmlatency_printk("%s: unexpected exit reason %u\n",
+                                         name, b->exit_reason[mode]);
+                        break;
+                }
+        }
+}
+
+void
+measure_vmlatency_vmfunc(u32 count)
+{
+        vmfunc_bench_t *b;
+        size_t size;
+        u32 n, i;
+
+        if (!count)
+                count = VMFUNC_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        if (ept_init() != 0)
+                return;
+
+        b = vmlatency_malloc(sizeof(*b));
+        if (!b)
+                return;
+
+        b->count = count;
+        b->samples = vmlatency_malloc(size);
+        if (!b->samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out1;
+        }
+
+        if (allocate_vmpage(&b->eptp_list) != 0)
+                goto out2;
+
+        b->eptp[0] = ept_pointer();
+        for (n = 0; n < VMFUNC_VIEWS - 1; ++n) {
+                if (allocate_vmpage(&b->pml4[n]) != 0) {
+                        vmlatency_printk("Failed to allocate EPT views\n");
+                        goto out3;
+                }
+                b->eptp[n + 1] = ept_make_view(&b->pml4[n]);
+        }
+        for (i = 0; i < VMFUNC_VIEWS; ++i)
+                ((u64 *)b->eptp_list.p)[i] = b->eptp[i];
+
+        if (run_guest(measure_vmfunc, b))
+                report_vmfunc(b);
+
+out3:
+        while (n--)
+                free_vmpage(&b->pml4[n]);
+        free_vmpage(&b->eptp_list);
+out2:
+        vmlatency_free(b->samples, size);
+out1:
+        vmlatency_free(b, sizeof(*b));
+}
@@ -16,13 +16,110 @@
 */
 
 #include "vmx.h"
+#include "calib.h"
+#include "ept.h"
+#include "freq.h"
+#include "pmc.h"
 #include "api.h"
 #include "asm-inlines.h"
 #include "cpu-defs.h"
-
-#define VMX_ITERATIONS 20
+#include "stats.h"
 
 extern void guest_code(void);
+extern void guest_timestamps(void);
+
+vmx_config_t vmx_config = {
+        VMX_DEFAULT_SAMPLES,
+        VMX_WARMUP_ITERATIONS,
+        VMX_BATCH_MIN,
+        VMX_BATCH_MAX,
+        VMX_BATCH_FACTOR,
+        true,
+        {0},
+        0,
+        0,
+        false,
+        false,
+        VMX_WORKSET_MIN,
+        VMX_WORKSET_MAX,
+        {0, 1, 10, 100, 1000},
+        5,
+        VMX_PAIR_ALL,
+        VMX_PAIR_ALL,
+        {VMCS_GUEST_RIP, VMCS_EXIT_REASON, VMCS_EXIT_QUAL, VMCS_GUEST_CS,
+         VMCS_TSC_OFFSET},
+        5,
+        false,
+        VMX_PMC_DEFAULT,
+        VMX_UNIT_ALL,
+        VMX_ADAPTIVE_PERCENTILE,
+        VMX_ADAPTIVE_PRECISION,
+        VMX_ADAPTIVE_BUDGET_MS,
+        false,
+        "cpuid",
+        guest_code,
+        VMEXIT_CPUID,
+        0,
+};
+
+bool
+vmx_config_has_cpu(int cpu)
+{
+        if (vmx_config.all_cpus)
+                return true;
+        if (cpu >= VMX_MAX_CPUS)
+                return false;
+        return !!(vmx_config.cpu_mask[cpu / 64] & __BIT(cpu % 64));
+}
+
+int
+vmx_config_first_cpu(void)
+{
+        int cpu;
+
+        for (cpu = 0; cpu < vmlatency_cpu_count(); ++cpu) {
+                if (vmlatency_cpu_online(cpu) && vmx_config_has_cpu(cpu))
+                        return cpu;
+        }
+        return -1;
+}
+
+void
+vmx_config_print(void)
+{
+        vmx_config_t *c = &vmx_config;
+        u32 i;
+        int cpu;
+
+        vmlatency_printk("samples %u warmup %u\n", c->samples, c->warmup);
+        vmlatency_printk("batches %u-%u factor %u\n", c->batch_min,
+                         c->batch_max, c->batch_factor);
+        vmlatency_printk("payload %s proc %#x proc2 %#x\n", c->payload,
+                         c->proc_ctls, c->proc_ctls2);
+        vmlatency_printk("ept %d vpid %d\n", c->ept, c->vpid);
+        vmlatency_printk("workset %u-%u\n", c->workset_min, c->workset_max);
+        for (i = 0; i < c->ptimer_count; ++i)
+                vmlatency_printk("ptimer %u\n", c->ptimer[i]);
+        vmlatency_printk("kick %#x migrate %#x\n", c->kick_pairs,
+                         c->migrate_pairs);
+        for (i = 0; i < c->shadow_field_count; ++i)
+                vmlatency_printk("shadow %#x\n", c->shadow_fields[i]);
+        vmlatency_printk("pmc %d events %#x\n", c->pmc, c->pmc_events);
+        vmlatency_printk("units %#x\n", c->units);
+        vmlatency_printk("adaptive percentile %u precision %u budget %u ms\n",
+                         c->percentile, c->precision, c->budget_ms);
+        vmlatency_printk("calibrate %d\n", c->calibrate);
+
+        if (c->all_cpus) {
+                vmlatency_printk("cpus all\n");
+                return;
+        }
+
+        for (cpu = 0; cpu < VMX_MAX_CPUS; ++cpu) {
+                if (vmx_config_has_cpu(cpu))
+                        vmlatency_printk("cpu %d\n", cpu);
+        }
+}
 
 typedef struct {
     descriptor_t gdt;
@@ -52,6 +149,7 @@ allocate_memory(vm_monitor_t *vmm)
         if (allocate_vmpage(&vmm->io_bitmap_a) == 0) cnt++; else return -cnt;
         if (allocate_vmpage(&vmm->io_bitmap_b) == 0) cnt++; else return -cnt;
         if (allocate_vmpage(&vmm->msr_bitmap) == 0) cnt++; else return -cnt;
+        if (allocate_vmpage(&vmm->guest_data) == 0) cnt++; else return -cnt;
 
         return cnt;
 }
@@ -59,11 +157,12 @@ allocate_memory(vm_monitor_t *vmm)
 static inline void
 free_memory(vm_monitor_t *vmm, int cnt)
 {
+        if (cnt == 6) { free_vmpage(&vmm->guest_data); cnt--; }
         if (cnt == 5) { free_vmpage(&vmm->msr_bitmap); cnt--; }
         if (cnt == 4) { free_vmpage(&vmm->io_bitmap_b); cnt--; }
         if (cnt == 3) { free_vmpage(&vmm->io_bitmap_a); cnt--; }
-        if (cnt == 2) { free_vmpage(&vmm->vmxon_region); cnt--; }
-        if (cnt == 1) { free_vmpage(&vmm->vmcs); cnt--; }
+        if (cnt == 2) { free_vmpage(&vmm->vmcs); cnt--; }
+        if (cnt == 1) { free_vmpage(&vmm->vmxon_region); cnt--; }
 }
 
 static inline bool
@@ -170,6 +269,17 @@ get_segment_ar(u16 seg)
         return (__lar(seg) >> 0x8) & 0xf0ff; /* Clear undefined bits */
 }
 
+/* Extract TR base from its 16-byte descriptor in GDT */
+static inline u64
+get_tr_base(u64 gdt_base, u16 tr)
+{
+        u64 lo = ((u64 *)(gdt_base + tr))[0];
+        u64 hi = ((u64 *)(gdt_base + tr))[1];
+
+        return ((lo >> 16) & 0xffffff) | (((lo >> 56) & 0xff) << 24)
+             | (hi << 32);
+}
+
 /* Initialize guest state to match host state */
 static inline void
 initialize_vmcs(vm_monitor_t *vmm)
@@ -178,7 +288,7 @@ initialize_vmcs(vm_monitor_t *vmm)
         u16 val16, tr, tr_limit;
         descriptor_t gdtr, idtr;
         u64 fs_base, gs_base;
-        u64 trbase, trdesc_lo, trdesc_hi;
+        u64 trbase;
         u32 ia32_sysenter_cs;
         u64 ia32_sysenter_esp, ia32_sysenter_eip;
         u64 cr0, cr3, cr4;
@@ -259,18 +369,14 @@ initialize_vmcs(vm_monitor_t *vmm)
         __vmwrite(VMCS_HOST_TR, tr);
         __vmwrite(VMCS_GUEST_TR_LIMIT, tr_limit);
         __vmwrite(VMCS_GUEST_TR_ACCESS_RIGHTS, get_segment_ar(tr));
-        /* Extracting TR.base from GDT */
-        trdesc_lo = ((u64*)(gdtr.base + tr))[0];
-        trbase = ((trdesc_lo >> 16) & 0xffffff)
-               | (((trdesc_lo >> 56) & 0xff) << 24);
-        trdesc_hi = ((u64*)(gdtr.base + tr))[1];
-        trbase |= trdesc_hi << 32;
+        trbase = get_tr_base(gdtr.base, tr);
         __vmwrite(VMCS_GUEST_TR_BASE, trbase);
         __vmwrite(VMCS_HOST_TR_BASE, trbase);
 
         /* 64-bit control fields */
         __vmwrite(VMCS_IO_BITMAP_A_ADDR, vmm->io_bitmap_a.pa);
         __vmwrite(VMCS_IO_BITMAP_B_ADDR, vmm->io_bitmap_b.pa);
+        __vmwrite(VMCS_MSR_BITMAP_ADDR, vmm->msr_bitmap.pa);
         __vmwrite(VMCS_EXEC_VMCS_PTR, 0);
         __vmwrite(VMCS_TSC_OFFSET, 0);
 
@@ -279,23 +385,18 @@ initialize_vmcs(vm_monitor_t *vmm)
         __vmwrite(VMCS_GUEST_IA32_DEBUGCTL, 0);
 
         /* 32-bit control fields */
-        __vmwrite(VMCS_PIN_BASED_VM_CTLS, vmm->pinbased_allowed0 &
-                                          vmm->pinbased_allowed1);
-        /* Secondary controls are not activated */
-        __vmwrite(VMCS_PROC_BASED_VM_CTLS, vmm->procbased_allowed0 &
-                                           vmm->procbased_allowed1);
+        __vmwrite(VMCS_PIN_BASED_VM_CTLS, vmm->pin_ctls);
+        __vmwrite(VMCS_PROC_BASED_VM_CTLS, vmm->proc_ctls);
+        if (vmm->proc_ctls & VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS)
+                __vmwrite(VMCS_PROC_BASED_VM_CTLS2, vmm->proc_ctls2);
         __vmwrite(VMCS_EXCEPTION_BITMAP, 0xffffffff);
         __vmwrite(VMCS_PF_ECODE_MASK, 0);
         __vmwrite(VMCS_PF_ECODE_MATCH, 0);
         __vmwrite(VMCS_CR3_TARGET_CNT, 0);
-        __vmwrite(VMCS_VMEXIT_CTLS, (vmm->exit_ctls_allowed0 &
-                                     vmm->exit_ctls_allowed1) |
-                                    VMCS_VMEXIT_CTL_HOST_ADDR_SPACE_SIZE);
+        __vmwrite(VMCS_VMEXIT_CTLS, vmm->exit_ctls);
         __vmwrite(VMCS_VMEXIT_MSR_STORE_CNT, 0);
         __vmwrite(VMCS_VMEXIT_MSR_LOAD_CNT, 0);
-        __vmwrite(VMCS_VMENTRY_CTLS, (vmm->entry_ctls_allowed0 &
-                                      vmm->entry_ctls_allowed1) |
-                                     VMCS_VMENTRY_CTL_IA32E_MODE_GUEST);
+        __vmwrite(VMCS_VMENTRY_CTLS, vmm->entry_ctls);
         __vmwrite(VMCS_VMENTRY_MSR_LOAD_CNT, 0);
         __vmwrite(VMCS_VMENTRY_INT_INFO, 0);
         __vmwrite(VMCS_VMENTRY_ECODE, 0);
@@ -338,7 +439,7 @@ initialize_vmcs(vm_monitor_t *vmm)
         __vmwrite(VMCS_GUEST_RSP, 0);
         /* Host stack pointer is saved just before vmentry */
 
-        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)&guest_code);
+        __vmwrite(VMCS_GUEST_RIP, (uintptr_t)vmx_config.payload_code);
         __vmwrite(VMCS_HOST_RIP, (uintptr_t)vmx_exit);
 
         rflags = __get_rflags();
@@ -355,6 +456,42 @@ initialize_vmcs(vm_monitor_t *vmm)
         __vmwrite(VMCS_HOST_IA32_SYSENTER_EIP, ia32_sysenter_eip);
 }
 
+void
+vmm_load_host_state(vm_monitor_t *vmm)
+{
+        u64 cap = vmm->ia32_vmx_ept_vpid_cap;
+        invvpid_desc_t vpid = {0};
+        descriptor_t gdtr, idtr;
+        u64 cr3 = __get_cr3();
+
+        /* Guest runs on host page tables, both must be the ones this CPU
+         * uses now */
+        __vmwrite(VMCS_HOST_CR3, cr3);
+        __vmwrite(VMCS_GUEST_CR3, cr3);
+
+        /* This CPU may cache translations of the VPID from an earlier
+         * run */
+        if ((__vmread(VMCS_PROC_BASED_VM_CTLS)
+             & VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS) &&
+            (__vmread(VMCS_PROC_BASED_VM_CTLS2)
+             & VMX_PROC_CTL2_ENABLE_VPID)) {
+                vpid.vpid = (u16)__vmread(VMCS_VPID);
+                if (cap & EPT_VPID_CAP_INVVPID_SINGLE)
+                        __invvpid(INVVPID_SINGLE_CONTEXT, &vpid);
+                else if (cap & EPT_VPID_CAP_INVVPID_ALL)
+                        __invvpid(INVVPID_ALL_CONTEXT, &vpid);
+        }
+
+        __get_gdt(&gdtr);
+        __get_idt(&idtr);
+        __vmwrite(VMCS_HOST_GDTR_BASE, gdtr.base);
+        __vmwrite(VMCS_HOST_IDTR_BASE, idtr.base);
+        __vmwrite(VMCS_HOST_TR_BASE, get_tr_base(gdtr.base, __str()));
+        __vmwrite(VMCS_HOST_FS_BASE, __rdmsr(IA32_FS_BASE));
+        __vmwrite(VMCS_HOST_GS_BASE, __rdmsr(IA32_GS_BASE));
+        __vmwrite(VMCS_HOST_IA32_SYSENTER_ESP, __rdmsr(IA32_SYSENTER_ESP));
+}
+
 #define PRINT_VMXCAP_MSR(name) do {                   \
         vmlatency_printk("%-30s (%#x): %#018llx\n",   \
                          #name, name, __rdmsr(name)); \
@@ -373,6 +510,7 @@ print_vmx_info()
                             (u32*)&brand_string[12 + 16 * i]);
         }
         vmlatency_printk("%s\n", brand_string);
+        vmlatency_printk("TSC frequency %llu kHz\n", freq_tsc_khz());
 
         has_true_ctls = !!(__rdmsr(IA32_VMX_BASIC) & __BIT(55));
 
@@ -430,7 +568,7 @@ cache_vmx_capabilities(vm_monitor_t *vmm)
                 vmm->ia32_vmx_true_pinbased_ctls =
                         __rdmsr(IA32_VMX_TRUE_PINBASED_CTLS);
                 vmm->ia32_vmx_true_procbased_ctls =
-                        __rdmsr(IA32_VMX_PROCBASED_CTLS);
+                        __rdmsr(IA32_VMX_TRUE_PROCBASED_CTLS);
                 vmm->ia32_vmx_true_exit_ctls = __rdmsr(IA32_VMX_TRUE_EXIT_CTLS);
                 vmm->ia32_vmx_true_entry_ctls =
                         __rdmsr(IA32_VMX_TRUE_ENTRY_CTLS);
@@ -463,6 +601,188 @@ cache_vmx_capabilities(vm_monitor_t *vmm)
         vmm->entry_ctls_allowed1 =
                 (vmm->has_true_ctls ? vmm->ia32_vmx_true_entry_ctls
                                     : vmm->ia32_vmx_entry_ctls) >> 32;
+
+        if ((vmm->ia32_vmx_procbased_ctls >> 32)
+            & VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS) {
+                vmm->ia32_vmx_procbased_ctls2 =
+                        __rdmsr(IA32_VMX_PROCBASED_CTLS2);
+                vmm->procbased2_allowed0 =
+                        0xffffffff & vmm->ia32_vmx_procbased_ctls2;
+                vmm->procbased2_allowed1 =
+                        vmm->ia32_vmx_procbased_ctls2 >> 32;
+        }
+
+        if (vmm->procbased2_allowed1 & (VMX_PROC_CTL2_ENABLE_EPT |
+                                        VMX_PROC_CTL2_ENABLE_VPID))
+                vmm->ia32_vmx_ept_vpid_cap = __rdmsr(IA32_VMX_EPT_VPID_CAP);
+}
+
+/* Minimal set of controls required to run 64-bit guest */
+static void
+initialize_controls(vm_monitor_t *vmm)
+{
+        vmm->pin_ctls = vmm->pinbased_allowed0 & vmm->pinbased_allowed1;
+        vmm->proc_ctls = vmm->procbased_allowed0 & vmm->procbased_allowed1;
+        vmm->proc_ctls2 = 0;
+        vmm->exit_ctls = (vmm->exit_ctls_allowed0 & vmm->exit_ctls_allowed1)
+                       | VMCS_VMEXIT_CTL_HOST_ADDR_SPACE_SIZE;
+        vmm->entry_ctls = (vmm->entry_ctls_allowed0 &
+                           vmm->entry_ctls_allowed1)
+                        | VMCS_VMENTRY_CTL_IA32E_MODE_GUEST;
+}
+
+/* Add controls requested by experiment configuration */
+static bool
+apply_config_controls(vm_monitor_t *vmm)
+{
+        u32 proc_ctls = vmm->proc_ctls | vmx_config.proc_ctls
+                      | vmx_config.payload_proc_ctls;
+        u32 proc_ctls2 = vmm->procbased2_allowed0 | vmx_config.proc_ctls2;
+
+        if (vmx_config.ept)
+                proc_ctls2 |= VMX_PROC_CTL2_ENABLE_EPT;
+        if (vmx_config.vpid)
+                proc_ctls2 |= VMX_PROC_CTL2_ENABLE_VPID;
+
+        if ((proc_ctls2 & VMX_PROC_CTL2_ENABLE_EPT) && !ept_pointer()) {
+                vmlatency_printk("EPT tables are not built\n");
+                return false;
+        }
+
+        if (proc_ctls2)
+                proc_ctls |= VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS;
+
+        if (proc_ctls & ~vmm->procbased_allowed1) {
+                vmlatency_printk("Unsupported proc-based controls %#x\n",
+                                 proc_ctls & ~vmm->procbased_allowed1);
+                return false;
+        }
+
+        if (proc_ctls2 & ~vmm->procbased2_allowed1) {
+                vmlatency_printk("Unsupported secondary proc-based controls"
+                                 " %#x\n",
+                                 proc_ctls2 & ~vmm->procbased2_allowed1);
+                return false;
+        }
+
+        vmm->proc_ctls = proc_ctls;
+        vmm->proc_ctls2 = proc_ctls2;
+        return true;
+}
+
+bool
+vmx_set_proc_ctls(vm_monitor_t *vmm, u32 ctls)
+{
+        ctls |= vmm->procbased_allowed0;
+        if (ctls & ~vmm->procbased_allowed1)
+                return false;
+
+        vmm->proc_ctls = ctls;
+        __vmwrite(VMCS_PROC_BASED_VM_CTLS, ctls);
+        return true;
+}
+
+bool
+vmx_set_pin_ctls(vm_monitor_t *vmm, u32 ctls)
+{
+        ctls |= vmm->pinbased_allowed0;
+        if (ctls & ~vmm->pinbased_allowed1)
+                return false;
+
+        vmm->pin_ctls = ctls;
+        __vmwrite(VMCS_PIN_BASED_VM_CTLS, ctls);
+        return true;
+}
+
+bool
+vmx_set_exit_ctls(vm_monitor_t *vmm, u32 ctls)
+{
+        ctls |= vmm->exit_ctls_allowed0;
+        if (ctls & ~vmm->exit_ctls_allowed1)
+                return false;
+
+        vmm->exit_ctls = ctls;
+        __vmwrite(VMCS_VMEXIT_CTLS, ctls);
+        return true;
+}
+
+bool
+vmx_set_entry_ctls(vm_monitor_t *vmm, u32 ctls)
+{
+        ctls |= vmm->entry_ctls_allowed0;
+        if (ctls & ~vmm->entry_ctls_allowed1)
+                return false;
+
+        vmm->entry_ctls = ctls;
+        __vmwrite(VMCS_VMENTRY_CTLS, ctls);
+        return true;
+}
+
+/* Load EPT pointer and VPID and drop translations cached for them. Guest
+ * uses host page tables, which may have changed since the previous run */
+static void
+load_ept_vpid(vm_monitor_t *vmm)
+{
+        u64 cap = vmm->ia32_vmx_ept_vpid_cap;
+        invept_desc_t ept = {0};
+        invvpid_desc_t vpid = {0};
+
+        if (!(vmm->proc_ctls & VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS))
+                return;
+
+        if (vmm->proc_ctls2 & VMX_PROC_CTL2_ENABLE_EPT) {
+                ept.eptp = ept_pointer();
+                __vmwrite(VMCS_EPT_POINTER, ept.eptp);
+                if (cap & EPT_VPID_CAP_INVEPT_SINGLE)
+                        __invept(INVEPT_SINGLE_CONTEXT, &ept);
+                else if (cap & EPT_VPID_CAP_INVEPT_ALL)
+                        __invept(INVEPT_ALL_CONTEXT, &ept);
+        }
+
+        if (vmm->proc_ctls2 & VMX_PROC_CTL2_ENABLE_VPID) {
+                vpid.vpid = vmm->vpid;
+                __vmwrite(VMCS_VPID, vmm->vpid);
+                if (cap & EPT_VPID_CAP_INVVPID_SINGLE)
+                        __invvpid(INVVPID_SINGLE_CONTEXT, &vpid);
+                else if (cap & EPT_VPID_CAP_INVVPID_ALL)
+                        __invvpid(INVVPID_ALL_CONTEXT, &vpid);
+        }
+}
+
+bool
+vmx_set_proc_ctls2(vm_monitor_t *vmm, u32 ctls)
+{
+        u32 proc_ctls = vmm->proc_ctls & ~VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS;
+
+        ctls |= vmm->procbased2_allowed0;
+        if (ctls & ~vmm->procbased2_allowed1)
+                return false;
+        if ((ctls & VMX_PROC_CTL2_ENABLE_EPT) && !ept_pointer())
+                return false;
+
+        if (ctls)
+                proc_ctls |= VMX_PROC_CTL_ACTIVATE_SECONDARY_CTLS;
+        if (!vmx_set_proc_ctls(vmm, proc_ctls))
+                return false;
+
+        vmm->proc_ctls2 = ctls;
+        if (ctls) {
+                __vmwrite(VMCS_PROC_BASED_VM_CTLS2, ctls);
+                load_ept_vpid(vmm);
+        }
+        return true;
+}
+
+int
+vmm_setup_vmcs(vm_monitor_t *vmm, vmpage_t *vmcs)
+{
+        ((u32 *)vmcs->p)[0] = get_vmcs_revision_identifier();
+        if (__vmclear(vmcs->pa) != 0 || __vmptrld(vmcs->pa) != 0)
+                return -1;
+
+        initialize_vmcs(vmm);
+        load_ept_vpid(vmm);
+        return 0;
 }
 
 static inline void
@@ -477,77 +797,613 @@ handle_vmexit(void)
 {
         u32 exit_reason = (u32)__vmread(VMCS_EXIT_REASON);
         int basic_exit_reason = exit_reason & 0xffff;
-        if (basic_exit_reason != VMEXIT_CPUID) {
-                vmlatency_printk("Error: VM exit is not caused by CPUID."
-                                 " Basic exit reason %d\n", basic_exit_reason);
+        if (basic_exit_reason != vmx_config.payload_exit_reason) {
+                vmlatency_printk("Error: VM exit is not caused by %s."
+                                 " Basic exit reason %d\n",
+                                 vmx_config.payload, basic_exit_reason);
+                return -1;
+        }
+        return 0;
+}
+
+int
+vmm_init(vm_monitor_t *vmm)
+{
+        int cnt;  /* error counter for memory allocation */
+
+        cache_vmx_capabilities(vmm);
+        initialize_controls(vmm);
+
+        cnt = allocate_memory(vmm);
+        if (cnt <= 0) {
+                free_memory(vmm, -cnt);
                 return -1;
         }
+        vmm->allocated_pages = cnt;
+
+        vmxon_setup_revision_id(vmm);
+        vmcs_setup_revision_id(vmm);
         return 0;
 }
 
 void
-measure_vmlatency()
+vmm_destroy(vm_monitor_t *vmm)
+{
+        free_memory(vmm, vmm->allocated_pages);
+        vmm->allocated_pages = 0;
+}
+
+bool
+vmm_run(vm_monitor_t *vmm, measure_fn_t measure, void *arg)
 {
-        u64 stats[VMX_ITERATIONS];
-        u64 start;
         bool vmlaunch_happened = false;
-        vm_monitor_t vmm = {0};
-        int cnt;  /* error counter for memory allocation */
-        int i, n;  /* loop counters */
         irq_flags_t irq_flags;
         host_state_t  hs;
+        freq_sample_t freq_start, freq_end;
 
-        cache_vmx_capabilities(&vmm);
+        vmm->wrong_cpu = false;
 
-        cnt = allocate_memory(&vmm);
-        if (cnt <= 0)
-                goto out1;
-
-        vmxon_setup_revision_id(&vmm);
-        vmcs_setup_revision_id(&vmm);
+        /* Every run starts with default controls */
+        initialize_controls(vmm);
+        if (!apply_config_controls(vmm))
+                return false;
 
         /* Disable interrupts */
         vmlatency_preempt_disable(&irq_flags);
 
-        if (do_vmxon(&vmm) != 0)
-                goto out2;
+        vmm->wrong_cpu = vmlatency_cpu_id() != vmm->cpu;
+        if (vmm->wrong_cpu)
+                goto out1;
 
-        if (do_vmptrld(&vmm) != 0)
-                goto out3;
+        if (do_vmxon(vmm) != 0)
+                goto out1;
+
+        if (do_vmptrld(vmm) != 0)
+                goto out2;
 
-        initialize_vmcs(&vmm);
+        initialize_vmcs(vmm);
+        load_ept_vpid(vmm);
         save_host_state(&hs);
 
         if (do_vmlaunch() != 0) {
                 vmlatency_printk("VMLAUNCH failed\n");
                 handle_early_exit();
-                goto out4;
+                goto out3;
         }
 
         vmlaunch_happened = true;
         handle_vmexit();
 
-        for (n = 0; n < VMX_ITERATIONS; ++n) {
-                start = __get_tsc();
-                for (i = 0; i < __BIT(n); ++i) {
-                        do_vmresume();
-                }
-                stats[n] = (__get_tsc() - start) / __BIT(n);
-        }
+        freq_read(&freq_start);
+        measure(vmm, arg);
+        freq_read(&freq_end);
+        freq_update(&freq_start, &freq_end);
 
-out4:
-        restore_host_state(&hs);
-        do_vmclear(&vmm);
 out3:
-        do_vmxoff(&vmm);
+        restore_host_state(&hs);
+        do_vmclear(vmm);
 out2:
+        do_vmxoff(vmm);
+out1:
         /* Enable interrupts */
         vmlatency_preempt_enable(&irq_flags);
-out1:
-        free_memory(&vmm, cnt);
 
-        if (vmlaunch_happened) {
-                for (n = 0; n < VMX_ITERATIONS; ++n)
-                        vmlatency_printk("%6d - %lld\n", __BIT(n), stats[n]);
+        return vmlaunch_happened;
+}
+
+/* VMX structures are allocated once per CPU id and reused by every run. EPT
+ * tables are shared by all CPUs */
+static vm_monitor_t **monitors;
+static int monitors_count;
+
+vm_monitor_t *
+vmm_get(int cpu)
+{
+        vm_monitor_t *vmm;
+
+        if (vmx_config.ept && ept_init() != 0)
+                return NULL;
+
+        if (!monitors) {
+                monitors_count = vmlatency_cpu_count();
+                monitors = vmlatency_malloc(monitors_count * sizeof(*monitors));
+                if (!monitors)
+                        return NULL;
+        }
+
+        if (monitors[cpu])
+                return monitors[cpu];
+
+        vmm = vmlatency_malloc(sizeof(*vmm));
+        if (!vmm)
+                return NULL;
+
+        if (vmm_init(vmm) != 0) {
+                vmlatency_free(vmm, sizeof(*vmm));
+                return NULL;
+        }
+        vmm->vpid = cpu + 1;  /* VPID 0 belongs to the host */
+        vmm->cpu = cpu;
+
+        monitors[cpu] = vmm;
+        return vmm;
+}
+
+void
+vmm_free_all(void)
+{
+        int cpu;
+
+        ept_free();
+
+        if (!monitors)
+                return;
+
+        for (cpu = 0; cpu < monitors_count; ++cpu) {
+                if (!monitors[cpu])
+                        continue;
+                vmm_destroy(monitors[cpu]);
+                vmlatency_free(monitors[cpu], sizeof(vm_monitor_t));
+        }
+
+        vmlatency_free(monitors, monitors_count * sizeof(*monitors));
+        monitors = NULL;
+}
+
+/* Unpinned callers are retried this many times if they migrate */
+#define RUN_GUEST_TRIES 16
+
+bool
+run_guest(measure_fn_t measure, void *arg)
+{
+        vm_monitor_t *vmm;
+        bool launched;
+        u32 tries = 0;
+
+        /* Allocation may sleep, so the CPU is chosen with preemption enabled
+         * and checked again by vmm_run */
+        do {
+                vmm = vmm_get(vmlatency_cpu_id());
+                if (!vmm) {
+                        vmlatency_printk("Failed to allocate VMX"
+                                         " structures\n");
+                        return false;
+                }
+                launched = vmm_run(vmm, measure, arg);
+        } while (!launched && vmm->wrong_cpu && ++tries < RUN_GUEST_TRIES);
+
+        if (!launched && vmm->wrong_cpu)
+                vmlatency_printk("Migrated to another CPU %u times\n",
+                                 tries);
+        return launched;
+}
+
+typedef struct {
+        u32 count;
+        u32 size[VMX_MAX_BATCHES];
+        u64 stats[VMX_MAX_BATCHES];
+        bool pmc;  /* counters captured */
+        pmc_counts_t pmc_counts[VMX_MAX_BATCHES];
+        u64 total[VMX_MAX_BATCHES];
+        bool noisy[VMX_MAX_BATCHES];  /* SMI or NMI hit the batch */
+        noise_sample_t noise[VMX_MAX_BATCHES];
+        bool calibrated;
+        calib_t calib;
+} batches_t;
+
+static void
+measure_batches(vm_monitor_t *vmm, void *arg)
+{
+        batches_t *b = arg;
+        noise_sample_t noise_start, noise_end;
+        u64 start;
+        u32 i, n;  /* loop counters */
+
+        for (n = 0; n < b->count; ++n) {
+                noise_read(&noise_start);
+                start = __get_tsc();
+                for (i = 0; i < b->size[n]; ++i) {
+                        do_vmresume();
+                }
+                b->total[n] = __get_tsc() - start;
+                noise_read(&noise_end);
+                b->stats[n] = b->total[n] / b->size[n];
+                b->noisy[n] = noise_delta(&noise_start, &noise_end,
+                                          &b->noise[n]);
+        }
+
+        /* Counters are captured in separate passes, so programming them does
+         * not disturb the timed batches */
+        b->pmc = vmx_config.pmc;
+        for (n = 0; n < b->count && b->pmc; ++n)
+                b->pmc = pmc_measure(vmm, b->size[n], &b->pmc_counts[n]);
+}
+
+/* Average in TSC ticks if selected, in the format parsed by process-data.py.
+ * Core cycles and nanoseconds if they are selected and known, the net cost
+ * if calibrated, and SMI and NMI counts with the ticks lost compared to clean
+ * batches go to an indented line, as performance counters do */
+static void
+print_batch(u32 size, u64 ticks, const noise_sample_t *noise, u64 lost,
+            const u64 *net)
+{
+        char line[256];
+        u64 value;
+        int len = 0;
+
+        line[0] = '\0';
+        if (vmx_config.units & VMX_UNIT_TSC)
+                vmlatency_printk("%6u - %lld\n", size, ticks);
+        else
+                len = vmlatency_snprintf(line, sizeof(line), " size %u",
+                                         size);
+        len = vmlatency_clamp_len(len, sizeof(line));
+
+        if ((vmx_config.units & VMX_UNIT_CORE) &&
+            freq_core_cycles(ticks, &value))
+                len += vmlatency_snprintf(line + len, sizeof(line) - len,
+                                          " core %llu", value);
+        len = vmlatency_clamp_len(len, sizeof(line));
+        if ((vmx_config.units & VMX_UNIT_NS) && freq_ns(ticks, &value))
+                len += vmlatency_snprintf(line + len, sizeof(line) - len,
+                                          " ns %llu.%llu", value / 10,
+                                          value % 10);
+        len = vmlatency_clamp_len(len, sizeof(line));
+        if (net)
+                len += vmlatency_snprintf(line + len, sizeof(line) - len,
+                                          " net %llu.%02llu",
+                                          *net / CALIB_SCALE,
+                                          *net % CALIB_SCALE);
+        len = vmlatency_clamp_len(len, sizeof(line));
+        if (noise)
+                len += vmlatency_snprintf(line + len, sizeof(line) - len,
+                                          " noisy smi %llu nmi %llu lost"
+                                          " %llu", noise->smi, noise->nmi,
+                                          lost);
+        len = vmlatency_clamp_len(len, sizeof(line));
+        /* Every item starts with a space */
+        if (len)
+                vmlatency_printk("        %s\n", line + 1);
+}
+
+/* Per-round-trip cost of the largest clean batch, it has the most accurate
+ * average. Returns 0 if every batch was hit */
+static u64
+clean_batch_cost(const batches_t *b)
+{
+        u32 n;
+
+        for (n = b->count; n > 0; --n)
+                if (!b->noisy[n - 1])
+                        return b->stats[n - 1];
+        return 0;
+}
+
+static void
+print_batches(const batches_t *b)
+{
+        u64 cost = clean_batch_cost(b);
+        u64 expected, lost, lost_total = 0, net;
+        u32 n, noisy = 0;
+
+        for (n = 0; n < b->count; ++n) {
+                lost = 0;
+                if (b->noisy[n]) {
+                        expected = (u64)b->size[n] * cost;
+                        if (cost && b->total[n] > expected)
+                                lost = b->total[n] - expected;
+                        lost_total += lost;
+                        ++noisy;
+                }
+
+                /* Net cost per round-trip in 1/CALIB_SCALE ticks, without
+                 * the loop and the call of the same shape */
+                net = b->total[n] * CALIB_SCALE / b->size[n];
+                net = net > b->calib.call[0] ? net - b->calib.call[0] : 0;
+
+                print_batch(b->size[n], b->stats[n],
+                            b->noisy[n] ? &b->noise[n] : NULL, lost,
+                            b->calibrated ? &net : NULL);
+                if (b->pmc)
+                        pmc_print(&b->pmc_counts[n], b->size[n]);
+        }
+
+        if (noisy)
+                vmlatency_printk("%u of %u batches hit by SMI/NMI, lost %llu"
+                                 " ticks\n", noisy, b->count, lost_total);
+}
+
+void
+measure_vmlatency()
+{
+        batches_t *b;
+        u64 size = vmx_config.batch_min;
+
+        b = vmlatency_malloc(sizeof(*b));
+        if (!b)
+                return;
+
+        for (b->count = 0; b->count < VMX_MAX_BATCHES; ++b->count) {
+                if (size > vmx_config.batch_max)
+                        break;
+                b->size[b->count] = (u32)size;
+                size *= vmx_config.batch_factor;
+        }
+
+        b->calibrated = vmx_config.calibrate && calib_run(&b->calib);
+        if (b->calibrated)
+                calib_print(&b->calib);
+
+        if (run_guest(measure_batches, b)) {
+                if (vmx_config.pmc && !b->pmc)
+                        vmlatency_printk("Performance counters are not"
+                                         " supported\n");
+                print_batches(b);
         }
+
+        vmlatency_free(b, sizeof(*b));
+}
+
+static void
+measure_samples(vm_monitor_t *vmm, void *arg)
+{
+        sample_buffer_t *buf = arg;
+        noise_sample_t noise_start, noise_end;
+        u32 end = buf->taken + VMX_SAMPLES_CHUNK;
+        u64 start;
+        u32 i;
+
+        if (end > buf->count)
+                end = buf->count;
+
+        for (i = 0; i < vmx_config.warmup; ++i)
+                do_vmresume();
+
+        /* Chunks hold whole noise windows, so a window never spans the
+         * yield between chunks */
+        for (i = buf->taken; i < end; ++i) {
+                if (buf->noise && i % NOISE_WINDOW == 0)
+                        noise_read(&noise_start);
+                start = __get_tsc_start();
+                do_vmresume();
+                buf->samples[i] = __get_tsc_end() - start;
+                if (buf->noise && ((i + 1) % NOISE_WINDOW == 0 ||
+                                   i + 1 == buf->count)) {
+                        noise_read(&noise_end);
+                        noise_delta(&noise_start, &noise_end,
+                                    &buf->noise[i / NOISE_WINDOW]);
+                }
+        }
+        buf->taken = end;
+}
+
+bool
+run_guest_chunked(measure_fn_t measure, void *arg, const u32 *taken,
+                  u32 count)
+{
+        u32 prev;
+
+        while (*taken < count) {
+                prev = *taken;
+                if (!run_guest(measure, arg))
+                        return false;
+                /* Measure gave up */
+                if (*taken == prev)
+                        break;
+                if (*taken < count)
+                        vmlatency_yield();
+        }
+        return true;
+}
+
+bool
+run_guest_samples(sample_buffer_t *buf)
+{
+        buf->taken = 0;
+        return run_guest_chunked(measure_samples, buf, &buf->taken,
+                                 buf->count);
+}
+
+typedef struct {
+        noise_sample_t noise;  /* SMIs and NMIs of all windows */
+        u32 windows;
+        u32 noisy;
+        u32 clean;  /* samples outside noisy windows */
+        sample_summary_t summary;  /* of clean samples */
+        u64 lost;
+} noise_windows_t;
+
+/* Move samples of windows hit by SMIs or NMIs to the end of the buffer and
+ * summarize the rest. Excess of noisy samples over the clean median is
+ * attributed to SMM and NMI handlers. Must run before samples are sorted */
+static void
+summarize_noise(sample_buffer_t *buf, noise_windows_t *r)
+{
+        const noise_sample_t *delta;
+        u32 w, i, end;
+        u64 tmp;
+
+        r->noise.smi = r->noise.nmi = 0;
+        r->windows = NOISE_WINDOWS(buf->count);
+        r->noisy = r->clean = 0;
+        r->lost = 0;
+
+        for (w = 0; w < r->windows; ++w) {
+                end = (w + 1) * NOISE_WINDOW;
+                if (end > buf->count)
+                        end = buf->count;
+
+                delta = &buf->noise[w];
+                if (delta->smi || delta->nmi) {
+                        r->noise.smi += delta->smi;
+                        r->noise.nmi += delta->nmi;
+                        ++r->noisy;
+                        continue;
+                }
+
+                for (i = w * NOISE_WINDOW; i < end; ++i, ++r->clean) {
+                        tmp = buf->samples[r->clean];
+                        buf->samples[r->clean] = buf->samples[i];
+                        buf->samples[i] = tmp;
+                }
+        }
+
+        if (!r->noisy || !r->clean)
+                return;
+
+        stats_summarize(buf->samples, r->clean, &r->summary);
+        for (i = r->clean; i < buf->count; ++i)
+                if (buf->samples[i] > r->summary.median)
+                        r->lost += buf->samples[i] - r->summary.median;
+}
+
+static void
+print_noise(const noise_windows_t *r)
+{
+        if (!r->noisy)
+                return;
+
+        vmlatency_printk("%u of %u windows hit: smi %llu nmi %llu\n",
+                         r->noisy, r->windows, r->noise.smi, r->noise.nmi);
+        if (!r->clean)
+                return;
+
+        stats_print_summary("round-trip clean", &r->summary);
+        vmlatency_printk("noisy windows lost %llu ticks\n", r->lost);
+}
+
+void
+measure_vmlatency_distribution(u32 count)
+{
+        sample_buffer_t buf;
+        sample_summary_t summary, net;
+        noise_windows_t noise;
+        calib_t calib;
+        bool calibrated;
+        size_t size, noise_size;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+        noise_size = NOISE_WINDOWS((size_t)count) * sizeof(noise_sample_t);
+
+        buf.count = count;
+        buf.samples = vmlatency_malloc(size);
+        if (!buf.samples) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                return;
+        }
+        /* Noise attribution is optional */
+        buf.noise = vmlatency_malloc(noise_size);
+        if (!buf.noise)
+                vmlatency_printk("Failed to allocate noise windows of %u"
+                                 " samples\n", count);
+
+        calibrated = vmx_config.calibrate && calib_run(&calib);
+        if (calibrated)
+                calib_print(&calib);
+
+        if (run_guest_samples(&buf)) {
+                if (buf.noise)
+                        summarize_noise(&buf, &noise);
+                stats_summarize(buf.samples, buf.count, &summary);
+                stats_print_summary("round-trip", &summary);
+                if (calibrated) {
+                        calib_net_summary(&summary, calib.sample_call, &net);
+                        stats_print_summary("round-trip net", &net);
+                }
+                stats_print_histogram("round-trip", buf.samples, buf.count);
+                if (buf.noise)
+                        print_noise(&noise);
+        }
+
+        if (buf.noise)
+                vmlatency_free(buf.noise, noise_size);
+        vmlatency_free(buf.samples, size);
+}
+
+typedef struct {
+        u64 *entry;
+        u64 *guest;
+        u64 *exit;
+        u32 count;
+        u32 taken;
+} split_buffer_t;
+
+/* Guest code stores TSC right after VM entry and right before the exiting
+ * instruction. RDTSC exiting and TSC offsetting are disabled, so guest and
+ * host timestamps are directly comparable */
+static void
+measure_split(vm_monitor_t *vmm, void *arg)
+{
+        split_buffer_t *buf = arg;
+        volatile u64 *ts = (volatile u64 *)vmm->guest_data.p;
+        u32 warmup = vmx_config.warmup;
+        u32 end_sample = buf->taken + VMX_SAMPLES_CHUNK;
+        u64 start, end;
+        u32 i;
+
+        if (end_sample > buf->count)
+                end_sample = buf->count;
+
+        /* Guest code executes RDTSC, drop controls of the configured payload,
+         * e.g. RDTSC exiting */
+        vmx_set_proc_ctls(vmm, vmm->proc_ctls & ~vmx_config.payload_proc_ctls);
+
+        for (i = 0; i < warmup; ++i) {
+                /* CPUID exit leaves RIP at CPUID, restart guest code */
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)&guest_timestamps);
+                do_vmresume_arg(vmm->guest_data.p);
+        }
+
+        for (i = buf->taken; i < end_sample; ++i) {
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)&guest_timestamps);
+                start = __get_tsc_start();
+                do_vmresume_arg(vmm->guest_data.p);
+                end = __get_tsc_end();
+
+                buf->entry[i] = ts[0] - start;
+                buf->guest[i] = ts[1] - ts[0];
+                buf->exit[i] = end - ts[1];
+        }
+        buf->taken = end_sample;
+}
+
+void
+measure_vmlatency_split(u32 count)
+{
+        split_buffer_t buf;
+        sample_summary_t summary;
+        size_t size;
+
+        if (!count)
+                count = vmx_config.samples;
+        size = (size_t)count * sizeof(u64);
+
+        buf.count = count;
+        buf.entry = vmlatency_malloc(size);
+        buf.guest = vmlatency_malloc(size);
+        buf.exit = vmlatency_malloc(size);
+        if (!buf.entry || !buf.guest || !buf.exit) {
+                vmlatency_printk("Failed to allocate %u samples\n", count);
+                goto out;
+        }
+
+        buf.taken = 0;
+        if (run_guest_chunked(measure_split, &buf, &buf.taken, buf.count)) {
+                stats_summarize(buf.entry, buf.count, &summary);
+                stats_print_summary("entry", &summary);
+                stats_summarize(buf.guest, buf.count, &summary);
+                stats_print_summary("guest", &summary);
+                stats_summarize(buf.exit, buf.count, &summary);
+                stats_print_summary("exit", &summary);
+        }
+
+out:
+        if (buf.exit)
+                vmlatency_free(buf.exit, size);
+        if (buf.guest)
+                vmlatency_free(buf.guest, size);
+        if (buf.entry)
+                vmlatency_free(buf.entry, size);
 }
@@ -20,6 +20,142 @@
 
 #include "types.h"
 #include "api.h"
+#include "noise.h"
+
+/* Round-trips done before sampling to warm up caches and predictors */
+#define VMX_WARMUP_ITERATIONS 1000
+/* Warm-up runs with interrupts disabled, in every chunk of chunked modes */
+#define VMX_WARMUP_LIMIT 100000
+
+/* Number of samples used when it is not specified explicitly */
+#define VMX_DEFAULT_SAMPLES 100000
+
+/* Batch mode runs batches of batch_min, batch_min * batch_factor, ... up to
+ * batch_max round-trips */
+#define VMX_BATCH_MIN 1
+#define VMX_BATCH_MAX (1u << 19)
+/* All batches run in one guest launch with interrupts disabled */
+#define VMX_BATCH_LIMIT (1u << 20)
+#define VMX_BATCH_FACTOR 2
+#define VMX_MAX_BATCHES 32
+
+/* Working set sizes in bytes, multiplied by 4 from min to max. Guest loads
+ * one quadword per line */
+#define VMX_WORKSET_MIN 0x1000
+#define VMX_WORKSET_MAX 0x1000000
+#define VMX_WORKSET_LINE 64
+
+/* Maximum number of VMX-preemption timer values */
+#define VMX_MAX_PTIMER_VALUES 8
+/* Every sample of a value waits for the timer with interrupts disabled */
+#define VMX_PTIMER_LIMIT (1u << 16)
+
+/* Maximum number of fields of VMCS shadowing experiment */
+#define VMX_MAX_SHADOW_FIELDS 8
+
+/* CPU pairs of kick and migration experiments */
+#define VMX_PAIR_SMT     0x1  /* SMT siblings */
+#define VMX_PAIR_PACKAGE 0x2  /* different cores of a package */
+#define VMX_PAIR_REMOTE  0x4  /* different packages */
+#define VMX_PAIR_ALL     (VMX_PAIR_SMT | VMX_PAIR_PACKAGE | VMX_PAIR_REMOTE)
+
+/* General-purpose counter events captured by batch mode in addition to fixed
+ * counters */
+#define VMX_PMC_L1D_MISSES     0x1
+#define VMX_PMC_L2_MISSES      0x2
+#define VMX_PMC_LLC_MISSES     0x4
+#define VMX_PMC_DTLB_MISSES    0x8
+#define VMX_PMC_MACHINE_CLEARS 0x10
+#define VMX_PMC_BRANCH_MISSES  0x20
+#define VMX_PMC_EVENTS         6
+#define VMX_PMC_DEFAULT (VMX_PMC_L1D_MISSES | VMX_PMC_L2_MISSES \
+                         | VMX_PMC_LLC_MISSES | VMX_PMC_DTLB_MISSES)
+
+/* Adaptive sampling stops when 95% confidence interval of the percentile
+ * is narrower than precision or after the time budget. Percentile and
+ * precision (relative half-width) are in parts per million */
+#define VMX_ADAPTIVE_PERCENTILE 500000
+#define VMX_ADAPTIVE_PRECISION  5000
+#define VMX_ADAPTIVE_BUDGET_MS  5000
+
+/* Units of reported results */
+#define VMX_UNIT_TSC  0x1  /* TSC ticks as measured */
+#define VMX_UNIT_CORE 0x2  /* core cycles, scaled by APERF/MPERF */
+#define VMX_UNIT_NS   0x4  /* nanoseconds, scaled by TSC frequency */
+#define VMX_UNIT_ALL  (VMX_UNIT_TSC | VMX_UNIT_CORE | VMX_UNIT_NS)
+
+/* Highest CPU id that can be selected in CPU mask plus one */
+#define VMX_MAX_CPUS 1024
+
+/* Experiment parameters shared by all measurement modes. Set at load time or
+ * through the control interface */
+typedef struct vmx_config {
+        u32 samples;       /* individually timed round-trips */
+        u32 warmup;        /* round-trips before sampling */
+        u32 batch_min;
+        u32 batch_max;
+        u32 batch_factor;
+
+        /* CPUs used by all-CPU and sweep modes. Other modes run on the first
+         * CPU in the mask unless CPU is given explicitly */
+        bool all_cpus;
+        u64 cpu_mask[VMX_MAX_CPUS / 64];
+
+        /* Controls set on top of the minimal ones */
+        u32 proc_ctls;
+        u32 proc_ctls2;
+
+        /* Run the guest with identity-mapped EPT and with a VPID */
+        bool ept;
+        bool vpid;
+
+        u32 workset_min;
+        u32 workset_max;
+
+        /* VMX-preemption timer values in timer ticks */
+        u32 ptimer[VMX_MAX_PTIMER_VALUES];
+        u32 ptimer_count;
+
+        /* CPU pairs, VMX_PAIR_* */
+        u32 kick_pairs;
+        u32 migrate_pairs;
+
+        /* Encodings of VMCS fields accessed by the guest with VMCS shadowing */
+        u32 shadow_fields[VMX_MAX_SHADOW_FIELDS];
+        u32 shadow_field_count;
+
+        /* Capture performance counters around batches, VMX_PMC_* events */
+        bool pmc;
+        u32 pmc_events;
+
+        /* VMX_UNIT_* used by summaries and batches */
+        u32 units;
+
+        /* Stop condition of adaptive sampling */
+        u32 percentile;
+        u32 precision;
+        u32 budget_ms;
+
+        /* Measure harness overhead before batches and samples and report
+         * results with it subtracted */
+        bool calibrate;
+
+        /* Exiting instruction executed by the guest */
+        const char *payload;
+        void (*payload_code)(void);
+        u32 payload_exit_reason;
+        u32 payload_proc_ctls;
+} vmx_config_t;
+
+extern vmx_config_t vmx_config;
+
+/* Select guest payload by name of VM exit matrix entry. Returns -1 if the
+ * payload is unknown or needs guest registers set up */
+int vmx_config_set_payload(vmx_config_t *config, const char *name);
+bool vmx_config_has_cpu(int cpu);
+/* First online CPU in the CPU mask, -1 if there is none */
+int vmx_config_first_cpu(void);
+void vmx_config_print(void);
 
 typedef struct vm_monitor {
         /* Cached VMX capabilities */
@@ -47,6 +183,19 @@ typedef struct vm_monitor {
         u32 entry_ctls_allowed0;
         u32 entry_ctls_allowed1;
 
+        u64 ia32_vmx_procbased_ctls2;  /* 0 if secondary controls are absent */
+        u32 procbased2_allowed0;
+        u32 procbased2_allowed1;
+
+        u64 ia32_vmx_ept_vpid_cap;  /* 0 if neither EPT nor VPID exist */
+
+        /* VM-execution controls written to VMCS */
+        u32 pin_ctls;
+        u32 proc_ctls;
+        u32 proc_ctls2;
+        u32 exit_ctls;
+        u32 entry_ctls;
+
         vmpage_t vmxon_region;
         vmpage_t vmcs;
 
@@ -54,14 +203,183 @@ typedef struct vm_monitor {
         vmpage_t io_bitmap_b;
         vmpage_t msr_bitmap;
 
+        /* Page shared with guest code, e.g. for guest-side timestamps */
+        vmpage_t guest_data;
+
+        int allocated_pages;
+
+        u16 vpid;
+
+        /* CPU the structures belong to. vmm_run on another CPU fails and
+         * sets wrong_cpu */
+        int cpu;
+        bool wrong_cpu;
+
         u64 old_vmxe;
         bool our_vmxon;
 } vm_monitor_t;
 
+typedef void (*measure_fn_t)(vm_monitor_t *vmm, void *arg);
+
+typedef struct sample_buffer {
+        u64 *samples;
+        u32 count;
+        u32 taken;
+        /* Optional SMI/NMI counts of NOISE_WINDOWS(count) windows */
+        noise_sample_t *noise;
+} sample_buffer_t;
+
 bool vmx_enabled(void);
 
+/* Cache VMX capabilities and allocate VMX structures. May sleep */
+int vmm_init(vm_monitor_t *vmm);
+void vmm_destroy(vm_monitor_t *vmm);
+
+/* Enter VMX operation on the current CPU, launch the guest and call measure
+ * function with interrupts disabled. Returns true if the guest was launched.
+ * Does not sleep, so it may be called in atomic context */
+bool vmm_run(vm_monitor_t *vmm, measure_fn_t measure, void *arg);
+
+/* Get VMX structures of the CPU, allocating them on first use. VMXON
+ * region, VMCS and bitmaps are reused across runs. May sleep */
+vm_monitor_t *vmm_get(int cpu);
+void vmm_free_all(void);
+
+/* vmm_run with VMX structures of the current CPU. Retries if the caller is
+ * not pinned and migrates before interrupts are disabled */
+bool run_guest(measure_fn_t measure, void *arg);
+
+/* Samples taken per guest launch by chunked modes, launches are separated by
+ * vmlatency_yield. A multiple of NOISE_WINDOW */
+#define VMX_SAMPLES_CHUNK 10000
+
+/* Call run_guest until measure advances *taken to count, yielding between
+ * launches, so interrupts are not disabled for long. Measure takes at most
+ * a chunk per launch and may stop early, e.g. if its controls are not
+ * supported. Returns false if the guest was not launched */
+bool run_guest_chunked(measure_fn_t measure, void *arg, const u32 *taken,
+                       u32 count);
+
+/* Time every round-trip into the buffer in chunks */
+bool run_guest_samples(sample_buffer_t *buf);
+
+/* Set primary proc-based controls on top of the required ones. Returns false
+ * if CPU does not support the controls */
+bool vmx_set_proc_ctls(vm_monitor_t *vmm, u32 ctls);
+
+/* Set pin-based controls on top of the required ones. Returns false if CPU
+ * does not support the controls */
+bool vmx_set_pin_ctls(vm_monitor_t *vmm, u32 ctls);
+
+/* Set VM-exit controls on top of the required ones. Returns false if CPU
+ * does not support the controls */
+bool vmx_set_exit_ctls(vm_monitor_t *vmm, u32 ctls);
+
+/* Set VM-entry controls on top of the required ones. Returns false if CPU
+ * does not support the controls */
+bool vmx_set_entry_ctls(vm_monitor_t *vmm, u32 ctls);
+
+/* Set secondary proc-based controls, activating them if ctls is not 0. EPT
+ * pointer and VPID are loaded and their cached translations are flushed */
+bool vmx_set_proc_ctls2(vm_monitor_t *vmm, u32 ctls);
+
+/* Initialize another VMCS region with the controls, guest and host state of
+ * vmm and make it current. Caller VMCLEARs it before vmm_run returns.
+ * Returns -1 if VMCLEAR or VMPTRLD fails */
+int vmm_setup_vmcs(vm_monitor_t *vmm, vmpage_t *vmcs);
+
+/* Write host state of the current CPU which differs between CPUs, e.g.
+ * GS base, TSS and CR3 with its PCID, to the current VMCS and flush
+ * translations of its VPID. Needed after VMCS moves to another CPU */
+void vmm_load_host_state(vm_monitor_t *vmm);
+
 void print_vmx_info(void);
 
 void measure_vmlatency(void);
 
+/* Time every VM round-trip separately and print the latency distribution */
+void measure_vmlatency_distribution(u32 count);
+
+/* Use guest-side timestamps to report VM-entry, in-guest and VM-exit
+ * latency distributions separately */
+void measure_vmlatency_split(u32 count);
+
+/* Measure VM round-trip latency for each supported exit reason */
+void measure_vmexit_matrix(u32 count);
+
+/* Run the guest on all online CPUs at the same time and report per-CPU
+ * latency distributions and aggregate exit rate */
+void measure_vmlatency_all_cpus(u32 count);
+
+/* Run the guest on each online CPU in turn and report latency distribution
+ * tagged with CPU topology */
+void measure_vmlatency_sweep(u32 count);
+
+/* Measure CPUID round-trip and TLB refill cost after VM exit with EPT and
+ * VPID enabled and disabled */
+void measure_vmlatency_ept(u32 count);
+
+/* Measure VM transition latency and guest cache re-warm cost after VM exit
+ * for a range of guest working set sizes */
+void measure_vmlatency_workset(u32 count);
+
+/* Let the guest spin until VMX-preemption timer expires and report exit
+ * delivery delay against the deadline and timer re-arm cost */
+void measure_vmlatency_ptimer(u32 count);
+
+/* Let the guest send itself an IPI and report latency of the external
+ * interrupt VM exit with and without acknowledge interrupt on exit */
+void measure_vmlatency_extint(u32 count);
+
+/* Kick a spinning guest on the CPU (first CPU in the mask if -1) with IPIs
+ * from another CPU and report latency from sending IPI to VM exit for each
+ * selected CPU pair */
+void measure_vmlatency_kick(u32 count, int cpu);
+
+/* Name of VMCS field or NULL if the field is unknown */
+const char *vmcs_field_name(u32 encoding);
+
+/* Time VMREAD and VMWRITE of every known VMCS field and report the cost
+ * grouped by field width and type */
+void measure_vmlatency_fields(u32 count);
+
+/* Let the guest VMREAD and VMWRITE configured fields through a shadow VMCS
+ * and with VM exits and report the cost of each */
+void measure_vmlatency_shadow(u32 count);
+
+/* Switch between growing number of launched VMCSes with VMPTRLD and
+ * VMRESUME, and start them cold with VMCLEAR, VMPTRLD and VMLAUNCH */
+void measure_vmlatency_pool(u32 count);
+
+/* Move a launched VMCS back and forth between the CPU (first CPU in the mask
+ * if -1) and another CPU of each selected pair and report VMCLEAR, load and
+ * launch cost and the first round-trips after every move */
+void measure_vmlatency_migrate(u32 count, int cpu);
+
+/* Switch between identity-mapped EPT views with VMFUNC in the guest and
+ * compare with switching them by the host on VMCALL exits */
+void measure_vmlatency_vmfunc(u32 count);
+
+/* Measure CPUID round-trip while switching 0 to all of the commonly switched
+ * MSRs with VMCS MSR lists and with RDMSR/WRMSR on the host path */
+void measure_vmlatency_msrlist(u32 count);
+
+/* Measure CPUID round-trip with each VM-entry and VM-exit control loading or
+ * saving EFER, PAT, PERF_GLOBAL_CTRL and debug controls, alone and in groups,
+ * and report marginal cost of each over the required controls */
+void measure_vmlatency_ctls(u32 count);
+
+/* Time round-trips in chunks until the confidence interval of the configured
+ * percentile is narrow enough, the time budget runs out or count samples are
+ * taken. Outliers are rejected online */
+void measure_vmlatency_adaptive(u32 count);
+
+/* Measure timer, empty loop and call overhead, and round-trips in loops
+ * unrolled 1, 4 and 16 times, raw and with the overhead subtracted */
+void measure_vmlatency_calib(u32 count);
+
+/* Execute text command, e.g. "samples count=100000 cpu=2". Output goes
+ * through vmlatency_printk. Returns -1 if command is malformed */
+int vmlatency_command(const char *cmd);
+
 #endif /* __VMX_H__ */
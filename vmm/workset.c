@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2026 Evgenii Iuliugin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "vmx.h"
+#include "api.h"
+#include "asm-inlines.h"
+#include "cpu-defs.h"
+#include "stats.h"
+
+/* Every sample walks the whole working set twice, so fewer samples are taken
+ * than in other modes */
+#define WORKSET_DEFAULT_SAMPLES 1000
+/* Lines walked per guest launch, at least one sample is taken. Interrupts of
+ * the host are handled between launches */
+#define WORKSET_CHUNK_LINES (1 << 18)
+
+extern void guest_workset(void);
+
+typedef struct {
+        guest_workset_t args;
+        char *buffer;
+        u32 *order;  /* scratch space for pointer chain */
+        u32 count;
+        u64 taken;   /* iterations including warm-up */
+        u64 *transition;
+        u64 *first_pass;
+        u64 *second_pass;
+        sample_summary_t transition_summary;
+        sample_summary_t first_summary;
+        sample_summary_t second_summary;
+} workset_t;
+
+static u64
+xorshift64(u64 *state)
+{
+        u64 x = *state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+/* Link lines into a single random cycle (Sattolo's algorithm), so hardware
+ * prefetchers cannot predict the next line */
+static void
+build_chain(workset_t *w, u32 lines)
+{
+        u64 seed = 0x9e3779b97f4a7c15ull;
+        u32 i, j, tmp;
+
+        for (i = 0; i < lines; ++i)
+                w->order[i] = i;
+
+        for (i = lines - 1; i > 0; --i) {
+                j = (u32)(xorshift64(&seed) % i);
+                tmp = w->order[i];
+                w->order[i] = w->order[j];
+                w->order[j] = tmp;
+        }
+
+        for (i = 0; i < lines; ++i) {
+                *(u64 *)(w->buffer + (size_t)i * VMX_WORKSET_LINE) =
+                        (uintptr_t)(w->buffer
+                                    + (size_t)w->order[i] * VMX_WORKSET_LINE);
+        }
+}
+
+static void
+measure_workset(vm_monitor_t *vmm, void *arg)
+{
+        workset_t *w = arg;
+        guest_workset_t *ws = (guest_workset_t *)vmm->guest_data.p;
+        u32 warmup = vmx_config.warmup;
+        u32 chunk = WORKSET_CHUNK_LINES / 2 / (u32)w->args.count;
+        u64 total = (u64)warmup + w->count;
+        u64 start, end;
+        u32 n;
+
+        *ws = w->args;
+
+        if (!chunk)
+                chunk = 1;
+        if (total - w->taken < chunk)
+                chunk = (u32)(total - w->taken);
+
+        for (; chunk; --chunk, ++w->taken) {
+                /* CPUID exit leaves RIP at CPUID, restart guest code */
+                __vmwrite(VMCS_GUEST_RIP, (uintptr_t)guest_workset);
+                start = __get_tsc_start();
+                do_vmresume_arg(ws);
+                end = __get_tsc_end();
+
+                if (w->taken < warmup)
+                        continue;
+
+                n = (u32)(w->taken - warmup);
+                w->transition[n] = (ws->entry_tsc - start)
+                                 + (end - ws->exit_tsc);
+                w->first_pass[n] = ws->first_pass;
+                w->second_pass[n] = ws->second_pass;
+        }
+}
+
+/* Warm-up and samples are taken in chunks of run_guest */
+static bool
+run_workset(workset_t *w)
+{
+        u64 total = (u64)vmx_config.warmup + w->count;
+
+        for (w->taken = 0; w->taken < total;) {
+                if (!run_guest(measure_workset, w))
+                        return false;
+                if (w->taken < total)
+                        vmlatency_yield();
+        }
+
+        stats_summarize(w->transition, w->count, &w->transition_summary);
+        stats_summarize(w->first_pass, w->count, &w->first_summary);
+        stats_summarize(w->second_pass, w->count, &w->second_summary);
+        return true;
+}
+
+static void
+report_workset(workset_t *w, u32 size)
+{
+        const char *pattern = w->args.chase ? "chase" : "seq";
+        char name[64];
+
+        vmlatency_snprintf(name, sizeof(name), "%s %uK transition", pattern,
+                           size >> 10);
+        stats_print_summary(name, &w->transition_summary);
+        vmlatency_snprintf(name, sizeof(name), "%s %uK first-pass", pattern,
+                           size >> 10);
+        stats_print_summary(name, &w->first_summary);
+        vmlatency_snprintf(name, sizeof(name), "%s %uK second-pass", pattern,
+                           size >> 10);
+        stats_print_summary(name, &w->second_summary);
+}
+
+/* Guest walks the working set right after VM entry and then once more. The
+ * first pass pays for lines and translations evicted by the host and the
+ * transition, the second one shows the warm cost */
+void
+measure_vmlatency_workset(u32 count)
+{
+        workset_t w;
+        u32 max = vmx_config.workset_max;
+        size_t size, order_size = (max / VMX_WORKSET_LINE) * sizeof(u32);
+        u64 ws_size;
+
+        if (!count)
+                count = WORKSET_DEFAULT_SAMPLES;
+        size = (size_t)count * sizeof(u64);
+
+        w.count = count;
+        w.buffer = vmlatency_malloc(max);
+        w.order = vmlatency_malloc(order_size);
+        w.transition = vmlatency_malloc(size);
+        w.first_pass = vmlatency_malloc(size);
+        w.second_pass = vmlatency_malloc(size);
+        if (!w.buffer || !w.order || !w.transition || !w.first_pass ||
+            !w.second_pass) {
+                vmlatency_printk("Failed to allocate %u byte working set\n",
+                                 max);
+                goto out;
+        }
+
+        w.args.buffer = (uintptr_t)w.buffer;
+        w.args.stride = VMX_WORKSET_LINE;
+
+        for (ws_size = vmx_config.workset_min; ws_size <= max; ws_size *= 4) {
+                w.args.count = ws_size / VMX_WORKSET_LINE;
+
+                w.args.chase = 0;
+                if (!run_workset(&w))
+                        break;
+                report_workset(&w, (u32)ws_size);
+
+                build_chain(&w, (u32)w.args.count);
+                w.args.chase = 1;
+                if (!run_workset(&w))
+                        break;
+                report_workset(&w, (u32)ws_size);
+        }
+
+out:
+        if (w.second_pass)
+                vmlatency_free(w.second_pass, size);
+        if (w.first_pass)
+                vmlatency_free(w.first_pass, size);
+        if (w.transition)
+                vmlatency_free(w.transition, size);
+        if (w.order)
+                vmlatency_free(w.order, order_size);
+        if (w.buffer)
+                vmlatency_free(w.buffer, max);
+}
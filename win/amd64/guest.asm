@@ -15,11 +15,285 @@
 ; along with this program. If not, see <http://www.gnu.org/licenses/>.
 ;
 
-public guest_code
+public guest_code, guest_timestamps
+public guest_vmcall, guest_rdmsr, guest_wrmsr, guest_in, guest_out, guest_rdtsc
+public guest_rdpmc, guest_hlt, guest_invlpg, guest_mov_cr3, guest_mov_dr
+public guest_touch, guest_workset, guest_spin, guest_self_ipi
+public guest_kick, guest_vmread, guest_vmwrite, guest_vmread_exit
+public guest_vmwrite_exit, guest_vmfunc
 
 .code
 guest_code:
         cpuid  ; cause VM-exit
         ret
 
+; Store guest-side TSC right after VM entry and just before the exiting
+; instruction. RCX points to the timestamps page
+guest_timestamps:
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     qword ptr [rcx], rax      ; entry timestamp
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     qword ptr [rcx + 8], rax  ; exit timestamp
+        cpuid  ; cause VM-exit
+
+; Exiting instructions for VM exit matrix. Registers are loaded by
+; do_vmresume_regs. Every instruction is followed by CPUID, so if it does not
+; cause VM exit the host sees unexpected exit reason instead of the guest
+; running into the next payload
+guest_vmcall:
+        vmcall
+        cpuid
+
+guest_rdmsr:
+        rdmsr
+        cpuid
+
+guest_wrmsr:
+        wrmsr
+        cpuid
+
+guest_in:
+        in      al, 80h  ; IO_PORT_POST
+        cpuid
+
+guest_out:
+        out     80h, al  ; IO_PORT_POST
+        cpuid
+
+guest_rdtsc:
+        rdtsc
+        cpuid
+
+guest_rdpmc:
+        rdpmc
+        cpuid
+
+guest_hlt:
+        hlt
+        cpuid
+
+guest_invlpg:
+        invlpg  byte ptr [rbx]
+        cpuid
+
+guest_mov_cr3:
+        mov     cr3, rbx
+        cpuid
+
+guest_mov_dr:
+        mov     rax, dr7
+        cpuid
+
+; Load count quadwords from buffer with given stride and store TSC cycles
+; spent. RCX points to guest_touch_t
+guest_touch:
+        mov     r11, rcx
+        mov     r10, qword ptr [r11]       ; buffer
+        mov     rcx, qword ptr [r11 + 8]   ; count
+        mov     r8, qword ptr [r11 + 16]   ; stride
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     r9, rax
+guest_touch_loop:
+        mov     rax, qword ptr [r10]
+        add     r10, r8
+        dec     rcx
+        jnz     guest_touch_loop
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        sub     rax, r9
+        mov     qword ptr [r11 + 24], rax  ; cycles
+        cpuid  ; cause VM-exit
+
+; Walk working set twice and store TSC right after VM entry, cycles spent in
+; both passes and TSC before the exiting instruction. RCX points to
+; guest_workset_t. Guest has no stack, so both passes are unrolled
+guest_workset:
+        mov     r11, rcx
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     qword ptr [r11 + 32], rax  ; entry timestamp
+        mov     r9, rax
+
+        mov     r10, qword ptr [r11]       ; buffer
+        mov     rcx, qword ptr [r11 + 8]   ; count
+        mov     r8, qword ptr [r11 + 16]   ; stride
+        cmp     qword ptr [r11 + 24], 0    ; chase
+        jne     guest_workset_chase1
+guest_workset_seq1:
+        mov     rax, qword ptr [r10]
+        add     r10, r8
+        dec     rcx
+        jnz     guest_workset_seq1
+        jmp     guest_workset_pass2
+guest_workset_chase1:
+        mov     r10, qword ptr [r10]
+        dec     rcx
+        jnz     guest_workset_chase1
+guest_workset_pass2:
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     rdx, rax
+        sub     rax, r9
+        mov     qword ptr [r11 + 40], rax  ; first pass
+        mov     r9, rdx
+
+        mov     r10, qword ptr [r11]
+        mov     rcx, qword ptr [r11 + 8]
+        cmp     qword ptr [r11 + 24], 0
+        jne     guest_workset_chase2
+guest_workset_seq2:
+        mov     rax, qword ptr [r10]
+        add     r10, r8
+        dec     rcx
+        jnz     guest_workset_seq2
+        jmp     guest_workset_done
+guest_workset_chase2:
+        mov     r10, qword ptr [r10]
+        dec     rcx
+        jnz     guest_workset_chase2
+guest_workset_done:
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     qword ptr [r11 + 56], rax  ; exit timestamp
+        sub     rax, r9
+        mov     qword ptr [r11 + 48], rax  ; second pass
+        cpuid  ; cause VM-exit
+
+; Spin until an asynchronous event, e.g. VMX-preemption timer, causes VM
+; exit
+guest_spin:
+        pause
+        jmp     guest_spin
+
+; Store TSC and send self-IPI with the vector through x2APIC, then spin until
+; the interrupt causes VM exit. RCX points to guest_ipi_t
+guest_self_ipi:
+        mov     r11, rcx
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     qword ptr [r11 + 8], rax  ; send timestamp
+        mov     rax, qword ptr [r11]      ; vector
+        xor     edx, edx
+        mov     ecx, 83fh                 ; X2APIC_SELF_IPI
+        wrmsr
+guest_self_ipi_spin:
+        pause
+        jmp     guest_self_ipi_spin
+
+; Tell other CPUs that the guest runs by copying sequence number and spin
+; until an interrupt causes VM exit. RCX points to guest_kick_t
+guest_kick:
+        mov     rax, qword ptr [rcx + 8]  ; seq
+        mov     qword ptr [rcx], rax      ; in_guest
+guest_kick_spin:
+        pause
+        jmp     guest_kick_spin
+
+; Execute count VMREADs of the field and store TSC cycles spent. With VMCS
+; shadowing they access the shadow VMCS without VM exit. RCX points to
+; guest_vmaccess_t
+guest_vmread:
+        mov     r11, rcx
+        mov     r10, qword ptr [r11]       ; field
+        mov     rcx, qword ptr [r11 + 8]   ; count
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     r9, rax
+guest_vmread_loop:
+        vmread  r8, r10
+        dec     rcx
+        jnz     guest_vmread_loop
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        sub     rax, r9
+        mov     qword ptr [r11 + 24], rax  ; cycles
+        cpuid  ; cause VM-exit
+
+; Same as guest_vmread for VMWRITEs of the value
+guest_vmwrite:
+        mov     r11, rcx
+        mov     r10, qword ptr [r11]       ; field
+        mov     rcx, qword ptr [r11 + 8]   ; count
+        mov     r8, qword ptr [r11 + 16]   ; value
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     r9, rax
+guest_vmwrite_loop:
+        vmwrite r10, r8
+        dec     rcx
+        jnz     guest_vmwrite_loop
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        sub     rax, r9
+        mov     qword ptr [r11 + 24], rax  ; cycles
+        cpuid  ; cause VM-exit
+
+; Single VMREAD or VMWRITE expected to cause VM exit. Guest registers are
+; not preserved, so the field is loaded on every VM entry
+guest_vmread_exit:
+        mov     r10, qword ptr [rcx]
+        vmread  r8, r10
+        cpuid
+
+guest_vmwrite_exit:
+        mov     r10, qword ptr [rcx]
+        mov     r8, qword ptr [rcx + 16]
+        vmwrite r10, r8
+        cpuid
+
+; Switch EPT views with VMFUNC leaf 0 and store TSC cycles spent. RCX points
+; to guest_vmfunc_t. VMFUNC takes the view index in ECX
+guest_vmfunc:
+        mov     r8, rcx
+        mov     r10, qword ptr [r8]        ; view mask
+        mov     r11, qword ptr [r8 + 8]    ; count
+        xor     esi, esi                   ; view index
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     r9, rax
+guest_vmfunc_loop:
+        inc     esi
+        and     esi, r10d
+        mov     ecx, esi
+        xor     eax, eax                   ; EPTP switching
+        db      0fh, 01h, 0d4h             ; vmfunc
+        dec     r11
+        jnz     guest_vmfunc_loop
+        lfence
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        sub     rax, r9
+        mov     qword ptr [r8 + 16], rax   ; cycles
+        cpuid  ; cause VM-exit
+
 end
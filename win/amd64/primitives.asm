@@ -15,9 +15,10 @@
 ; along with this program. If not, see <http://www.gnu.org/licenses/>.
 ;
 
-public _disable
+public _disable, _enable
 public __get_gdt, __set_gdt, __sldt, __lar, __str
 public __get_es, __get_cs, __get_ss, __get_ds, __get_fs, __get_gs, __get_ds
+public __invept, __invvpid
 
 .code
 
@@ -26,6 +27,11 @@ _disable:
         cli
         ret
 
+; void _enable(void);
+_enable:
+        sti
+        ret
+
 ; void __get_gdt(descriptor_t *gdtr);
 __get_gdt:
         sgdt fword ptr [rcx]
@@ -51,6 +57,16 @@ __str:
         str rax
         ret
 
+; void __invept(u64 type, const invept_desc_t *desc);
+__invept:
+        db 66h, 0fh, 38h, 80h, 0ah  ; invept rcx, oword ptr [rdx]
+        ret
+
+; void __invvpid(u64 type, const invvpid_desc_t *desc);
+__invvpid:
+        db 66h, 0fh, 38h, 81h, 0ah  ; invvpid rcx, oword ptr [rdx]
+        ret
+
 ; u16 __get_es(void);
 __get_es:
         mov rax, es
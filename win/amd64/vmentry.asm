@@ -15,12 +15,22 @@
 ; along with this program. If not, see <http://www.gnu.org/licenses/>.
 ;
 
-public do_vmlaunch, do_vmresume, vmx_exit
+public do_vmlaunch, do_vmresume, do_vmresume_arg, do_vmresume_regs, vmx_exit
+public do_vmresume_nop
 
 .const
 VMCS_HOST_RSP equ 6c14H
 
 vmentry_prepare macro
+        ; save callee-saved registers, guest code is free to clobber them
+        push    rbx
+        push    rbp
+        push    rdi
+        push    rsi
+        push    r12
+        push    r13
+        push    r14
+        push    r15
         ; save stack pointer
         mov     rax, VMCS_HOST_RSP
         vmwrite rax, rsp
@@ -33,8 +43,25 @@ do_vmlaunch:
         jmp entry_error
 
 do_vmresume:
+do_vmresume_arg:
         vmentry_prepare
         vmresume
+        jmp entry_error
+
+; Same code path as do_vmresume without the transition, used to calibrate
+; call overhead
+do_vmresume_nop:
+        vmentry_prepare
+        jmp vmx_exit
+
+; Load guest general purpose registers from guest_regs_t before entry
+do_vmresume_regs:
+        vmentry_prepare
+        mov     rax, qword ptr [rcx]
+        mov     rbx, qword ptr [rcx + 8]
+        mov     rdx, qword ptr [rcx + 24]
+        mov     rcx, qword ptr [rcx + 16]
+        vmresume
         ; fall through
 
 entry_error:
@@ -45,6 +72,14 @@ vmx_exit:
         xor rax, rax  ; return 0
 
 vmx_return:
+        pop     r15
+        pop     r14
+        pop     r13
+        pop     r12
+        pop     rsi
+        pop     rdi
+        pop     rbp
+        pop     rbx
         ret
 
 end
\ No newline at end of file
@@ -26,8 +26,11 @@
 #define MAX_MSG_SZ     (ERROR_LOG_MAXIMUM_SIZE - sizeof(IO_ERROR_LOG_PACKET))
 #define MAX_MSG_CH     (MAX_MSG_SZ / sizeof(WCHAR))
 
+#define VMLATENCY_POOL_TAG 'tlmv'
+
 #ifndef _M_IX86
 extern void _disable(void);
+extern void _enable(void);
 #endif
 
 void
@@ -61,6 +64,17 @@ vmlatency_printm(const char *fmt, ...)
         va_end(va);
 }
 
+int
+vmlatency_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+        NTSTATUS status;
+        va_list va;
+        va_start(va, fmt);
+        status = RtlStringCbVPrintfA(buf, size, fmt, va);
+        va_end(va);
+        return NT_SUCCESS(status) ? (int)strlen(buf) : -1;
+}
+
 void
 vmlatency_preempt_disable(irq_flags_t *irq_flags)
 {
@@ -108,3 +122,103 @@ free_vmpage(vmpage_t *p)
         p->p = NULL;
         p->pa = 0;
 }
+
+void *
+vmlatency_malloc(size_t size)
+{
+        void *p = ExAllocatePoolWithTag(NonPagedPool, size, VMLATENCY_POOL_TAG);
+        if (p)
+                RtlZeroMemory(p, size);
+        return p;
+}
+
+void
+vmlatency_free(void *p, size_t size)
+{
+        ExFreePoolWithTag(p, VMLATENCY_POOL_TAG);
+}
+
+void *
+vmlatency_malloc_user(size_t size)
+{
+        return vmlatency_malloc(size);
+}
+
+int
+vmlatency_cpu_count(void)
+{
+        return KeQueryActiveProcessorCount(NULL);
+}
+
+bool
+vmlatency_cpu_online(int cpu)
+{
+        return cpu < vmlatency_cpu_count();
+}
+
+int
+vmlatency_cpu_id(void)
+{
+        return KeGetCurrentProcessorNumber();
+}
+
+int
+vmlatency_cpu_node(int cpu)
+{
+        return -1;
+}
+
+int
+vmlatency_run_on_cpu(int cpu, int (*fn)(void *arg), void *arg)
+{
+        int ret;
+        KAFFINITY old = KeSetSystemAffinityThreadEx((KAFFINITY)1 << cpu);
+        ret = fn(arg);
+        KeRevertToUserAffinityThreadEx(old);
+        return ret;
+}
+
+int
+vmlatency_run_on_all_cpus(int (*fn)(void *arg), void *arg)
+{
+        return -1;
+}
+
+void
+vmlatency_yield(void)
+{
+        LARGE_INTEGER interval;
+        interval.QuadPart = 0;
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+}
+
+int
+vmlatency_ipi_vector(void)
+{
+        return -1;
+}
+
+void
+vmlatency_irq_window(void)
+{
+        _enable();
+        __nop();
+        _disable();
+}
+
+u64
+vmlatency_time_ns(void)
+{
+        LARGE_INTEGER freq;
+        LARGE_INTEGER cnt = KeQueryPerformanceCounter(&freq);
+        return (cnt.QuadPart / freq.QuadPart) * 1000000000ull
+               + (cnt.QuadPart % freq.QuadPart) * 1000000000ull
+                 / freq.QuadPart;
+}
+
+u64
+vmlatency_nmi_count(void)
+{
+        /* NMI statistics are not exported by the kernel */
+        return 0;
+}
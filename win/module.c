@@ -60,6 +60,8 @@ VOID
 VmlatencyUnloadDriver(__in PDRIVER_OBJECT DriverObject) {
         PDEVICE_OBJECT deviceObject = DriverObject->DeviceObject;
 
+        vmm_free_all();
+
         if (deviceObject != NULL)
                 IoDeleteDevice(deviceObject);
         g_Device = NULL;